@@ -0,0 +1,145 @@
+#!/bin/sh
+#
+# Synthetic benchmark of the pg_orphaned scans
+#
+# Creates a throwaway cluster with BENCH_RELATIONS relations spread over
+# the default tablespace and BENCH_TABLESPACES tablespaces, adds
+# BENCH_ORPHANS synthetic orphaned relfilenodes (sparse files made with
+# truncate, with segments, forks and temp relations), then runs each
+# pg_orphaned function and reports, per run, the elapsed time and the
+# counters of pg_orphaned_last_scan_stats().
+#
+# Usage: make bench [PG_CONFIG=...]
+#        BENCH_RELATIONS=100000 BENCH_ORPHANS=50000 make bench
+#
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$($PG_CONFIG --bindir)
+RELATIONS=${BENCH_RELATIONS:-10000}
+ORPHANS=${BENCH_ORPHANS:-10000}
+TABLESPACES=${BENCH_TABLESPACES:-2}
+RUNS=${BENCH_RUNS:-3}
+PORT=${BENCH_PORT:-54329}
+
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/pg_orphaned_bench.XXXXXX")
+PGDATA=$WORKDIR/data
+export PGHOST=$WORKDIR PGPORT=$PORT PGDATABASE=postgres
+
+cleanup()
+{
+	"$BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+psql()
+{
+	"$BINDIR/psql" -X -q -v ON_ERROR_STOP=1 "$@"
+}
+
+echo "# pg_orphaned benchmark: $RELATIONS relations, $ORPHANS orphaned relfilenodes, $TABLESPACES tablespaces"
+
+"$BINDIR/initdb" -D "$PGDATA" -A trust --no-sync >/dev/null
+cat >> "$PGDATA/postgresql.conf" <<EOF
+port = $PORT
+listen_addresses = ''
+unix_socket_directories = '$WORKDIR'
+shared_preload_libraries = 'pg_orphaned'
+max_worker_processes = 16
+fsync = off
+max_locks_per_transaction = 1024
+EOF
+"$BINDIR/pg_ctl" -D "$PGDATA" -l "$WORKDIR/log" -w start >/dev/null
+
+psql -c "CREATE EXTENSION pg_orphaned"
+
+i=1
+while [ $i -le "$TABLESPACES" ]; do
+	mkdir "$WORKDIR/ts$i"
+	psql -c "CREATE TABLESPACE bench_ts$i LOCATION '$WORKDIR/ts$i'"
+	i=$((i + 1))
+done
+
+# the relations, one transaction each
+psql <<EOF
+SELECT format('CREATE TABLE bench_%s (id int, t text) %s', i,
+			  CASE WHEN $TABLESPACES > 0 AND i % ($TABLESPACES + 1) <> 0
+				   THEN 'TABLESPACE bench_ts' || (i % ($TABLESPACES + 1)) END)
+FROM generate_series(1, $RELATIONS) i \gexec
+CHECKPOINT;
+EOF
+
+# where the relation files of the database are
+DBOID=$(psql -At -c "SELECT oid FROM pg_database WHERE datname = current_database()")
+DIRS="$PGDATA/base/$DBOID"
+for ts in $(psql -At -c "SELECT oid FROM pg_tablespace WHERE spcname LIKE 'bench_ts%'"); do
+	DIRS="$DIRS $(echo "$PGDATA"/pg_tblspc/$ts/PG_*/$DBOID)"
+done
+
+# the synthetic orphaned files: sparse, with relfilenodes no relation uses
+perl -e '
+	my ($n, @dirs) = @ARGV;
+	for my $i (1 .. $n)
+	{
+		my $dir = $dirs[$i % scalar(@dirs)];
+		my $rfn = 3000000000 + $i;
+		my @files;
+
+		if ($i % 20 == 0) { @files = ("t3_$rfn"); }
+		else
+		{
+			@files = ("$rfn");
+			push @files, "$rfn.1", "$rfn.2" if $i % 10 == 0;
+			push @files, "${rfn}_fsm", "${rfn}_vm" if $i % 5 == 0;
+		}
+		for my $f (@files)
+		{
+			open(my $fh, ">", "$dir/$f") or die "$dir/$f: $!";
+			truncate($fh, $f =~ /\.\d+$/ ? 1073741824 : 8192 * (1 + $i % 128)) or die $!;
+			close($fh);
+		}
+	}' "$ORPHANS" $DIRS
+
+psql -c "CHECKPOINT"
+
+# one line per run: elapsed time and the counters of the scan, after an
+# optional unmeasured warm-up query run in the same session
+run()
+{
+	label=$1
+	settings=$2
+	query=$3
+	warmup=${4:-SELECT 1}
+
+	r=1
+	while [ $r -le "$RUNS" ]; do
+		psql -At -F ' ' <<EOF
+$settings
+SELECT count(*) AS warmup FROM ($warmup) q \gset
+SELECT clock_timestamp() AS start \gset
+SELECT count(*) AS rows FROM ($query) q \gset
+SELECT format('%-40s run %s  %8s ms  rows %s  %s  hit rate %s%%',
+			  '$label', $r,
+			  round(extract(epoch FROM clock_timestamp() - :'start'::timestamptz) * 1000, 1),
+			  :rows,
+			  string_agg(name || ' ' || value, '  ' ORDER BY ord),
+			  round(100.0 * max(value) FILTER (WHERE name = 'cache_hits') /
+					nullif(sum(value) FILTER (WHERE name IN ('cache_hits', 'catalog_probes')), 0), 1))
+FROM pg_orphaned_last_scan_stats() WITH ORDINALITY AS s(name, value, ord)
+WHERE name IN ('directories', 'files', 'stat_calls', 'stat_calls_saved',
+			   'catalog_probes', 'cache_hits', 'orphaned', 'peak_memory');
+EOF
+		r=$((r + 1))
+	done
+}
+
+run "pg_list_orphaned (probe)" "SET pg_orphaned.catalog_lookup = probe;" "SELECT * FROM pg_list_orphaned()"
+run "pg_list_orphaned (bulk)" "SET pg_orphaned.catalog_lookup = bulk;" "SELECT * FROM pg_list_orphaned()"
+run "pg_list_orphaned (auto)" "" "SELECT * FROM pg_list_orphaned()"
+run "pg_list_orphaned (parallel tablespace)" "SET pg_orphaned.parallel_scan = tablespace;" "SELECT * FROM pg_list_orphaned()"
+run "pg_list_orphaned (incremental)" "SET pg_orphaned.incremental = on;" "SELECT * FROM pg_list_orphaned()" "SELECT * FROM pg_list_orphaned()"
+run "pg_list_orphaned (shared cache)" "SET pg_orphaned.shared_cache = on; SET pg_orphaned.catalog_lookup = probe;" "SELECT * FROM pg_list_orphaned()"
+run "pg_orphaned_summary" "" "SELECT * FROM pg_orphaned_summary()"
+run "pg_list_orphaned_cluster" "" "SELECT * FROM pg_list_orphaned_cluster()"
@@ -0,0 +1,210 @@
+-- the functions whose arguments or result changed
+DROP FUNCTION pg_list_orphaned(interval);
+DROP FUNCTION pg_move_orphaned(interval);
+DROP FUNCTION pg_remove_moved_orphaned();
+
+CREATE FUNCTION pg_list_orphaned(
+	older_than interval default null,
+	tablespaces oid[] default null,
+	min_size bigint default null,
+	min_age interval default null,
+	OUT dbname text,
+	OUT path text,
+	OUT name text,
+	OUT size bigint,
+	OUT mod_time timestamptz,
+	OUT relfilenode bigint,
+	OUT reloid bigint,
+	OUT older bool)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_list_orphaned'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_list_orphaned_cluster(
+	older_than interval default null,
+	OUT dbname text,
+	OUT path text,
+	OUT name text,
+	OUT size bigint,
+	OUT mod_time timestamptz,
+	OUT relfilenode bigint,
+	OUT reloid bigint,
+	OUT older bool)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_list_orphaned_cluster'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_cached(
+	older_than interval default null,
+	OUT dbname text,
+	OUT path text,
+	OUT name text,
+	OUT size bigint,
+	OUT mod_time timestamptz,
+	OUT relfilenode bigint,
+	OUT reloid bigint,
+	OUT older bool,
+	OUT scanned_at timestamptz,
+	OUT age interval)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_cached'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_cached_tablespaces(
+	OUT dbname text,
+	OUT reltablespace oid,
+	OUT files bigint,
+	OUT size bigint,
+	OUT scanned_at timestamptz,
+	OUT age interval)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_cached_tablespaces'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_last_scan_stats(
+	OUT name text,
+	OUT value bigint)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_last_scan_stats'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_last_scan_tablespaces(
+	OUT reltablespace oid,
+	OUT directories bigint,
+	OUT entries bigint,
+	OUT files bigint,
+	OUT orphaned bigint,
+	OUT orphaned_size bigint,
+	OUT elapsed_time bigint)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_last_scan_tablespaces'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_progress_info(
+	OUT pid int,
+	OUT datid oid,
+	OUT command text,
+	OUT phase text,
+	OUT reltablespace oid,
+	OUT directories_done bigint,
+	OUT directories_total bigint,
+	OUT files bigint,
+	OUT orphaned bigint,
+	OUT bytes bigint)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_progress_info'
+LANGUAGE C VOLATILE;
+
+CREATE VIEW pg_orphaned_progress AS
+	SELECT * FROM pg_orphaned_progress_info();
+
+CREATE FUNCTION pg_orphaned_summary(
+	older_than interval default null,
+	top_n int default 10,
+	OUT kind text,
+	OUT reltablespace oid,
+	OUT relfilenode bigint,
+	OUT files bigint,
+	OUT size bigint,
+	OUT older_size bigint,
+	OUT oldest_mod_time timestamptz,
+	OUT newest_mod_time timestamptz)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_summary'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_scan_step(
+	max_files int default 10000,
+	max_ms int default 1000,
+	older_than interval default null,
+	OUT dbname text,
+	OUT path text,
+	OUT name text,
+	OUT size bigint,
+	OUT mod_time timestamptz,
+	OUT relfilenode bigint,
+	OUT reloid bigint,
+	OUT older bool)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_scan_step'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_scan_position(
+	OUT reltablespace oid,
+	OUT relfilenode bigint,
+	OUT started_at timestamptz,
+	OUT updated_at timestamptz,
+	OUT steps bigint,
+	OUT passes bigint)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_scan_position'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_scan_reset()
+    RETURNS void
+    LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_orphaned_scan_reset';
+
+CREATE FUNCTION pg_orphaned_snapshot(name text default null)
+    RETURNS text
+    LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_orphaned_snapshot';
+
+CREATE FUNCTION pg_orphaned_diff(
+	manifest_a text,
+	manifest_b text,
+	OUT change text,
+	OUT reltablespace oid,
+	OUT relfilenode bigint,
+	OUT backend int,
+	OUT fork text,
+	OUT segno bigint,
+	OUT previous_size bigint,
+	OUT previous_mod_time timestamptz,
+	OUT size bigint,
+	OUT mod_time timestamptz)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_diff'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_manifests(
+	OUT name text,
+	OUT created_at timestamptz,
+	OUT entries bigint)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME','pg_orphaned_manifests'
+LANGUAGE C VOLATILE;
+
+CREATE FUNCTION pg_orphaned_drop_manifest(name text)
+    RETURNS void
+    LANGUAGE c STRICT
+AS 'MODULE_PATHNAME', 'pg_orphaned_drop_manifest';
+
+CREATE FUNCTION pg_move_orphaned(older_than interval default null, durable bool default false)
+    RETURNS int
+    LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_move_orphaned';
+
+CREATE FUNCTION pg_remove_moved_orphaned()
+    RETURNS bigint
+    LANGUAGE c
+AS 'MODULE_PATHNAME', 'pg_remove_moved_orphaned';
+
+revoke execute on function pg_list_orphaned(older_than interval, tablespaces oid[], min_size bigint, min_age interval) from public;
+revoke execute on function pg_list_orphaned_cluster(older_than interval) from public;
+revoke execute on function pg_orphaned_cached(older_than interval) from public;
+revoke execute on function pg_orphaned_cached_tablespaces() from public;
+revoke execute on function pg_orphaned_last_scan_stats() from public;
+revoke execute on function pg_orphaned_last_scan_tablespaces() from public;
+revoke execute on function pg_orphaned_progress_info() from public;
+revoke all on pg_orphaned_progress from public;
+revoke execute on function pg_orphaned_summary(older_than interval, top_n int) from public;
+revoke execute on function pg_orphaned_scan_step(max_files int, max_ms int, older_than interval) from public;
+revoke execute on function pg_orphaned_scan_position() from public;
+revoke execute on function pg_orphaned_scan_reset() from public;
+revoke execute on function pg_orphaned_snapshot(name text) from public;
+revoke execute on function pg_orphaned_diff(manifest_a text, manifest_b text) from public;
+revoke execute on function pg_orphaned_manifests() from public;
+revoke execute on function pg_orphaned_drop_manifest(name text) from public;
+revoke execute on function pg_move_orphaned(older_than interval, durable bool) from public;
+revoke execute on function pg_remove_moved_orphaned() from public;
@@ -15,25 +15,31 @@
 #include "utils/builtins.h"
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#ifdef USE_PGORPH_URING
+#include <liburing.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #if PG_VERSION_NUM < 190000
 #include "commands/dbcommands.h"
 #else
 #include "access/htup_details.h"
 #include "utils/lsyscache.h"
 #endif
-#include "regex/regex.h"
 #include "storage/fd.h"
 #include "utils/hsearch.h"
 #include "utils/tuplestore.h"
 
 #if PG_VERSION_NUM < 110000
-#include "catalog/pg_collation.h"
 #include "catalog/catalog.h"
 #include "utils/memutils.h"
 #include "catalog/pg_tablespace.h"
 #define pg_dir_create_mode S_IRWXU
+#define pg_file_create_mode (S_IRUSR | S_IWUSR)
 #else
-#include "catalog/pg_collation_d.h"
 #include "catalog/pg_tablespace_d.h"
 #include "common/file_perm.h"
 #include "utils/rel.h"
@@ -43,7 +49,50 @@
 #include "utils/fmgroids.h"
 #include "utils/relmapper.h"
 #include "catalog/indexing.h"
+#include "catalog/pg_class.h"
+#include "common/relpath.h"
 #include "utils/inval.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "storage/bufmgr.h"
+#include "access/xact.h"
+#include "lib/stringinfo.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "tcop/tcopprot.h"
+#include "catalog/pg_database.h"
+#include "utils/syscache.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+#include "lib/binaryheap.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "utils/array.h"
+#include "catalog/pg_type.h"
+#include "pgtime.h"
+#include "storage/procarray.h"
+#if PG_VERSION_NUM < 170000
+#include "storage/sinvaladt.h"
+#endif
+
+#ifndef PG_TEMP_FILES_DIR
+#define PG_TEMP_FILES_DIR "pgsql_tmp"
+#endif
+#ifndef PG_TEMP_FILE_PREFIX
+#define PG_TEMP_FILE_PREFIX "pgsql_tmp"
+#endif
+
+/* the shared relfilenode cache needs dshash */
+#if PG_VERSION_NUM >= 110000
+#include "lib/dshash.h"
+#define PGORPH_SHARED_CACHE
+#endif
 
 #if PG_VERSION_NUM >= 120000
 #include "access/table.h"
@@ -53,13 +102,27 @@
 #include "utils/tqual.h"
 #include "access/htup_details.h"
 #endif
-#define NUMBER_SUFFIXES 2
-#define MAX_SUFFIX_SIZE 5
+#define PGORPH_MAX_PARALLEL_WORKERS 64
+#define PGORPH_QUEUE_SIZE 65536
+
+#if PG_VERSION_NUM >= 140000
+#define PGORPH_HASH_STRINGS HASH_STRINGS
+#else
+#define PGORPH_HASH_STRINGS 0
+#endif
+
+#if PG_VERSION_NUM >= 120000
+#define PGORPH_WL_FLAGS (WL_LATCH_SET | WL_EXIT_ON_PM_DEATH)
+#else
+#define PGORPH_WL_FLAGS (WL_LATCH_SET | WL_POSTMASTER_DEATH)
+#endif
 
 #include "catalog/pg_control.h"
 #include "common/controldata_utils.h"
 
 PG_MODULE_MAGIC;
+void _PG_init(void);
+
 Datum pg_list_orphaned(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(pg_list_orphaned);
 
@@ -75,30 +138,224 @@ Datum pg_remove_moved_orphaned(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(pg_move_back_orphaned);
 Datum pg_move_back_orphaned(PG_FUNCTION_ARGS);
 
+Datum pg_list_orphaned_cluster(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_list_orphaned_cluster);
+
+Datum pg_orphaned_cached(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_cached);
+
+Datum pg_orphaned_cached_tablespaces(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_cached_tablespaces);
+
+Datum pg_orphaned_last_scan_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_last_scan_stats);
+Datum pg_orphaned_last_scan_tablespaces(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_last_scan_tablespaces);
+Datum pg_orphaned_progress_info(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_progress_info);
+Datum pg_orphaned_scan_step(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_scan_step);
+Datum pg_orphaned_scan_position(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_scan_position);
+Datum pg_orphaned_scan_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_scan_reset);
+Datum pg_orphaned_snapshot(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_snapshot);
+Datum pg_orphaned_diff(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_diff);
+Datum pg_orphaned_manifests(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_manifests);
+Datum pg_orphaned_drop_manifest(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_drop_manifest);
+
+Datum pg_orphaned_summary(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_orphaned_summary);
+
+PGDLLEXPORT void pgorph_scan_worker_main(Datum main_arg);
+PGDLLEXPORT void pgorph_cluster_worker_main(Datum main_arg);
+PGDLLEXPORT void pgorph_launcher_main(Datum main_arg);
+PGDLLEXPORT void pgorph_daemon_main(Datum main_arg);
+
 static bool made_directory = false;
 static bool found_existing_directory = false;
 static char *orphaned_backup_dir= "orphaned_backup";
 static Timestamp limitts;
 static TimestampTz last_checkpoint_time;
 
-static List   *list_orphaned_relations=NULL;
-static void pg_list_orphaned_internal(FunctionCallInfo fcinfo);
-static void search_orphaned(List **flist, Oid dboid, const char *dbname, const char *dir, Oid reltablespace);
-static void pg_build_orphaned_list(Oid dbOid, bool restore);
+static Tuplestorestate *pgorph_begin_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+struct PgOrphSink;
+static void search_orphaned(struct PgOrphSink *sink, Oid dboid, const char *dbname, const char *dir, Oid reltablespace);
+static void search_spill_files(struct PgOrphSink *sink, const char *dbname, const char *dir,
+							   bool restore);
+static void pgorph_spill_dir_usage(const char *path, int64 *size, TimestampTz *mod_time);
+struct PgOrphScanDir;
+static void pgorph_scan_dir(struct PgOrphSink *sink, Oid dboid, const char *dbname, struct PgOrphScanDir *sdir);
+static void pg_build_orphaned_list(Oid dbOid, bool restore, struct PgOrphSink *sink);
 static void verify_dir_is_empty_or_create(char *dirname, bool *created, bool *found, bool display_hint);
 static int pg_orphaned_mkdir_p(char *path, int omode);
 static int pg_orphaned_check_dir(const char *dir);
 static void requireSuperuser(void);
 static Oid RelidByRelfilenodeDirty(Oid reltablespace, Oid relfilenode);
+static Oid RelidByRelfilenodeDirtyProbe(Oid reltablespace, Oid relfilenode);
 static void InitializeRelfilenodeMapDirty(void);
+static void pgorph_init_lookup(void);
+static void pgorph_bulk_load_relfilenodes(void);
+static bool pgorph_bulk_miss_needs_probe(TimestampTz mod_time);
 static bool is_directory_empty(const char *path);
 
-/* Hash table for information about each relfilenode <-> oid pair */
-static HTAB *RelfilenodeMapHashDirty = NULL;
-
 /* built first time through in InitializeRelfilenodeMap */
 static ScanKeyData relfilenode_skey_dirty[2];
 
+/*
+ * How the relfilenodes found on disk are checked against pg_class:
+ * probe does one index lookup per file, bulk loads all the pg_class
+ * relfilenodes in one pass and auto switches from probe to bulk once
+ * the number of probes makes the pg_class scan the cheaper option.
+ */
+typedef enum
+{
+	PGORPH_LOOKUP_AUTO,
+	PGORPH_LOOKUP_BULK,
+	PGORPH_LOOKUP_PROBE
+} PgOrphLookupMode;
+
+static const struct config_enum_entry pgorph_lookup_options[] = {
+	{"auto", PGORPH_LOOKUP_AUTO, false},
+	{"bulk", PGORPH_LOOKUP_BULK, false},
+	{"probe", PGORPH_LOOKUP_PROBE, false},
+	{NULL, 0, false}
+};
+
+static int pgorph_lookup_mode = PGORPH_LOOKUP_AUTO;
+static bool pgorph_shared_cache = false;
+static int pgorph_shared_cache_max_entries = 1000000;
+
+/*
+ * Directories can be scanned by dynamic background workers, either one
+ * worker per tablespace or one worker per device.
+ */
+typedef enum
+{
+	PGORPH_PARALLEL_OFF,
+	PGORPH_PARALLEL_TABLESPACE,
+	PGORPH_PARALLEL_DEVICE
+} PgOrphParallelMode;
+
+static const struct config_enum_entry pgorph_parallel_options[] = {
+	{"off", PGORPH_PARALLEL_OFF, false},
+	{"tablespace", PGORPH_PARALLEL_TABLESPACE, false},
+	{"device", PGORPH_PARALLEL_DEVICE, false},
+	{NULL, 0, false}
+};
+
+static int pgorph_parallel_mode = PGORPH_PARALLEL_OFF;
+static int pgorph_max_parallel_workers = 4;
+
+/*
+ * How the orphaned file candidates are stat'ed: one fstatat() after the
+ * other, or a batch of statx submitted at once through io_uring (when
+ * built with liburing).
+ */
+typedef enum
+{
+	PGORPH_STAT_SYNC,
+	PGORPH_STAT_IO_URING
+} PgOrphStatMethod;
+
+static const struct config_enum_entry pgorph_stat_method_options[] = {
+	{"sync", PGORPH_STAT_SYNC, false},
+#ifdef USE_PGORPH_URING
+	{"io_uring", PGORPH_STAT_IO_URING, false},
+#endif
+	{NULL, 0, false}
+};
+
+#ifdef USE_PGORPH_URING
+static int pgorph_stat_method = PGORPH_STAT_IO_URING;
+#else
+static int pgorph_stat_method = PGORPH_STAT_SYNC;
+#endif
+
+/* candidates stat'ed at once */
+#define PGORPH_STAT_BATCH 64
+/* candidates of a directory after which they are reported */
+#define PGORPH_PENDING_FLUSH 8192
+#define PGORPH_URING_DEPTH 256
+
+/*
+ * Removal of the moved orphaned files: the files are shrunk by steps of
+ * pg_orphaned.remove_truncate_step before being unlinked, and the
+ * removal sleeps as vacuum's cost delay does once the bytes freed since
+ * the last sleep exceed what pg_orphaned.remove_rate_limit allows for
+ * PGORPH_REMOVE_DELAY_MS.
+ */
+#define PGORPH_REMOVE_DELAY_MS 10
+#define PGORPH_REMOVE_PROGRESS_MS 10000
+static int pgorph_remove_rate_limit = 0;	/* kB/s, 0 disables the throttling */
+static int pgorph_remove_truncate_step = 64;	/* MB */
+
+typedef struct PgOrphRemoveState
+{
+	int64		files;			/* files to remove */
+	int64		bytes;			/* bytes to free */
+	int64		removed;
+	int64		freed;
+	int64		balance;		/* bytes freed since the last sleep */
+	TimestampTz last_report;
+} PgOrphRemoveState;
+
+static char *pgorph_backup_path(const char *path, Oid dbOid);
+static char *pgorph_original_path(const char *path);
+static List *pgorph_backup_roots(Oid dbOid, bool existing);
+static HTAB *pgorph_durable_begin(void);
+static void pgorph_durable_add(HTAB *touched, const char *dir, bool with_parents);
+static void pgorph_durable_end(HTAB *touched);
+static void pgorph_fsync_path(const char *path, bool isdir);
+static int	pgorph_fsync(int fd);
+static void pgorph_remove_collect(const char *path, List **files, PgOrphRemoveState *state);
+static void pgorph_remove_file(const char *path, int64 size, PgOrphRemoveState *state);
+static void pgorph_remove_delay(PgOrphRemoveState *state, int64 bytes);
+static void pgorph_remove_report(PgOrphRemoveState *state);
+
+/*
+ * Moves across filesystems: the file is cloned if the filesystems share
+ * their blocks, else copied in the kernel by chunks of PGORPH_COPY_CHUNK
+ * (so that the copy can be interrupted), else copied through a buffer.
+ */
+#define PGORPH_COPY_CHUNK (8 * 1024 * 1024)
+#define PGORPH_COPY_BUFFER (1024 * 1024)
+#if defined(HAVE_COPY_FILE_RANGE) || \
+	(defined(__linux__) && defined(__GLIBC__) && \
+	 (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27)))
+#define PGORPH_HAVE_COPY_FILE_RANGE
+#endif
+
+static void pgorph_move_file(const char *from, const char *to, bool durable);
+static void pgorph_copy_file(const char *from, const char *to);
+static void pgorph_copy_data(const char *from, const char *tmp);
+
+/* background scanner */
+static int pgorph_scan_interval = 0;
+static char *pgorph_scan_database = NULL;
+
+/*
+ * A probe costs a lock acquisition and a btree descent, roughly the
+ * price of reading a few heap pages, so auto switches to the bulk load
+ * once the probes outnumber a quarter of the pg_class pages.
+ */
+#define PGORPH_PAGES_PER_PROBE 4
+#define PGORPH_MIN_BULK_THRESHOLD 64
+
+/*
+ * Set once the whole pg_class has been loaded into the cache during the
+ * current scan: any relfilenode missing from the cache is then known not
+ * to be in pg_class (only the relmapper still needs to be checked).
+ */
+static bool RelfilenodeMapDirtyComplete = false;
+static TimestampTz pgorph_bulk_loaded_at = 0;
+static int64 pgorph_nprobes = 0;
+static int64 pgorph_bulk_threshold = 0;
+
 typedef struct
 {
 	Oid                     reltablespace;
@@ -109,19 +366,756 @@ typedef struct
 {
 	RelfilenodeMapKeyDirty key;          /* lookup key - must be first */
 	Oid                     relid;                  /* pg_class.oid */
+	char		status;			/* used by simplehash */
+	uint64		gen;			/* pgorph_rfn_reset_gen, or for a negative
+								 * entry pgorph_rfn_inval_gen, when entered */
 } RelfilenodeMapEntryDirty;
 
+/* the key of the relfilenode cached for a relid, to invalidate it */
+typedef struct
+{
+	Oid			relid;
+	char		status;			/* used by simplehash */
+	uint64		gen;			/* pgorph_rfn_reset_gen when entered */
+	RelfilenodeMapKeyDirty key;
+} PgOrphRelidEntry;
+
+/*
+ * The relfilenode cache is an open addressing table specialized for its
+ * key, with a relid to key reverse index: invalidating one relation only
+ * removes its entry. The generations make a complete reset, and the
+ * invalidation of the negative entries (any new relation may match one),
+ * free: the stale entries are just ignored, then replaced.
+ */
+static uint64 pgorph_rfn_reset_gen = 0;
+static uint64 pgorph_rfn_inval_gen = 0;
+
+static inline uint32
+pgorph_hash_oid(Oid oid)
+{
+	/* murmurhash32 finalizer */
+	uint32		h = (uint32) oid;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+#define SH_PREFIX pgorph_rfn
+#define SH_ELEMENT_TYPE RelfilenodeMapEntryDirty
+#define SH_KEY_TYPE RelfilenodeMapKeyDirty
+#define SH_KEY key
+#define SH_HASH_KEY(tb, k) \
+	(pgorph_hash_oid((k).relfilenode) ^ (pgorph_hash_oid((k).reltablespace) * 31))
+#define SH_EQUAL(tb, a, b) \
+	((a).relfilenode == (b).relfilenode && (a).reltablespace == (b).reltablespace)
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+#define SH_PREFIX pgorph_relid
+#define SH_ELEMENT_TYPE PgOrphRelidEntry
+#define SH_KEY_TYPE Oid
+#define SH_KEY relid
+#define SH_HASH_KEY(tb, k) pgorph_hash_oid(k)
+#define SH_EQUAL(tb, a, b) ((a) == (b))
+#define SH_SCOPE static inline
+#define SH_DECLARE
+#define SH_DEFINE
+#include "lib/simplehash.h"
+
+/* Hash tables for information about each relfilenode <-> oid pair */
+static pgorph_rfn_hash *RelfilenodeMapHashDirty = NULL;
+static pgorph_relid_hash *RelfilenodeMapRelidDirty = NULL;
+
+static void pgorph_rfn_store(RelfilenodeMapKeyDirty *key, Oid relid);
+
+#ifdef PGORPH_SHARED_CACHE
+/*
+ * The relfilenodes found in pg_class are also kept in a dshash table
+ * shared by the backends (pg_orphaned.shared_cache), so that a new
+ * connection does not have to probe pg_class again for each file.
+ *
+ * The relcache callback of a backend only sees the invalidations that
+ * this backend processes, so the callback registered in every backend
+ * when preloaded only bumps generation counters in shared memory: a
+ * shared entry is valid as long as the counter of the slot of its relid
+ * (and the reset counter) did not change since it was looked up.
+ * Negative entries are not shared: a relation can show up in pg_class
+ * before any invalidation is processed, and missing it would make its
+ * files orphaned.
+ *
+ * The table holds at most pg_orphaned.shared_cache_max_entries entries.
+ * Once full, the backend that wants to add one sweeps it (PostgreSQL 15
+ * and later, where dshash can be walked): the stale entries go first,
+ * then arbitrary ones until an eighth of the room is free. Before 15 the
+ * stale entries are only removed when looked up, and no entry is added
+ * to a full table.
+ */
+#define PGORPH_INVAL_SLOTS 1024
+
+typedef struct PgOrphSharedCacheKey
+{
+	Oid			dboid;
+	RelfilenodeMapKeyDirty key;
+} PgOrphSharedCacheKey;
+
+typedef struct PgOrphSharedCacheEntry
+{
+	PgOrphSharedCacheKey key;	/* lookup key - must be first */
+	Oid			relid;
+	uint64		reset_gen;
+	uint64		relid_gen;
+} PgOrphSharedCacheEntry;
+
+/* generations read before a pg_class probe */
+typedef struct PgOrphCacheStamp
+{
+	uint64		reset_gen;
+	uint64		any_gen;
+} PgOrphCacheStamp;
+
+static bool pgorph_shared_cache_lookup(Oid reltablespace, Oid relfilenode, Oid *relid);
+static bool pgorph_shared_cache_stamp(PgOrphCacheStamp *stamp);
+static void pgorph_shared_cache_insert(Oid reltablespace, Oid relfilenode, Oid relid,
+									   PgOrphCacheStamp *stamp);
+static void pgorph_shared_cache_inval(Datum arg, Oid relid);
+#endif
+
+/* relation file names are much shorter, the longest being t<n>_<n>_init.<n> */
+#define PGORPH_MAX_FILENAME 64
+
+/*
+ * An orphaned file: the database name and the directory are not copied
+ * for each file, they point to strings interned once per scan (or owned
+ * by the sink the record has been emitted to)
+ */
 typedef struct OrphanedRelation {
-	char	   *dbname;
-	char	   *path;
-	char	   *name;
-	int size;
+	const char *dbname;
+	const char *path;
+	int64		size;
 	TimestampTz mod_time;
 	Oid relfilenode;
 	Oid reloid;
+	char		name[PGORPH_MAX_FILENAME];
 } OrphanedRelation;
 
-static void pgorph_add_suffix(List **flist, OrphanedRelation *orph);
+/* what a relation file name says */
+typedef struct PgOrphFileName
+{
+	Oid			relfilenode;
+	int			backend;		/* -1 unless the file of a temp relation */
+	ForkNumber	fork;
+	uint32		segno;
+} PgOrphFileName;
+
+static bool pgorph_parse_filename(const char *name, PgOrphFileName *fname);
+static bool pgorph_temp_owner_alive(int backend, Oid dboid);
+
+/* a stat to run as part of a batch, err is set to its errno or 0 */
+typedef struct PgOrphStatRequest
+{
+	const char *name;			/* relative to the directory */
+	bool		follow;			/* follow a symbolic link */
+	struct stat *st;
+	int		   *err;
+} PgOrphStatRequest;
+
+/*
+ * a relation file unknown to the catalog, row.reloid being the result of
+ * the check, that is reported with the other files of its relfilenode
+ */
+typedef struct PgOrphPending
+{
+	OrphanedRelation row;
+	PgOrphFileName fname;
+	struct PgOrphFileState *fstate;	/* incremental scans */
+	bool		have_stat;
+	bool		owner_gone;		/* temp file of a backend that is gone */
+	int			err;
+	struct stat st;
+} PgOrphPending;
+
+/* the classification of the relation files of a directory, in progress */
+typedef struct PgOrphDirScan
+{
+	struct PgOrphSink *sink;
+	Oid			dboid;
+	const char *dbname;
+	const char *dir;
+	Oid			reltablespace;
+	DIR		   *dirdesc;
+	struct PgOrphDirState *dstate;	/* incremental scans */
+	PgOrphPending *pending;		/* candidates */
+	int			maxpending;
+	int			npending;
+	int			nstated;		/* stat'ed already */
+	HTAB	   *decided;		/* relfilenodes flushed */
+} PgOrphDirScan;
+
+static void pgorph_stat_batch(DIR *dirdesc, const char *dir, PgOrphStatRequest *reqs, int nreqs);
+#ifdef USE_PGORPH_URING
+static bool pgorph_uring_stat_batch(DIR *dirdesc, PgOrphStatRequest *reqs, int nreqs);
+#endif
+static int pgorph_fstatat(DIR *dirdesc, const char *dir, const char *name,
+						  struct stat *st, bool follow);
+static bool pgorph_stat_entry(DIR *dirdesc, const char *dir, const char *name,
+							  struct stat *st, bool follow);
+
+/*
+ * The files of the main fork are stat'ed through a symbolic link, the
+ * ones of the other forks are not, as pg_orphaned always did
+ */
+#define PGORPH_STAT_FOLLOW(fname) ((fname)->fork == MAIN_FORKNUM)
+
+/*
+ * Statistics of the last scan run by this backend, reported by
+ * pg_orphaned_last_scan_stats()
+ */
+typedef struct PgOrphScanStats
+{
+	int64		directories;
+	int64		entries;		/* read from the directories */
+	int64		files;
+	int64		stat_calls;
+	int64		stat_calls_saved;	/* compared to a stat per entry */
+	int64		stat_batches;	/* submitted through io_uring */
+	int64		catalog_probes;	/* pg_class index probes */
+	int64		cache_hits;		/* relfilenodes found in the local cache */
+	int64		cache_misses;
+	int64		invalidations;	/* relcache invalidations received */
+	int64		orphaned;
+	int64		orphaned_size;
+	int64		allocations;	/* done by the scan itself */
+	int64		allocated_bytes;
+	int64		peak_memory;
+	int64		fsyncs;			/* files and directories fsync'ed */
+	int64		fsync_time;		/* in microseconds */
+	int64		copied_files;	/* moved across filesystems */
+	int64		copied_bytes;	/* not counting the cloned files */
+	int64		clones;
+	int64		shared_cache_hits;
+	int64		shared_cache_evictions;
+	int64		temp_owner_gone;	/* temp files classified without pg_class */
+	/* in microseconds, summed over the workers but elapsed_time */
+	int64		readdir_time;
+	int64		stat_time;
+	int64		catalog_time;
+	int64		emit_time;		/* sending the results to the sink */
+	int64		elapsed_time;
+} PgOrphScanStats;
+
+static const struct
+{
+	const char *name;
+	Size		offset;
+} pgorph_stats_fields[] = {
+	{"directories", offsetof(PgOrphScanStats, directories)},
+	{"entries", offsetof(PgOrphScanStats, entries)},
+	{"files", offsetof(PgOrphScanStats, files)},
+	{"stat_calls", offsetof(PgOrphScanStats, stat_calls)},
+	{"stat_calls_saved", offsetof(PgOrphScanStats, stat_calls_saved)},
+	{"stat_batches", offsetof(PgOrphScanStats, stat_batches)},
+	{"catalog_probes", offsetof(PgOrphScanStats, catalog_probes)},
+	{"cache_hits", offsetof(PgOrphScanStats, cache_hits)},
+	{"cache_misses", offsetof(PgOrphScanStats, cache_misses)},
+	{"invalidations", offsetof(PgOrphScanStats, invalidations)},
+	{"orphaned", offsetof(PgOrphScanStats, orphaned)},
+	{"orphaned_size", offsetof(PgOrphScanStats, orphaned_size)},
+	{"allocations", offsetof(PgOrphScanStats, allocations)},
+	{"allocated_bytes", offsetof(PgOrphScanStats, allocated_bytes)},
+	{"peak_memory", offsetof(PgOrphScanStats, peak_memory)},
+	{"fsyncs", offsetof(PgOrphScanStats, fsyncs)},
+	{"fsync_time", offsetof(PgOrphScanStats, fsync_time)},
+	{"copied_files", offsetof(PgOrphScanStats, copied_files)},
+	{"copied_bytes", offsetof(PgOrphScanStats, copied_bytes)},
+	{"clones", offsetof(PgOrphScanStats, clones)},
+	{"shared_cache_hits", offsetof(PgOrphScanStats, shared_cache_hits)},
+	{"shared_cache_evictions", offsetof(PgOrphScanStats, shared_cache_evictions)},
+	{"temp_owner_gone", offsetof(PgOrphScanStats, temp_owner_gone)},
+	{"readdir_time", offsetof(PgOrphScanStats, readdir_time)},
+	{"stat_time", offsetof(PgOrphScanStats, stat_time)},
+	{"catalog_time", offsetof(PgOrphScanStats, catalog_time)},
+	{"emit_time", offsetof(PgOrphScanStats, emit_time)},
+	{"elapsed_time", offsetof(PgOrphScanStats, elapsed_time)},
+};
+
+static PgOrphScanStats pgorph_stats;
+static instr_time pgorph_scan_start;
+
+/* add the time elapsed since start to a phase of the statistics */
+#define PGORPH_PHASE_END(start, phase) \
+	do { \
+		instr_time	end_; \
+		INSTR_TIME_SET_CURRENT(end_); \
+		INSTR_TIME_SUBTRACT(end_, (start)); \
+		pgorph_stats.phase += (int64) INSTR_TIME_GET_MICROSEC(end_); \
+	} while (0)
+
+/*
+ * Reading the clock around each directory entry and each result costs as
+ * much as what is measured, so only one call in PGORPH_TIMING_SAMPLE is
+ * timed and counted for all of them.
+ */
+#define PGORPH_TIMING_SAMPLE 16
+
+#define PGORPH_SAMPLE_START(calls, start) \
+	(((calls)++ % PGORPH_TIMING_SAMPLE) == 0 ? \
+	 (INSTR_TIME_SET_CURRENT(start), true) : false)
+
+#define PGORPH_SAMPLE_END(start, phase) \
+	do { \
+		instr_time	end_; \
+		INSTR_TIME_SET_CURRENT(end_); \
+		INSTR_TIME_SUBTRACT(end_, (start)); \
+		pgorph_stats.phase += (int64) INSTR_TIME_GET_MICROSEC(end_) * PGORPH_TIMING_SAMPLE; \
+	} while (0)
+
+static uint64 pgorph_readdir_calls = 0;
+static uint64 pgorph_emit_calls = 0;
+
+/*
+ * Statistics of the directories of a tablespace scanned by the last scan,
+ * also kept per directory while scanning
+ */
+typedef struct PgOrphTablespaceScanStats
+{
+	Oid			reltablespace;
+	int64		directories;
+	int64		entries;
+	int64		files;
+	int64		orphaned;
+	int64		orphaned_size;
+	int64		elapsed_time;	/* in microseconds */
+} PgOrphTablespaceScanStats;
+
+static PgOrphTablespaceScanStats *pgorph_ts_stats = NULL;
+static int	pgorph_ts_nstats = 0;
+
+/*
+ * Wait events reported while blocked in the filesystem, throttled or
+ * idle: custom ones from PostgreSQL 17, the generic Extension one before
+ */
+typedef enum
+{
+	PGORPH_WAIT_READDIR,
+	PGORPH_WAIT_STAT,
+	PGORPH_WAIT_COPY,
+	PGORPH_WAIT_REMOVE,
+	PGORPH_WAIT_WORKERS,
+	PGORPH_WAIT_THROTTLE,		/* pg_orphaned.remove_rate_limit */
+	PGORPH_WAIT_SCANNER_IDLE,	/* background scanner between runs */
+	PGORPH_WAIT_COUNT
+} PgOrphWaitEvent;
+
+static uint32 pgorph_wait_event(PgOrphWaitEvent event);
+
+/*
+ * Progress of the functions, published through the pgstat_progress_*
+ * parameters of the backend. An extension can not add its own progress
+ * command, so the parameters are set under PROGRESS_COMMAND_INVALID and
+ * marked with the start time of the statement: pg_orphaned_progress_info()
+ * only shows the backends whose current statement set them.
+ */
+#define PGORPH_PROGRESS_MARKER		0
+#define PGORPH_PROGRESS_COMMAND		1
+#define PGORPH_PROGRESS_PHASE		2
+#define PGORPH_PROGRESS_TABLESPACE	3
+#define PGORPH_PROGRESS_DIRS_DONE	4
+#define PGORPH_PROGRESS_DIRS_TOTAL	5
+#define PGORPH_PROGRESS_FILES		6
+#define PGORPH_PROGRESS_ORPHANED	7
+#define PGORPH_PROGRESS_BYTES		8
+
+/* entries read between two updates of the progress during a scan */
+#define PGORPH_PROGRESS_INTERVAL	1024
+
+typedef enum
+{
+	PGORPH_COMMAND_LIST = 1,
+	PGORPH_COMMAND_LIST_MOVED,
+	PGORPH_COMMAND_SUMMARY,
+	PGORPH_COMMAND_MOVE,
+	PGORPH_COMMAND_MOVE_BACK,
+	PGORPH_COMMAND_REMOVE,
+	PGORPH_COMMAND_SNAPSHOT,
+	PGORPH_COMMAND_LIST_CLUSTER,
+	PGORPH_COMMAND_SCAN_STEP,
+	PGORPH_COMMAND_DAEMON
+} PgOrphProgressCommand;
+
+static const char *const pgorph_progress_commands[] = {
+	NULL,
+	"pg_list_orphaned",
+	"pg_list_orphaned_moved",
+	"pg_orphaned_summary",
+	"pg_move_orphaned",
+	"pg_move_back_orphaned",
+	"pg_remove_moved_orphaned",
+	"pg_orphaned_snapshot",
+	"pg_list_orphaned_cluster",
+	"pg_orphaned_scan_step",
+	"background scanner"
+};
+
+typedef enum
+{
+	PGORPH_PHASE_INITIALIZING,
+	PGORPH_PHASE_SCANNING,
+	PGORPH_PHASE_MOVING,
+	PGORPH_PHASE_SYNCING,
+	PGORPH_PHASE_COLLECTING,
+	PGORPH_PHASE_REMOVING,
+	PGORPH_PHASE_CHECKING
+} PgOrphProgressPhase;
+
+static const char *const pgorph_progress_phases[] = {
+	"initializing",
+	"scanning directories",
+	"moving files",
+	"syncing directories",
+	"collecting files",
+	"removing files",
+	"checking catalogs"
+};
+
+/* the progress of a scan worker, read by its leader */
+typedef struct PgOrphWorkerProgress
+{
+	pg_atomic_uint32 dirs_done;
+	pg_atomic_uint64 files;
+	pg_atomic_uint64 orphaned;
+} PgOrphWorkerProgress;
+
+static bool pgorph_progress_active = false;
+static int64 pgorph_progress_dirs_done = 0;
+static PgOrphWorkerProgress *pgorph_worker_progress = NULL;
+
+static void pgorph_progress_start(PgOrphProgressCommand command);
+static void pgorph_progress_phase(PgOrphProgressPhase phase);
+static void pgorph_progress_set(int index, int64 val);
+static void pgorph_progress_scan(void);
+static void pgorph_progress_end(void);
+static void pgorph_xact_callback(XactEvent event, void *arg);
+static void pgorph_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+									SubTransactionId parentSubid, void *arg);
+
+/*
+ * Chunked scans
+ *
+ * pg_orphaned_scan_step() checks a bounded slice of the relation files of
+ * the database per call: the directories are taken in tablespace order
+ * and the files of a directory in relfilenode order, so the position
+ * reached is the tablespace and the last relfilenode checked in it. It is
+ * kept in pg_orphaned/scan_step_<dboid>, written once the call completes:
+ * a cancelled call is done again by the next one.
+ *
+ * A directory is read once per call, keeping only the max_files first
+ * relation files after the position, then they are classified in order
+ * until the time is up.
+ */
+#define PGORPH_STATE_DIR			"pg_orphaned"
+#define PGORPH_STEP_MAGIC			0x4F525053
+#define PGORPH_STEP_FIRST_FILES		1024
+
+typedef struct PgOrphStepState
+{
+	uint32		magic;
+	Oid			dboid;
+	Oid			reltablespace;	/* directory being scanned */
+	Oid			relfilenode;	/* last one checked in it */
+	TimestampTz started_at;		/* of the current pass */
+	TimestampTz updated_at;
+	int64		steps;			/* of the current pass */
+	int64		passes;			/* completed */
+} PgOrphStepState;
+
+/*
+ * Everything a scan allocates lives in this context, freed in one go
+ * once the scan is done
+ */
+static MemoryContext pgorph_scan_context = NULL;
+
+static MemoryContext pgorph_scan_begin(void);
+static void pgorph_scan_end(MemoryContext oldcontext);
+static void *pgorph_scan_alloc(MemoryContext cxt, Size size);
+static void pgorph_scan_track_memory(MemoryContext extra);
+static void pgorph_stats_accumulate(PgOrphScanStats *stats);
+
+/*
+ * Where the orphaned files found by a scan go: copied to a list, written
+ * to the tuplestore of a set returning function while the directories
+ * are being walked, sent to the leader of a parallel scan, added to
+ * the totals of pg_orphaned_summary(), or kept as the entries of the
+ * manifest of pg_orphaned_snapshot().
+ */
+typedef enum
+{
+	PGORPH_SINK_LIST,
+	PGORPH_SINK_TUPLESTORE,
+	PGORPH_SINK_MQ,
+	PGORPH_SINK_SUMMARY,
+	PGORPH_SINK_MANIFEST
+} PgOrphSinkKind;
+
+/*
+ * Totals of the orphaned files of a tablespace or of a relfilenode
+ */
+typedef struct PgOrphTotal
+{
+	Oid			reltablespace;
+	Oid			relfilenode;	/* InvalidOid for a tablespace */
+	int64		files;
+	int64		size;
+	int64		older_size;		/* size of the files older than limitts */
+	TimestampTz oldest;
+	TimestampTz newest;
+} PgOrphTotal;
+
+/*
+ * The files of a relfilenode are reported one after the other for a given
+ * directory, but the files of a parallel scan come from several workers:
+ * one relfilenode is accumulated per directory until the next one shows
+ * up there.
+ */
+typedef struct PgOrphSummaryRun
+{
+	char		path[MAXPGPATH];
+	int			backend;		/* -1 unless the files of a temp relation */
+	PgOrphTotal total;
+} PgOrphSummaryRun;
+
+typedef struct PgOrphSummary
+{
+	PgOrphTotal *tablespaces;
+	int			ntablespaces;
+	int			maxtablespaces;
+	PgOrphSummaryRun *runs;
+	int			nruns;
+	int			maxruns;
+	/* the top_n largest relfilenodes, smallest first */
+	binaryheap *heap;
+	PgOrphTotal *top;
+	int			top_n;
+} PgOrphSummary;
+
+/*
+ * Filters pushed down into a scan: the files checked against them before
+ * pg_class and the orphaned ones reported only if they match
+ */
+typedef struct PgOrphFilter
+{
+	bool		active;
+	int64		min_size;
+	TimestampTz max_mod_time;	/* DT_NOEND when no minimum age is set */
+} PgOrphFilter;
+
+typedef struct PgOrphSink
+{
+	PgOrphSinkKind kind;
+	MemoryContext cxt;			/* owns the list, its records and strings */
+	List	   *list;
+	const char *last_dbname;	/* interned strings of the last record */
+	const char *last_path;
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	MemoryContext tmpcxt;		/* reset after each tuple */
+	shm_mq_handle *mqh;
+	StringInfoData buf;
+	PgOrphSummary *summary;
+	struct PgOrphManifestEntry *entries;	/* in cxt */
+	int64		nentries;
+	int64		maxentries;
+	PgOrphFilter filter;
+	List	   *tablespaces;		/* the ones to scan, all of them when NIL */
+} PgOrphSink;
+
+static void pgorph_list_sink_init(PgOrphSink *sink);
+static void pgorph_tuplestore_sink_init(PgOrphSink *sink, FunctionCallInfo fcinfo);
+static void pgorph_mq_sink_init(PgOrphSink *sink, shm_mq_handle *mqh);
+static void pgorph_summary_sink_init(PgOrphSink *sink, int top_n);
+static void pgorph_manifest_sink_init(PgOrphSink *sink);
+static void pgorph_manifest_add(PgOrphSink *sink, OrphanedRelation *orph);
+static int	pgorph_total_cmp(Datum a, Datum b, void *arg);
+static void pgorph_summary_add(PgOrphSummary *summary, OrphanedRelation *orph);
+static void pgorph_summary_finish(PgOrphSink *sink, FunctionCallInfo fcinfo);
+static Oid pgorph_path_tablespace(const char *path);
+static void pgorph_emit(PgOrphSink *sink, OrphanedRelation *orph);
+static bool pgorph_filter_match(PgOrphFilter *filter, int64 size, TimestampTz mod_time);
+
+/* incremental scans: state of a scanned file */
+
+typedef struct PgOrphFileState
+{
+	char		name[PGORPH_MAX_FILENAME];	/* hash key - must be first */
+	int64		size;
+	time_t		mtime;
+	uint64		seen;			/* generation of the last scan seeing it */
+	bool		deferred;		/* has to be classified again */
+	int			nrows;
+	OrphanedRelation *rows;		/* the orphaned files reported for it */
+} PgOrphFileState;
+
+/* incremental scans: state of a scanned directory */
+typedef struct PgOrphDirState
+{
+	char		path[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY)];	/* hash key */
+	time_t		mtime;
+	bool		trusted;		/* mtime is reliable to detect a change */
+	time_t		scan_mtime;		/* mtime and trusted once the scan is done */
+	bool		scan_trusted;
+	uint64		generation;		/* incremented at each scan */
+	int			ndeferred;
+	HTAB	   *files;
+} PgOrphDirState;
+
+static MemoryContext pgorph_incr_context = NULL;
+static HTAB *pgorph_incr_dirs = NULL;
+static bool pgorph_incremental = false;
+static bool pgorph_spill_files = false;
+static char *pgorph_spill_files_database = NULL;
+static bool pgorph_incremental_scan = false;
+
+static PgOrphDirState *pgorph_incr_begin_dir(const char *dir, Oid dboid, Oid reltablespace,
+											  bool *unchanged);
+static bool pgorph_incr_still_live(PgOrphFileName *fname, Oid dboid, Oid reltablespace);
+static void pgorph_incr_end_dir(PgOrphDirState *dstate);
+static void pgorph_incr_forget_dir(PgOrphDirState *dstate);
+static void pgorph_incr_emit_dir(PgOrphSink *sink, PgOrphDirState *dstate, const char *dbname);
+static PgOrphFileState *pgorph_incr_begin_file(PgOrphDirState *dstate, const char *name,
+											   struct stat *attrib, bool *reuse);
+static void pgorph_incr_end_file(PgOrphDirState *dstate, PgOrphFileState *fstate,
+								 OrphanedRelation *rows, int nrows, bool deferred);
+static void pgorph_incr_free_rows(PgOrphFileState *fstate);
+static void pgorph_incr_reset(void);
+static void pgorph_stat_pending(DIR *dirdesc, const char *dir, Oid reltablespace,
+								PgOrphPending *pending, int from, int to, bool probe);
+static void pgorph_report_groups(PgOrphSink *sink, PgOrphDirState *dstate,
+								 PgOrphPending *pending, int npending,
+								 HTAB **decided, bool flush);
+static PgOrphPending *pgorph_pending_add(PgOrphPending **pending, int *npending, int *maxpending,
+										 const char *dbname, const char *dir, const char *name,
+										 PgOrphFileName *fname);
+static bool pgorph_dir_scan_begin(PgOrphDirScan *scan, PgOrphSink *sink, Oid dboid,
+								  const char *dbname, const char *dir, Oid reltablespace,
+								  PgOrphDirState *dstate);
+static void pgorph_dir_scan_file(PgOrphDirScan *scan, const char *name, PgOrphFileName *fname);
+static void pgorph_dir_scan_end(PgOrphDirScan *scan);
+
+/* a directory to scan, and the parallel worker scanning it */
+typedef struct PgOrphScanDir
+{
+	Oid			reltablespace;
+	int			worker;
+	bool		spill;			/* a pgsql_tmp directory */
+	bool		restore;		/* in the backup directory */
+	PgOrphTablespaceScanStats stats;
+	char		path[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY)];
+} PgOrphScanDir;
+
+static void pgorph_ts_stats_add(PgOrphTablespaceScanStats *dstats);
+static void pgorph_scan_dir_stats(PgOrphScanDir *sdir, PgOrphScanStats *before, instr_time start);
+
+/*
+ * State shared with the scan workers, followed in the dynamic shared
+ * memory segment by one shm_mq per worker
+ */
+typedef struct PgOrphParallelScan
+{
+	Oid			dboid;
+	Oid			userid;
+	TimestampTz last_checkpoint_time;
+	int			lookup_mode;
+	bool		shared_cache;
+	PgOrphFilter filter;
+	int			nworkers;
+	int			ndirs;
+	bool		done[PGORPH_MAX_PARALLEL_WORKERS];
+	PgOrphScanStats stats[PGORPH_MAX_PARALLEL_WORKERS];
+	PgOrphWorkerProgress progress[PGORPH_MAX_PARALLEL_WORKERS];
+	PgOrphScanDir dirs[FLEXIBLE_ARRAY_MEMBER];
+} PgOrphParallelScan;
+
+static void pgorph_progress_parallel(PgOrphParallelScan *pscan, int nworkers);
+
+typedef struct PgOrphWireRelation
+{
+	int64		size;
+	TimestampTz mod_time;
+	Oid			relfilenode;
+	Oid			reloid;
+} PgOrphWireRelation;
+
+/* a relation file found by the cluster wide walk */
+typedef struct PgOrphClusterFile
+{
+	const char *path;			/* shared by the files of a directory */
+	char		name[PGORPH_MAX_FILENAME];
+} PgOrphClusterFile;
+
+/* a relfilenode to check against the catalog of its database */
+typedef struct PgOrphCandidate
+{
+	Oid			reltablespace;
+	Oid			relfilenode;
+	bool		owner_gone;		/* temp file of a backend that is gone */
+	Oid			reloid;			/* result of the check */
+} PgOrphCandidate;
+
+/* the files found for a database, candidates[i] is for files[i] */
+typedef struct PgOrphClusterDb
+{
+	Oid			dboid;			/* hash key - must be first */
+	char	   *dbname;
+	bool		checked;
+	int			nfiles;
+	int			maxfiles;
+	PgOrphClusterFile *files;
+	PgOrphCandidate *candidates;
+} PgOrphClusterDb;
+
+/* the check of one database by a cluster worker */
+typedef struct PgOrphClusterTask
+{
+	Oid			dboid;
+	Size		offset;			/* of its first candidate */
+	int			ncandidates;
+	bool		done;
+} PgOrphClusterTask;
+
+/*
+ * State shared with the cluster workers, followed in the dynamic shared
+ * memory segment by the candidates of all the tasks
+ */
+typedef struct PgOrphClusterScan
+{
+	Oid			userid;
+	TimestampTz last_checkpoint_time;
+	int			lookup_mode;
+	bool		shared_cache;
+	int			ntasks;
+	PgOrphClusterTask tasks[FLEXIBLE_ARRAY_MEMBER];
+} PgOrphClusterScan;
+
+static TimestampTz pgorph_last_checkpoint_time(void);
+static PgOrphScanDir *pgorph_make_scan_dir(const char *path, Oid reltablespace);
+static List *pgorph_scan_dirs(Oid dbOid, const char *dbname, bool restore);
+static bool pgorph_parallel_scan(List *dirs, Oid dbOid, const char *dbName, PgOrphSink *sink);
+static void pgorph_wait_for_workers(void);
+static void pgorph_serialize_orphan(StringInfo buf, OrphanedRelation *orph);
+static void pgorph_deserialize_orphan(OrphanedRelation *orph, void *data, Size nbytes, const char *dbname);
+static void pg_build_orphaned_cluster_list(PgOrphSink *sink);
+static void pgorph_cluster_walk(HTAB *dbs);
+static void pgorph_cluster_walk_tablespace(HTAB *dbs, const char *tbsdir, Oid reltablespace);
+static void pgorph_cluster_walk_db(HTAB *dbs, const char *dir, Oid dboid, Oid reltablespace);
+static void pgorph_cluster_check(HTAB *dbs);
+static char *pgorph_database_to_check(Oid dboid);
+static bool pgorph_launch_cluster_worker(dsm_segment *seg, int task, BackgroundWorkerHandle **handle);
+static void pgorph_check_candidates(PgOrphCandidate *candidates, int ncandidates);
 
 /*
  * function to check the status of directory
@@ -291,55 +1285,25 @@ pg_orphaned_mkdir_p(char *path, int omode)
 }
 
 /*
- * function to build the list
- * of orphaned files
- * the boolean is used to search
- * in the standard directory or in the backup one
- * the logic to go through each directory/tablespace
- * is mainly inspired from the existing calculate_database_size()
+ * the directories holding the relation files of a database, or the
+ * ones of its backup when restore is true
  */
-void
-pg_build_orphaned_list(Oid dbOid, bool restore)
+static List *
+pgorph_scan_dirs(Oid dbOid, const char *dbname, bool restore)
 {
-
-	const char *dbName = NULL;
 	DIR                *dirdesc;
 	struct dirent *direntry;
 	char            dirpath[MAXPGPATH];
 	char            dir[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY)];
 	Oid                     reltbsnode = InvalidOid;
-	char *reltbsname;
-	ControlFileData *ControlFile;
-	bool        crc_ok;
-	time_t      time_tmp;
-	MemoryContext   mctx;
-
-	dbName=get_database_name(MyDatabaseId);
-
-	/* get a copy of the control file */
-#if PG_VERSION_NUM >= 120000
-	ControlFile = get_controlfile(".", &crc_ok);
-#else
-	ControlFile = get_controlfile(".", NULL, &crc_ok);
-#endif
-	if (!crc_ok)
-		ereport(ERROR,(errmsg("pg_control CRC value is incorrect")));
-
-	/* get last checkpoint time */
-	time_tmp = (time_t) ControlFile->checkPointCopy.time;
-	last_checkpoint_time = time_t_to_timestamptz(time_tmp);
-
-	mctx = MemoryContextSwitchTo(TopMemoryContext);
-
-	list_free_deep(list_orphaned_relations);
-	list_orphaned_relations=NIL;
+	List	   *dirs = NIL;
 
 	/* default tablespace */
 	if (!restore)
 		snprintf(dir, sizeof(dir), "base/%u", dbOid);
 	else
 		snprintf(dir, sizeof(dir), "%s/%u/base/%u", orphaned_backup_dir, dbOid, dbOid);
-	search_orphaned(&list_orphaned_relations, dbOid, dbName, dir, 0);
+	dirs = lappend(dirs, pgorph_make_scan_dir(dir, 0));
 
 	/* Scan the non-default tablespaces */
 	if (!restore)
@@ -350,760 +1314,6926 @@ pg_build_orphaned_list(Oid dbOid, bool restore)
 	/*
 	 * In case no tablespaces in the dedicated backup dir
 	 */
-	if (restore && pg_orphaned_check_dir(dirpath) != 4)
-		return;
-
-	dirdesc = AllocateDir(dirpath);
-
-	while ((direntry = ReadDir(dirdesc, dirpath)) != NULL)
+	if (!restore || pg_orphaned_check_dir(dirpath) == 4)
 	{
-		CHECK_FOR_INTERRUPTS();
+		dirdesc = AllocateDir(dirpath);
 
-		if (strcmp(direntry->d_name, ".") == 0 ||
-			strcmp(direntry->d_name, "..") == 0)
-			continue;
+		while ((direntry = ReadDir(dirdesc, dirpath)) != NULL)
+		{
+			CHECK_FOR_INTERRUPTS();
 
-		if (!restore)
-			snprintf(dir, sizeof(dir), "pg_tblspc/%s/%s/%u",
-				direntry->d_name, TABLESPACE_VERSION_DIRECTORY, dbOid);
-		else
-			snprintf(dir, sizeof(dir), "%s/%u/pg_tblspc/%s/%s/%u",
-				orphaned_backup_dir, dbOid, direntry->d_name, TABLESPACE_VERSION_DIRECTORY, dbOid);
+			if (strcmp(direntry->d_name, ".") == 0 ||
+				strcmp(direntry->d_name, "..") == 0)
+				continue;
 
-		reltbsname = strdup(direntry->d_name);
-		reltbsnode = (Oid) strtoul(reltbsname, &reltbsname, 10);
+			if (!restore)
+				snprintf(dir, sizeof(dir), "pg_tblspc/%s/%s/%u",
+					direntry->d_name, TABLESPACE_VERSION_DIRECTORY, dbOid);
+			else
+				snprintf(dir, sizeof(dir), "%s/%u/pg_tblspc/%s/%s/%u",
+					orphaned_backup_dir, dbOid, direntry->d_name, TABLESPACE_VERSION_DIRECTORY, dbOid);
 
-		search_orphaned(&list_orphaned_relations, dbOid, dbName, dir, reltbsnode);
-	}
-	FreeDir(dirdesc);
-	MemoryContextSwitchTo(mctx);
-}
+			reltbsnode = (Oid) strtoul(direntry->d_name, NULL, 10);
 
-Datum
-pg_list_orphaned(PG_FUNCTION_ARGS)
-{
-	requireSuperuser();
+			dirs = lappend(dirs, pgorph_make_scan_dir(dir, reltbsnode));
+		}
+		FreeDir(dirdesc);
+	}
 
-    if (PG_ARGISNULL(0))
-		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
-	else
-		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+	/* the files moved to the backup directory of their tablespace */
+	if (restore)
+	{
+		dirdesc = AllocateDir("pg_tblspc");
 
-	pg_build_orphaned_list(MyDatabaseId, false);
-	pg_list_orphaned_internal(fcinfo);
-	return (Datum) 0;
-}
+		while ((direntry = ReadDir(dirdesc, "pg_tblspc")) != NULL)
+		{
+			CHECK_FOR_INTERRUPTS();
 
-Datum
-pg_list_orphaned_moved(PG_FUNCTION_ARGS)
-{
-	requireSuperuser();
+			if (strcmp(direntry->d_name, ".") == 0 ||
+				strcmp(direntry->d_name, "..") == 0)
+				continue;
 
-	pg_build_orphaned_list(MyDatabaseId, true);
-	pg_list_orphaned_internal(fcinfo);
-	return (Datum) 0;
-}
+			snprintf(dir, sizeof(dir), "pg_tblspc/%s/%s/%u/%s/%u",
+				direntry->d_name, orphaned_backup_dir, dbOid, TABLESPACE_VERSION_DIRECTORY, dbOid);
 
-void
-pg_list_orphaned_internal(FunctionCallInfo fcinfo)
-{
+			if (pg_orphaned_check_dir(dir) != 4)
+				continue;
 
-	ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	Tuplestorestate *tupstore;
-	TupleDesc           tupdesc;
-	MemoryContext   per_query_ctx;
-	MemoryContext   oldcontext;
-	ListCell   *cell;
+			reltbsnode = (Oid) strtoul(direntry->d_name, NULL, 10);
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+			dirs = lappend(dirs, pgorph_make_scan_dir(dir, reltbsnode));
+		}
+		FreeDir(dirdesc);
+	}
 
 	/*
-	 * Build a tuple descriptor for our result type
+	 * The temporary files of the sessions are not tied to a database:
+	 * they are only reported, and moved to the backup directory, by the
+	 * one named by pg_orphaned.spill_files_database.
 	 */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
-
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
-	MemoryContextSwitchTo(oldcontext);
+	if (restore ||
+		(pgorph_spill_files && pgorph_spill_files_database != NULL &&
+		 dbname != NULL && strcmp(pgorph_spill_files_database, dbname) == 0))
+	{
+		PgOrphScanDir *sdir;
 
-#if (PG_VERSION_NUM < 130000)
-	for (cell = list_head(list_orphaned_relations); cell != NULL; cell = lnext(cell))
-#else
-	for (cell = list_head(list_orphaned_relations); cell != NULL; cell = lnext(list_orphaned_relations, cell))
-#endif
-	{
-		OrphanedRelation  *orph = (OrphanedRelation *)lfirst(cell);
+		if (!restore)
+			snprintf(dir, sizeof(dir), "base/%s", PG_TEMP_FILES_DIR);
+		else
+			snprintf(dir, sizeof(dir), "%s/%u/base/%s", orphaned_backup_dir, dbOid, PG_TEMP_FILES_DIR);
+		if (pg_orphaned_check_dir(dir) == 4)
+		{
+			sdir = pgorph_make_scan_dir(dir, 0);
+			sdir->spill = true;
+			sdir->restore = restore;
+			dirs = lappend(dirs, sdir);
+		}
 
-		Datum           values[8];
-		bool            nulls[8];
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+		dirdesc = AllocateDir("pg_tblspc");
+
+		while ((direntry = ReadDir(dirdesc, "pg_tblspc")) != NULL)
+		{
+			CHECK_FOR_INTERRUPTS();
 
-		values[0] = CStringGetTextDatum(orph->dbname);
-		values[1] = CStringGetTextDatum(orph->path);
-		values[2] = CStringGetTextDatum(orph->name);
-		values[3] = Int64GetDatum(orph->size);
-		values[4] = TimestampTzGetDatum(orph->mod_time);
-		values[5] = Int64GetDatum(orph->relfilenode);
-		values[6] = Int64GetDatum(orph->reloid);
+			if (strcmp(direntry->d_name, ".") == 0 ||
+				strcmp(direntry->d_name, "..") == 0)
+				continue;
 
-        if (orph->mod_time <= limitts)
-            values[7] = BoolGetDatum(true);
-        else
-            values[7] = BoolGetDatum(false);
+			if (!restore)
+				snprintf(dir, sizeof(dir), "pg_tblspc/%s/%s/%s",
+					direntry->d_name, TABLESPACE_VERSION_DIRECTORY, PG_TEMP_FILES_DIR);
+			else
+				snprintf(dir, sizeof(dir), "pg_tblspc/%s/%s/%u/%s/%s",
+					direntry->d_name, orphaned_backup_dir, dbOid, TABLESPACE_VERSION_DIRECTORY, PG_TEMP_FILES_DIR);
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			if (pg_orphaned_check_dir(dir) != 4)
+				continue;
+
+			reltbsnode = (Oid) strtoul(direntry->d_name, NULL, 10);
+
+			sdir = pgorph_make_scan_dir(dir, reltbsnode);
+			sdir->spill = true;
+			sdir->restore = restore;
+			dirs = lappend(dirs, sdir);
+		}
+		FreeDir(dirdesc);
 	}
+
+	return dirs;
 }
 
 /*
- * function that look for orphaned files
- * in a given directory
- * the logic to go through the list of files
- * is mainly inspired by the existing pg_ls_dir_files()
+ * function to build the list
+ * of orphaned files
+ * the boolean is used to search
+ * in the standard directory or in the backup one
+ * the logic to go through each directory/tablespace
+ * is mainly inspired from the existing calculate_database_size()
  */
 void
-search_orphaned(List **flist, Oid dboid, const char* dbname, const char* dir, Oid reltablespace)
+pg_build_orphaned_list(Oid dbOid, bool restore, PgOrphSink *sink)
 {
-	Oid                     oidrel = InvalidOid;
-	Oid                     relfilenode = InvalidOid;
-	char *relfilename;
-	DIR                *dirdesc;
-	struct dirent *de;
-	OrphanedRelation *orph;
-	TimestampTz segment_time;
 
-	dirdesc = AllocateDir(dir);
-	if (!dirdesc)
-		return ;
+	const char *dbName = NULL;
+	List	   *dirs;
+	ListCell   *cell;
+	MemoryContext oldcontext;
 
-	while ((de = ReadDir(dirdesc, dir)) != NULL)
+	oldcontext = pgorph_scan_begin();
+
+	/* interned: the records of the scan all point to it */
+	dbName=get_database_name(MyDatabaseId);
+
+	/* get last checkpoint time */
+	last_checkpoint_time = pgorph_last_checkpoint_time();
+
+	dirs = pgorph_scan_dirs(dbOid, dbName, restore);
+
+	/* only the directories of the requested tablespaces are walked */
+	if (sink->tablespaces != NIL)
 	{
-		char            path[MAXPGPATH * 2];
-		struct stat attrib;
+		List	   *requested = NIL;
 
-		/* Skip hidden files */
-		if (de->d_name[0] == '.')
-			continue;
+		foreach(cell, dirs)
+		{
+			PgOrphScanDir *sdir = (PgOrphScanDir *) lfirst(cell);
+			Oid			reltablespace = OidIsValid(sdir->reltablespace) ?
+				sdir->reltablespace : DEFAULTTABLESPACE_OID;
 
-		/* Get the file info */
-		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
-		if (stat(path, &attrib) < 0)
-			ereport(ERROR,
-				(errcode_for_file_access(),
-				errmsg("could not stat directory \"%s\": %m", dir)));
+			if (list_member_oid(sink->tablespaces, reltablespace))
+				requested = lappend(requested, sdir);
+		}
+		dirs = requested;
+	}
 
-		/* Ignore anything but regular files */
-		if (!S_ISREG(attrib.st_mode))
-			continue;
+	pgorph_progress_phase(PGORPH_PHASE_SCANNING);
+	pgorph_progress_set(PGORPH_PROGRESS_DIRS_TOTAL, list_length(dirs));
 
-		/* Ignore non digit files */
-		if (strstr(de->d_name, "_") == NULL && isdigit((unsigned char) *(de->d_name))) {
-			orph = palloc(sizeof(*orph));
-			relfilename = strdup(de->d_name);
-			relfilenode = (Oid) strtoul(relfilename, &relfilename, 10);
-			/* If RelidByRelfilenodeDirty does not return a valid oid
-			 * then we consider this file as orphaned
-			 */
-			oidrel = RelidByRelfilenodeDirty(reltablespace, relfilenode);
-			/*
-			 * Filter and don't report as orphaned
-			 * if first segment, size is zero and created after the last checkpoint
-			 * due to https://github.com/postgres/postgres/blob/REL_12_8/src/backend/storage/smgr/md.c#L225
-			 */
-			segment_time = time_t_to_timestamptz(attrib.st_mtime);
-			if (!OidIsValid(oidrel) && !(attrib.st_size == 0 &&
-				strstr(de->d_name, ".") == NULL && segment_time > last_checkpoint_time))
-			{
-				orph->dbname = strdup(dbname);
-				orph->path = strdup(dir);
-				orph->name = strdup(de->d_name);
-				orph->size = (int64) attrib.st_size;
-				orph->mod_time = segment_time;
-				orph->relfilenode = relfilenode;
-				orph->reloid = oidrel;
-				*flist = lappend(*flist, orph);
-				/* search for _init and _fsm */
-				if(strstr(de->d_name, ".") == NULL)
-					pgorph_add_suffix(flist, orph);
-			}
-		/* 
-		 * unless is this a temp table?
-		 * temp table format on disk is: t%d_%u
-		 * so that we check it starts with a t
-		 * and then check the format with a regex
-		 */
-		} else if (de->d_name[0] == 't') {
-			int i;
-			pg_wchar   *wstr;
-			int        wlen;
-			pg_wchar   *regwstr;
-			int        regwlen;
-			int     r;
-			char *regex = "^t[0-9]*_[0-9]";
-			int  regcomp_result;
-			char            errMsg[100];
-			regex_t* preg = palloc(sizeof(regex_t));
-			char	   *t;
-			char       *tokptr = NULL;
-			char *temprel;
-
-			regwstr = palloc((strlen(regex) + 1) * sizeof(pg_wchar));
-			regwlen = pg_mb2wchar_with_len(regex, regwstr, strlen(regex));
-
-			regcomp_result = pg_regcomp(preg,
-							regwstr,
-							regwlen,
-							REG_ADVANCED | REG_NOSUB,
-							DEFAULT_COLLATION_OID);
-
-			pfree(regwstr);
-
-			if (regcomp_result == REG_OKAY) {
-				wstr = palloc((strlen(de->d_name) + 1) * sizeof(pg_wchar));
-				wlen = pg_mb2wchar_with_len(de->d_name, wstr, strlen(de->d_name));
-				r = pg_regexec(preg, wstr, wlen, 0, NULL, 0, NULL, 0);
-				if (r != REG_NOMATCH) {
-					temprel = pstrdup(de->d_name);
-					for (i = 0, t = strtok_r(temprel, "_", &tokptr); t != NULL; i++, t = strtok_r(NULL, "_", &tokptr))
-					{
-						if (i == 1) {
-							orph = palloc(sizeof(*orph));
-							relfilename = strdup(t);
-							relfilenode = (Oid) strtoul(relfilename, &relfilename, 10);
-							/* If RelidByRelfilenodeDirty does not return a valid oid
-							 * then we consider this file as orphaned
-							 */
-							oidrel = RelidByRelfilenodeDirty(reltablespace, relfilenode);
-							if (!OidIsValid(oidrel)) {
-								orph->dbname = strdup(dbname);
-								orph->path = strdup(dir);
-								orph->name = strdup(de->d_name);
-								orph->size = (int64) attrib.st_size;
-								orph->mod_time = time_t_to_timestamptz(attrib.st_mtime);
-								orph->relfilenode = relfilenode;
-								orph->reloid = oidrel;
-								*flist = lappend(*flist, orph);
-								/* _fsm case has already been handled for temp */
-								/* _init would have been too but _init on temp is not possible */
-							}
-						}	
-					}
-				}
-				pfree(wstr);
-			} else {
-				/* regex didn't compile */
-				pg_regerror(regcomp_result, preg, errMsg, sizeof(errMsg));
-						ereport(ERROR,
-							(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
-							errmsg("invalid regular expression: %s", errMsg)));
-			}
-			pg_regfree(preg);
+	/* the backup directory is never scanned incrementally */
+	if (!pgorph_incremental)
+		pgorph_incr_reset();
+	pgorph_incremental_scan = pgorph_incremental && !restore;
+
+	/* let background workers scan the directories if configured to */
+	if (pgorph_incremental_scan ||
+		!pgorph_parallel_scan(dirs, dbOid, dbName, sink))
+	{
+		/* choose how the relfilenodes will be checked against pg_class */
+		pgorph_init_lookup();
+
+		foreach(cell, dirs)
+		{
+			PgOrphScanDir *sdir = (PgOrphScanDir *) lfirst(cell);
+
+			pgorph_scan_dir(sink, dbOid, dbName, sdir);
+			pgorph_ts_stats_add(&sdir->stats);
 		}
 	}
-	FreeDir(dirdesc);
+	pgorph_incremental_scan = false;
+
+	pgorph_scan_track_memory(sink->cxt);
+	pgorph_scan_end(oldcontext);
 }
 
 /*
- * function to move orphaned files
- * to the backup directory
- * the exact same directory tree is kept
+ * create the context of a scan and switch to it
  */
-Datum
-pg_move_orphaned(PG_FUNCTION_ARGS)
+static MemoryContext
+pgorph_scan_begin(void)
 {
-	Oid                     dbOid;
-	ListCell   *cell;
-	char *dir_to_create;
-	int nb_moved;
-
-	requireSuperuser();
-
-    if (PG_ARGISNULL(0))
-		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
-    else
-		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+	MemSet(&pgorph_stats, 0, sizeof(pgorph_stats));
+	pgorph_ts_nstats = 0;
+	INSTR_TIME_SET_CURRENT(pgorph_scan_start);
 
-	dbOid = MyDatabaseId;
-	pg_build_orphaned_list(dbOid, false);
-	dir_to_create = psprintf("%s/%d", orphaned_backup_dir, dbOid);
+	/* a scan interrupted by an error went away with its parent */
+	pgorph_scan_context = AllocSetContextCreate(CurrentMemoryContext,
+												"pg_orphaned scan",
+												ALLOCSET_DEFAULT_SIZES);
 
-	verify_dir_is_empty_or_create(dir_to_create, &made_directory, &found_existing_directory, true);
-	nb_moved = 0;
+	return MemoryContextSwitchTo(pgorph_scan_context);
+}
 
-	/* going through the list of orphaned files */
-#if (PG_VERSION_NUM < 130000)
-	for (cell = list_head(list_orphaned_relations); cell != NULL; cell = lnext(cell))
-#else
-	for (cell = list_head(list_orphaned_relations); cell != NULL; cell = lnext(list_orphaned_relations, cell))
-#endif
-	{
-		char  orphaned_file[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
-		char  orphaned_file_backup_dir[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
-		char  orphaned_file_backup[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
+static void
+pgorph_scan_end(MemoryContext oldcontext)
+{
+	PGORPH_PHASE_END(pgorph_scan_start, elapsed_time);
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(pgorph_scan_context);
+	pgorph_scan_context = NULL;
+}
 
-		OrphanedRelation  *orph = (OrphanedRelation *)lfirst(cell);
+/*
+ * allocations done by the scan itself, counted in the statistics
+ */
+static void *
+pgorph_scan_alloc(MemoryContext cxt, Size size)
+{
+	pgorph_stats.allocations++;
+	pgorph_stats.allocated_bytes += size;
 
-        snprintf(orphaned_file, sizeof(orphaned_file), "%s/%s", orph->path, orph->name);
-        snprintf(orphaned_file_backup_dir, sizeof(orphaned_file_backup_dir), "%s/%s", dir_to_create, orph->path);
+	return MemoryContextAlloc(cxt, size);
+}
 
-		/*
-		 * Create the directory if it does not exist
-		 */
-		if (pg_orphaned_check_dir(orphaned_file_backup_dir) == 0)
-			verify_dir_is_empty_or_create(orphaned_file_backup_dir, &made_directory, &found_existing_directory, false);
+/*
+ * record the memory used by the scan context and the given one
+ * (where the results are kept), if more than seen so far
+ */
+static void
+pgorph_scan_track_memory(MemoryContext extra)
+{
+	int64		used;
 
-        snprintf(orphaned_file_backup, sizeof(orphaned_file_backup), "%s/%s", orphaned_file_backup_dir, orph->name);
+#if PG_VERSION_NUM >= 130000
+	used = pgorph_scan_context != NULL ?
+		MemoryContextMemAllocated(pgorph_scan_context, true) : 0;
+	if (extra != NULL)
+		used += MemoryContextMemAllocated(extra, true);
+#else
+	/* only what the scan allocated itself can be measured */
+	used = pgorph_stats.allocated_bytes;
+#endif
 
-        /* If old enough, move the orphaned file and check the success */
-        if (orph->mod_time <= limitts)
-        {
-            if (rename(orphaned_file, orphaned_file_backup) != 0)
-                ereport(ERROR,
-                        (errcode_for_file_access(),
-                        errmsg("could not rename \"%s\" to \"%s\": %m",
-                        orphaned_file, orphaned_file_backup)));
-            else
-                nb_moved++;
-        }
-	}
-	PG_RETURN_INT32(nb_moved);
+	if (used > pgorph_stats.peak_memory)
+		pgorph_stats.peak_memory = used;
 }
 
 /*
- * function to remove the orphaned files
- * we basically remove the whole backup directory
- * for this database
+ * add the statistics of a parallel scan worker
  */
-Datum
-pg_remove_moved_orphaned(PG_FUNCTION_ARGS)
+static void
+pgorph_stats_accumulate(PgOrphScanStats *stats)
 {
+	pgorph_stats.directories += stats->directories;
+	pgorph_stats.files += stats->files;
+	pgorph_stats.stat_calls += stats->stat_calls;
+	pgorph_stats.stat_calls_saved += stats->stat_calls_saved;
+	pgorph_stats.stat_batches += stats->stat_batches;
+	pgorph_stats.entries += stats->entries;
+	pgorph_stats.catalog_probes += stats->catalog_probes;
+	pgorph_stats.cache_hits += stats->cache_hits;
+	pgorph_stats.cache_misses += stats->cache_misses;
+	pgorph_stats.invalidations += stats->invalidations;
+	pgorph_stats.orphaned += stats->orphaned;
+	pgorph_stats.orphaned_size += stats->orphaned_size;
+	pgorph_stats.allocations += stats->allocations;
+	pgorph_stats.allocated_bytes += stats->allocated_bytes;
+	pgorph_stats.shared_cache_hits += stats->shared_cache_hits;
+	pgorph_stats.shared_cache_evictions += stats->shared_cache_evictions;
+	pgorph_stats.temp_owner_gone += stats->temp_owner_gone;
+	pgorph_stats.readdir_time += stats->readdir_time;
+	pgorph_stats.stat_time += stats->stat_time;
+	pgorph_stats.catalog_time += stats->catalog_time;
+	pgorph_stats.emit_time += stats->emit_time;
+	/* elapsed_time is the one of the leader */
+	/* the workers and the leader don't share their memory */
+	pgorph_stats.peak_memory += stats->peak_memory;
+}
 
-	Oid                     dbOid;
-	char *dir_to_remove;
-
-	requireSuperuser();
+/*
+ * get the last checkpoint time from a copy of the control file
+ */
+static TimestampTz
+pgorph_last_checkpoint_time(void)
+{
+	ControlFileData *ControlFile;
+	bool        crc_ok;
+	time_t      time_tmp;
 
-	dbOid = MyDatabaseId;
+#if PG_VERSION_NUM >= 120000
+	ControlFile = get_controlfile(".", &crc_ok);
+#else
+	ControlFile = get_controlfile(".", NULL, &crc_ok);
+#endif
+	if (!crc_ok)
+		ereport(ERROR,(errmsg("pg_control CRC value is incorrect")));
 
-	dir_to_remove = psprintf("%s/%d", orphaned_backup_dir, dbOid);
+	time_tmp = (time_t) ControlFile->checkPointCopy.time;
+	pfree(ControlFile);
 
-	if (!rmtree(dir_to_remove, true))
-		ereport(WARNING,
-				(errmsg("could not remove directory \"%s\"", dir_to_remove)));
+	return time_t_to_timestamptz(time_tmp);
+}
 
-	/* Now remove the top directory if empty */
-	dir_to_remove = psprintf("%s", orphaned_backup_dir);
+static PgOrphScanDir *
+pgorph_make_scan_dir(const char *path, Oid reltablespace)
+{
+	PgOrphScanDir *sdir = pgorph_scan_alloc(CurrentMemoryContext, sizeof(PgOrphScanDir));
 
-	if (is_directory_empty(dir_to_remove) && !rmtree(dir_to_remove, true))
-		ereport(WARNING,
-				(errmsg("could not remove directory \"%s\"", dir_to_remove)));
+	sdir->reltablespace = reltablespace;
+	sdir->worker = 0;
+	sdir->spill = false;
+	sdir->restore = false;
+	memset(&sdir->stats, 0, sizeof(sdir->stats));
+	sdir->stats.reltablespace = reltablespace;
+	strlcpy(sdir->path, path, sizeof(sdir->path));
 
-	PG_RETURN_VOID();
+	return sdir;
 }
 
 /*
- * function to move back the backed up
- * orphaned files to their original location
- * we ensure that the files to restore are still
- * orphaned ones
+ * Scan the directories with dynamic background workers, one per tablespace
+ * or one per device depending on pg_orphaned.parallel_scan. Each worker
+ * connects to the database, runs the same dirty snapshot check and streams
+ * the orphaned files back through a shm_mq.
+ *
+ * Returns false if the directories have to be scanned by the caller.
  */
-Datum
-pg_move_back_orphaned(PG_FUNCTION_ARGS)
+static bool
+pgorph_parallel_scan(List *dirs, Oid dbOid, const char *dbName, PgOrphSink *sink)
 {
-
-	Oid                     dbOid;
+	int			ndirs = list_length(dirs);
+	int			ngroups = 0;
+	int			nworkers;
+	dev_t	   *devices;
+	Size		header_size;
+	dsm_segment *seg;
+	PgOrphParallelScan *pscan;
+	shm_mq_handle **mqh;
+	BackgroundWorkerHandle **handles;
+	bool	   *attached;
+	int			nattached = 0;
+	bool		leader_scan = false;
 	ListCell   *cell;
-	int nb_moved;
+	int			i;
 
-	requireSuperuser();
+	if (pgorph_parallel_mode == PGORPH_PARALLEL_OFF ||
+		pgorph_max_parallel_workers <= 0 || ndirs < 2)
+		return false;
 
-	dbOid = MyDatabaseId;
-	nb_moved = 0;
+	/* directories that do not exist don't need to be scanned */
+	devices = palloc(sizeof(dev_t) * ndirs);
+	foreach(cell, dirs)
+	{
+		PgOrphScanDir *sdir = (PgOrphScanDir *) lfirst(cell);
+		struct stat st;
+		int			g;
 
-	/*
-	 * Exists but empty
-	 */
-	if (pg_orphaned_check_dir(orphaned_backup_dir) != 4)
-		PG_RETURN_INT32(nb_moved);
+		if (stat(sdir->path, &st) < 0 || !S_ISDIR(st.st_mode))
+		{
+			sdir->worker = -1;
+			continue;
+		}
 
-	/* building the list of orphaned files
-	 * from the backup location: so the second arg is set to true
-	 */
-	pg_build_orphaned_list(dbOid, true);
+		/* one group per directory or per device */
+		g = ngroups;
+		if (pgorph_parallel_mode == PGORPH_PARALLEL_DEVICE)
+		{
+			for (g = 0; g < ngroups; g++)
+				if (devices[g] == st.st_dev)
+					break;
+		}
+		if (g == ngroups)
+			devices[ngroups++] = st.st_dev;
+		sdir->worker = g;
+	}
+	pfree(devices);
+
+	if (ngroups < 2)
+		return false;
+
+	nworkers = Min(ngroups, pgorph_max_parallel_workers);
+
+	/* set up the dynamic shared memory segment */
+	header_size = MAXALIGN(offsetof(PgOrphParallelScan, dirs) +
+						   sizeof(PgOrphScanDir) * ndirs);
+	seg = dsm_create(header_size + (Size) PGORPH_QUEUE_SIZE * nworkers, 0);
+	pscan = (PgOrphParallelScan *) dsm_segment_address(seg);
+
+	pscan->dboid = dbOid;
+	pscan->userid = GetUserId();
+	pscan->last_checkpoint_time = last_checkpoint_time;
+	pscan->lookup_mode = pgorph_lookup_mode;
+	pscan->shared_cache = pgorph_shared_cache;
+	pscan->filter = sink->filter;
+	pscan->nworkers = nworkers;
+	pscan->ndirs = ndirs;
+	i = 0;
+	foreach(cell, dirs)
+	{
+		PgOrphScanDir *sdir = (PgOrphScanDir *) lfirst(cell);
 
-	/* going through the list of orphaned files */
-#if (PG_VERSION_NUM < 130000)
-	for (cell = list_head(list_orphaned_relations); cell != NULL; cell = lnext(cell))
-#else
-	for (cell = list_head(list_orphaned_relations); cell != NULL; cell = lnext(list_orphaned_relations, cell))
+		memcpy(&pscan->dirs[i], sdir, sizeof(PgOrphScanDir));
+		if (sdir->worker >= 0)
+			pscan->dirs[i].worker = sdir->worker % nworkers;
+		i++;
+	}
+
+	mqh = palloc0(sizeof(shm_mq_handle *) * nworkers);
+	handles = palloc0(sizeof(BackgroundWorkerHandle *) * nworkers);
+	attached = palloc0(sizeof(bool) * nworkers);
+
+	for (i = 0; i < nworkers; i++)
+	{
+		BackgroundWorker worker;
+		shm_mq	   *mq;
+
+		pscan->done[i] = false;
+		MemSet(&pscan->stats[i], 0, sizeof(PgOrphScanStats));
+		pg_atomic_init_u32(&pscan->progress[i].dirs_done, 0);
+		pg_atomic_init_u64(&pscan->progress[i].files, 0);
+		pg_atomic_init_u64(&pscan->progress[i].orphaned, 0);
+		mq = shm_mq_create((char *) pscan + header_size + (Size) PGORPH_QUEUE_SIZE * i,
+						   PGORPH_QUEUE_SIZE);
+		shm_mq_set_receiver(mq, MyProc);
+
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_orphaned");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgorph_scan_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_orphaned scan worker %d", i);
+#if PG_VERSION_NUM >= 110000
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_orphaned scan worker");
 #endif
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+		worker.bgw_notify_pid = MyProcPid;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[i]))
+		{
+			/* no free slot, the leader will scan these directories itself */
+			leader_scan = true;
+			continue;
+		}
+
+		mqh[i] = shm_mq_attach(mq, seg, handles[i]);
+		attached[i] = true;
+		nattached++;
+	}
+
+	/* directories whose worker could not be launched */
+	if (leader_scan)
 	{
-		char  orphaned_file_backup[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
-		char  *orphaned_file_restore;
-		char  *orphaned_file_restore_dup;
+		pgorph_init_lookup();
 
-		OrphanedRelation  *orph = (OrphanedRelation *)lfirst(cell);
+		for (i = 0; i < ndirs; i++)
+		{
+			if (pscan->dirs[i].worker < 0 || attached[pscan->dirs[i].worker])
+				continue;
+			pgorph_scan_dir(sink, dbOid, dbName, &pscan->dirs[i]);
+		}
+	}
 
-		snprintf(orphaned_file_backup, sizeof(orphaned_file_backup), "%s/%s", orph->path, orph->name);
+	/* gather the orphaned files found by the workers */
+	while (nattached > 0)
+	{
+		bool		got_message = false;
 
-		/* remove first 2 directories used to locate the backup */	
-		orphaned_file_restore_dup = strdup(orphaned_file_backup);
-		orphaned_file_restore = strchr(orphaned_file_restore_dup, '/');
+		pgorph_progress_parallel(pscan, nworkers);
 
-		orphaned_file_restore_dup = orphaned_file_restore + 1;
-		orphaned_file_restore = strchr(orphaned_file_restore_dup, '/');
+		for (i = 0; i < nworkers; i++)
+		{
+			shm_mq_result res;
+			Size		nbytes;
+			void	   *data;
 
-		/* move the orphaned files back to their original location */
-		if (rename(orphaned_file_backup, orphaned_file_restore + 1) != 0)
-			ereport(ERROR,
-				(errcode_for_file_access(),
-					errmsg("could not rename \"%s\" to \"%s\": %m",
-						orphaned_file_backup, orphaned_file_restore+1)));
-		else
-			nb_moved++;
+			if (!attached[i])
+				continue;
+
+			res = shm_mq_receive(mqh[i], &nbytes, &data, true);
+			if (res == SHM_MQ_SUCCESS)
+			{
+				OrphanedRelation orph;
+
+				pgorph_deserialize_orphan(&orph, data, nbytes, dbName);
+				pgorph_emit(sink, &orph);
+				got_message = true;
+			}
+			else if (res == SHM_MQ_DETACHED)
+			{
+				if (!pscan->done[i])
+					ereport(ERROR,
+						(errmsg("pg_orphaned scan worker %d exited before completing its scan", i)));
+				attached[i] = false;
+				nattached--;
+			}
+		}
+
+		if (!got_message && nattached > 0)
+			pgorph_wait_for_workers();
 	}
-	PG_RETURN_INT32(nb_moved);
+
+	for (i = 0; i < nworkers; i++)
+	{
+		if (handles[i] != NULL && pscan->done[i])
+			pgorph_stats_accumulate(&pscan->stats[i]);
+	}
+	for (i = 0; i < ndirs; i++)
+		pgorph_ts_stats_add(&pscan->dirs[i].stats);
+	pgorph_progress_dirs_done = ndirs;
+	pgorph_progress_scan();
+
+	dsm_detach(seg);
+	pfree(mqh);
+	pfree(handles);
+	pfree(attached);
+
+	return true;
 }
 
 /*
- * Verify that the given directory exists and is empty. If it does not
- * exist, it is created. If it exists but is not empty, an error will
- * be given and the process ended.
- * mainly a copy/paste from the verify_dir_is_empty_or_create() in pg_basebackup.c
+ * Wait until one of our background workers sends a message or exits
  */
 static void
-verify_dir_is_empty_or_create(char *dirname, bool *created, bool *found, bool display_hint)
+pgorph_wait_for_workers(void)
 {
-	switch (pg_orphaned_check_dir(dirname))
-	{
-		case 0:
-
-			/*
-			 * Does not exist, so create
-			 */
-			if (pg_orphaned_mkdir_p(dirname, pg_dir_create_mode) == -1)
-			{
-				ereport(ERROR,
-					(errcode_for_file_access(),
-					errmsg("could not create directory \"%s\": %m", dirname)));
-				exit(1);
-			}
-			if (created)
-				*created = true;
-			return;
-		case 1:
+	int			rc;
 
-			/*
-			 * Exists, empty
-			 */
-			if (found)
-				*found = true;
-			return;
-		case 2:
-		case 3:
-		case 4:
+	rc = WaitLatch(MyLatch, PGORPH_WL_FLAGS, 0, pgorph_wait_event(PGORPH_WAIT_WORKERS));
+#if PG_VERSION_NUM < 120000
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+#else
+	(void) rc;
+#endif
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+}
 
-			/*
-			 * Exists, not empty
-			 */
-			if (!display_hint)
-				ereport(ERROR,
-					(errcode_for_file_access(),
-					errmsg("directory \"%s\" exists but is not empty", dirname)));
-			else
-				ereport(ERROR,
-					(errcode_for_file_access(),
-					errmsg("directory \"%s\" exists but is not empty", dirname),
-					errhint(" please check no files exist with pg_list_orphaned_moved(), move them back (if any) with pg_move_back_orphaned() and then clean \"%s\" up with pg_remove_moved_orphaned()", dirname)));
-			exit(1);
-		case -1:
+/*
+ * scan a directory, keeping track of its own statistics
+ */
+static void
+pgorph_scan_dir(PgOrphSink *sink, Oid dboid, const char *dbname, PgOrphScanDir *sdir)
+{
+	PgOrphScanStats before = pgorph_stats;
+	instr_time	start;
 
-			/*
-			 * Access problem
-			 */
-			ereport(ERROR,
-				(errcode_for_file_access(),
-				errmsg("could not access directory \"%s\": %m", dirname)));
-			exit(1);
-	}
+	pgorph_progress_set(PGORPH_PROGRESS_TABLESPACE, sdir->reltablespace);
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (sdir->spill)
+		search_spill_files(sink, dbname, sdir->path, sdir->restore);
+	else
+		search_orphaned(sink, dboid, dbname, sdir->path, sdir->reltablespace);
+
+	if (pgorph_worker_progress != NULL)
+		pg_atomic_fetch_add_u32(&pgorph_worker_progress->dirs_done, 1);
+	pgorph_progress_dirs_done++;
+	pgorph_progress_scan();
+
+	pgorph_scan_dir_stats(sdir, &before, start);
 }
 
 /*
- * We don't want non superuser to execute the functions
+ * add to the statistics of a directory what has been done since before
+ * and start
  */
 static void
-requireSuperuser(void)
+pgorph_scan_dir_stats(PgOrphScanDir *sdir, PgOrphScanStats *before, instr_time start)
 {
-	if (!superuser())
-		ereport(ERROR,
-			(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-			errmsg("only superuser can execute pg_orphaned functions")));
+	instr_time	end;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+
+	sdir->stats.directories += pgorph_stats.directories - before->directories;
+	sdir->stats.entries += pgorph_stats.entries - before->entries;
+	sdir->stats.files += pgorph_stats.files - before->files;
+	sdir->stats.orphaned += pgorph_stats.orphaned - before->orphaned;
+	sdir->stats.orphaned_size += pgorph_stats.orphaned_size - before->orphaned_size;
+	sdir->stats.elapsed_time += (int64) INSTR_TIME_GET_MICROSEC(end);
 }
 
 /*
- * If exists add _init, _fsm if exists
- * to the list of orphaned files
+ * add the statistics of a directory to the ones of its tablespace,
+ * kept until the next scan of the session
  */
-void
-pgorph_add_suffix(List **flist, OrphanedRelation *orph)
+static void
+pgorph_ts_stats_add(PgOrphTablespaceScanStats *dstats)
 {
-	struct stat st;
-	char  orphaned_init_fsm[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
-	char  orphaned_name[10 + 6] = {0};
-	char add_suffix[NUMBER_SUFFIXES][MAX_SUFFIX_SIZE] = { "init", "fsm" };
-	int i;
+	static int	maxstats = 0;
+	PgOrphTablespaceScanStats *tstats = NULL;
+	int			i;
 
-	for (i = 0; i < NUMBER_SUFFIXES; i++)
+	for (i = 0; i < pgorph_ts_nstats; i++)
 	{
-		snprintf(orphaned_init_fsm, sizeof(orphaned_init_fsm), "%s/%s_%s", orph->path, orph->name, add_suffix[i]);
-		/* Does the corresponding file exist? */
-		if (lstat(orphaned_init_fsm, &st) < 0)
+		if (pgorph_ts_stats[i].reltablespace == dstats->reltablespace)
 		{
-			if (errno != ENOENT)
-				elog(ERROR, "could not stat file \"%s\": %m", orphaned_init_fsm);
+			tstats = &pgorph_ts_stats[i];
+			break;
 		}
-		else
-		/* file exists let's add it to the orphaned list */
-		{
-			OrphanedRelation *orph_suffix;
-			orph_suffix = palloc(sizeof(*orph_suffix));
-
-			/* most of the attributes are the same so just copy */
-			memcpy(orph_suffix, orph, sizeof(OrphanedRelation));
-
-			/* update specific attributes */
-			snprintf(orphaned_name, sizeof(orphaned_name), "%s_%s", orph_suffix->name, add_suffix[i]);
-			orph_suffix->name = strdup(orphaned_name);
-			orph_suffix->size = (int64) st.st_size;
-			orph_suffix->mod_time = time_t_to_timestamptz(st.st_mtime);
+	}
 
-			*flist = lappend(*flist, orph_suffix);
+	if (tstats == NULL)
+	{
+		if (pgorph_ts_nstats == maxstats)
+		{
+			maxstats = Max(8, maxstats * 2);
+			if (pgorph_ts_stats == NULL)
+				pgorph_ts_stats = MemoryContextAlloc(TopMemoryContext,
+													 maxstats * sizeof(PgOrphTablespaceScanStats));
+			else
+				pgorph_ts_stats = repalloc(pgorph_ts_stats,
+										   maxstats * sizeof(PgOrphTablespaceScanStats));
 		}
+		tstats = &pgorph_ts_stats[pgorph_ts_nstats++];
+		memset(tstats, 0, sizeof(PgOrphTablespaceScanStats));
+		tstats->reltablespace = dstats->reltablespace;
 	}
+
+	tstats->directories += dstats->directories;
+	tstats->entries += dstats->entries;
+	tstats->files += dstats->files;
+	tstats->orphaned += dstats->orphaned;
+	tstats->orphaned_size += dstats->orphaned_size;
+	tstats->elapsed_time += dstats->elapsed_time;
 }
 
 /*
- * Map a relation's (tablespace, filenode) to a relation's oid and cache the
- * result.
- *
- * This is the same as the existing RelidByRelfilenode in relfilenodemap.c but
- * it is done by using a DirtySnapshot as we want to see relation being created.
- *
- * Returns InvalidOid if no relation matching the criteria could be found.
+ * read a directory entry, as the time spent in the filesystem
  */
-Oid
-RelidByRelfilenodeDirty(Oid reltablespace, Oid relfilenode)
+static struct dirent *
+pgorph_readdir(DIR *dirdesc, const char *dir)
 {
-	RelfilenodeMapKeyDirty key;
-	RelfilenodeMapEntryDirty *entry;
-	bool            found;
-	SysScanDesc scandesc;
-	Relation        relation;
-	HeapTuple       ntp;
-	ScanKeyData skey[2];
-	Oid                     relid;
-	SnapshotData DirtySnapshot;
+	struct dirent *de;
+	instr_time	start;
+	bool		timed;
 
-	InitDirtySnapshot(DirtySnapshot);
-	if (RelfilenodeMapHashDirty == NULL)
-		InitializeRelfilenodeMapDirty();
+	timed = PGORPH_SAMPLE_START(pgorph_readdir_calls, start);
+	pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_READDIR));
+	de = ReadDir(dirdesc, dir);
+	pgstat_report_wait_end();
+	if (timed)
+		PGORPH_SAMPLE_END(start, readdir_time);
 
-	/* pg_class will show 0 when the value is actually MyDatabaseTableSpace */
-	if (reltablespace == MyDatabaseTableSpace)
-		reltablespace = 0;
+	if (de != NULL && ++pgorph_stats.entries % PGORPH_PROGRESS_INTERVAL == 0)
+		pgorph_progress_scan();
 
-	MemSet(&key, 0, sizeof(key));
-	key.reltablespace = reltablespace;
-	key.relfilenode = relfilenode;
+	return de;
+}
 
-	/*
-	 * Check cache and return entry if one is found. Even if no target
-	 * relation can be found later on we store the negative match and return a
-	 * InvalidOid from cache. That's not really necessary for performance
-	 * since querying invalid values isn't supposed to be a frequent thing,
-	 * but it's basically free.
-	 */
-	entry = hash_search(RelfilenodeMapHashDirty, (void *) &key, HASH_FIND, &found);
+/*
+ * true for a name too long to be the one of a relation file, or of a
+ * temporary file, which is skipped
+ */
+static bool
+pgorph_name_too_long(const char *dir, const char *name)
+{
+	if (strlen(name) < PGORPH_MAX_FILENAME)
+		return false;
 
-	if (found)
-		return entry->relid;
+	ereport(DEBUG1,
+			(errmsg_internal("skipping \"%s/%s\": name too long for a relation file",
+							 dir, name)));
+	return true;
+}
 
-	/* ok, no previous cache entry, do it the hard way */
+/*
+ * start publishing the progress of a function, in its backend entry
+ */
+static void
+pgorph_progress_start(PgOrphProgressCommand command)
+{
+	const int	index[] = {
+		PGORPH_PROGRESS_MARKER,
+		PGORPH_PROGRESS_COMMAND
+	};
+	int64		val[2];
+
+	pgstat_progress_start_command(PROGRESS_COMMAND_INVALID, InvalidOid);
+	val[0] = (int64) GetCurrentStatementStartTimestamp();
+	val[1] = command;
+	pgstat_progress_update_multi_param(2, index, val);
+
+	pgorph_progress_active = true;
+	pgorph_progress_dirs_done = 0;
+}
 
-	/* initialize empty/negative cache entry before doing the actual lookups */
-	relid = InvalidOid;
+static void
+pgorph_progress_phase(PgOrphProgressPhase phase)
+{
+	pgorph_progress_set(PGORPH_PROGRESS_PHASE, phase);
+}
 
-	if (reltablespace == GLOBALTABLESPACE_OID)
+static void
+pgorph_progress_set(int index, int64 val)
+{
+	if (pgorph_progress_active)
+		pgstat_progress_update_param(index, val);
+}
+
+/*
+ * publish the directories and files scanned so far: by the leader in
+ * its backend entry, by a scan worker for its leader
+ */
+static void
+pgorph_progress_scan(void)
+{
+	if (pgorph_worker_progress != NULL)
 	{
-		/*
-		 * Ok, shared table, check relmapper.
-		 */
-#if PG_VERSION_NUM >= 160000
-		relid = RelationMapFilenumberToOid(relfilenode, true);
-#else
-		relid = RelationMapFilenodeToOid(relfilenode, true);
-#endif
+		pg_atomic_write_u64(&pgorph_worker_progress->files, pgorph_stats.files);
+		pg_atomic_write_u64(&pgorph_worker_progress->orphaned, pgorph_stats.orphaned);
 	}
-	else
+	else if (pgorph_progress_active)
 	{
-		/*
-		 * Not a shared table, could either be a plain relation or a
-		 * non-shared, nailed one, like e.g. pg_class.
-		 */
-		/* check for plain relations by looking in pg_class */
-#if PG_VERSION_NUM >= 120000
-		relation = table_open(RelationRelationId, AccessShareLock);
-#else
-		relation = heap_open(RelationRelationId, AccessShareLock);
-#endif
-		/* copy scankey to local copy, it will be modified during the scan */
-		memcpy(skey, relfilenode_skey_dirty, sizeof(skey));
+		const int	index[] = {
+			PGORPH_PROGRESS_DIRS_DONE,
+			PGORPH_PROGRESS_FILES,
+			PGORPH_PROGRESS_ORPHANED
+		};
+		int64		val[3];
+
+		val[0] = pgorph_progress_dirs_done;
+		val[1] = pgorph_stats.files;
+		val[2] = pgorph_stats.orphaned;
+		pgstat_progress_update_multi_param(3, index, val);
+	}
+}
 
-		/* set scan arguments */
-		skey[0].sk_argument = ObjectIdGetDatum(reltablespace);
-		skey[1].sk_argument = ObjectIdGetDatum(relfilenode);
+/*
+ * the leader of a parallel scan adds the progress of its workers to its own
+ */
+static void
+pgorph_progress_parallel(PgOrphParallelScan *pscan, int nworkers)
+{
+	const int	index[] = {
+		PGORPH_PROGRESS_DIRS_DONE,
+		PGORPH_PROGRESS_FILES,
+		PGORPH_PROGRESS_ORPHANED
+	};
+	int64		val[3];
+	int			i;
+
+	if (!pgorph_progress_active)
+		return;
 
-		scandesc = systable_beginscan(relation,
-							ClassTblspcRelfilenodeIndexId,
-							true,
-							&DirtySnapshot,
-							2,
-							skey);
+	val[0] = pgorph_progress_dirs_done;
+	val[1] = pgorph_stats.files;
+	val[2] = pgorph_stats.orphaned;
+	for (i = 0; i < nworkers; i++)
+	{
+		val[0] += pg_atomic_read_u32(&pscan->progress[i].dirs_done);
+		val[1] += (int64) pg_atomic_read_u64(&pscan->progress[i].files);
+		val[2] += (int64) pg_atomic_read_u64(&pscan->progress[i].orphaned);
+	}
+	pgstat_progress_update_multi_param(3, index, val);
+}
 
-		found = false;
+static void
+pgorph_progress_end(void)
+{
+	if (!pgorph_progress_active)
+		return;
+	pgstat_progress_update_param(PGORPH_PROGRESS_MARKER, 0);
+	pgstat_progress_end_command();
+	pgorph_progress_active = false;
+}
 
-		while (HeapTupleIsValid(ntp = systable_getnext(scandesc)))
-		{
-#if PG_VERSION_NUM >= 120000
-			Form_pg_class classform = (Form_pg_class) GETSTRUCT(ntp);
-			found = true;
+/*
+ * An error leaves the state of the function that was running behind: the
+ * progress, ended by the abort, and the scan context, deleted with its
+ * parent. Forget them so the next call of the session starts clean.
+ */
+static void
+pgorph_abort_cleanup(void)
+{
+	pgorph_progress_active = false;
+	pgorph_worker_progress = NULL;
+	pgorph_scan_context = NULL;
+	pgorph_incremental_scan = false;
+}
 
-			Assert(classform->reltablespace == reltablespace);
-			Assert(classform->relfilenode == relfilenode);
-			relid = classform->oid;
-#else
-			found = true;
-			relid = HeapTupleGetOid(ntp);
-#endif
-		}
+static void
+pgorph_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		pgorph_abort_cleanup();
+}
 
-		systable_endscan(scandesc);
-#if PG_VERSION_NUM >= 120000
-		table_close(relation, AccessShareLock);
+static void
+pgorph_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		pgorph_abort_cleanup();
+}
+
+static uint32
+pgorph_wait_event(PgOrphWaitEvent event)
+{
+#if PG_VERSION_NUM >= 170000
+	static uint32 events[PGORPH_WAIT_COUNT];
+	static const char *const names[PGORPH_WAIT_COUNT] = {
+		"PgOrphanedReadDir",
+		"PgOrphanedStat",
+		"PgOrphanedCopy",
+		"PgOrphanedRemove",
+		"PgOrphanedWorkers",
+		"PgOrphanedThrottle",
+		"PgOrphanedScannerIdle"
+	};
+
+	if (events[event] == 0)
+		events[event] = WaitEventExtensionNew(names[event]);
+	return events[event];
 #else
-		heap_close(relation, AccessShareLock);
+	return PG_WAIT_EXTENSION;
 #endif
-		/* check for tables that are mapped but not shared */
-		if (!found)
-#if PG_VERSION_NUM >= 160000
-			relid = RelationMapFilenumberToOid(relfilenode, false);
+}
+
+/*
+ * Wire format of an orphaned file sent by a scan worker: the fixed part
+ * followed by the path and the name, both null terminated.
+ */
+static void
+pgorph_serialize_orphan(StringInfo buf, OrphanedRelation *orph)
+{
+	PgOrphWireRelation wire;
+
+	wire.size = orph->size;
+	wire.mod_time = orph->mod_time;
+	wire.relfilenode = orph->relfilenode;
+	wire.reloid = orph->reloid;
+
+	resetStringInfo(buf);
+	appendBinaryStringInfo(buf, (char *) &wire, sizeof(wire));
+	appendBinaryStringInfo(buf, orph->path, strlen(orph->path) + 1);
+	appendBinaryStringInfo(buf, orph->name, strlen(orph->name) + 1);
+}
+
+static void
+pgorph_deserialize_orphan(OrphanedRelation *orph, void *data, Size nbytes, const char *dbname)
+{
+	PgOrphWireRelation wire;
+	char	   *path;
+
+	if (nbytes < sizeof(wire) + 2)
+		elog(ERROR, "invalid message received from pg_orphaned scan worker");
+
+	memcpy(&wire, data, sizeof(wire));
+	path = (char *) data + sizeof(wire);
+
+	/* the path points into the message */
+	orph->dbname = dbname;
+	orph->path = path;
+	strlcpy(orph->name, path + strlen(path) + 1, sizeof(orph->name));
+	orph->size = wire.size;
+	orph->mod_time = wire.mod_time;
+	orph->relfilenode = wire.relfilenode;
+	orph->reloid = wire.reloid;
+}
+
+/*
+ * Entry point of the scan workers launched by pgorph_parallel_scan()
+ */
+void
+pgorph_scan_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	PgOrphParallelScan *pscan;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	Size		header_size;
+	PgOrphSink	sink;
+	MemoryContext oldcontext;
+	int			worker;
+	int			i;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&worker, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			errmsg("could not map dynamic shared memory segment")));
+	pscan = (PgOrphParallelScan *) dsm_segment_address(seg);
+
+	header_size = MAXALIGN(offsetof(PgOrphParallelScan, dirs) +
+						   sizeof(PgOrphScanDir) * pscan->ndirs);
+	mq = (shm_mq *) ((char *) pscan + header_size + (Size) PGORPH_QUEUE_SIZE * worker);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(pscan->dboid, pscan->userid, 0);
 #else
-			relid = RelationMapFilenodeToOid(relfilenode, false);
+	BackgroundWorkerInitializeConnectionByOid(pscan->dboid, pscan->userid);
 #endif
+
+	StartTransactionCommand();
+	oldcontext = pgorph_scan_begin();
+
+	last_checkpoint_time = pscan->last_checkpoint_time;
+	pgorph_lookup_mode = pscan->lookup_mode;
+	pgorph_shared_cache = pscan->shared_cache;
+	pgorph_init_lookup();
+
+	/* the orphaned files are streamed to the leader while walking */
+	pgorph_mq_sink_init(&sink, mqh);
+	sink.filter = pscan->filter;
+	pgorph_worker_progress = &pscan->progress[worker];
+
+	for (i = 0; i < pscan->ndirs; i++)
+	{
+		if (pscan->dirs[i].worker != worker)
+			continue;
+		/* the database name is filled in by the leader */
+		pgorph_scan_dir(&sink, pscan->dboid, "", &pscan->dirs[i]);
 	}
 
-	/*
-	 * Only enter entry into cache now, our opening of pg_class could have
-	 * caused cache invalidations to be executed which would have deleted a
-	 * new entry if we had entered it above.
-	 */
-	entry = hash_search(RelfilenodeMapHashDirty, (void *) &key, HASH_ENTER, &found);
-	if (found)
-		elog(ERROR, "corrupted hashtable");
-	entry->relid = relid;
+	pgorph_worker_progress = NULL;
+	pgorph_scan_track_memory(NULL);
+	pgorph_scan_end(oldcontext);
+	CommitTransactionCommand();
 
-	return relid;
+	memcpy(&pscan->stats[worker], &pgorph_stats, sizeof(PgOrphScanStats));
+	pscan->done[worker] = true;
+	dsm_detach(seg);
 }
 
 /*
- *  Flush mapping entries when pg_class is updated in a relevant fashion.
- *  Same as RelfilenodeMapInvalidateCallback in relfilenodemap.c
+ * function to build the list of orphaned files
+ * of all the databases of the cluster
+ * base/ and pg_tblspc/ are walked only once, then
+ * the relfilenodes found for each database are checked
+ * against its catalog by a pool of background workers
+ * and only the files missing from it are stat'ed
  */
 static void
-RelfilenodeMapInvalidateCallbackDirty(Datum arg, Oid relid)
+pg_build_orphaned_cluster_list(PgOrphSink *sink)
 {
+	HTAB	   *dbs;
+	HASHCTL		ctl;
 	HASH_SEQ_STATUS status;
-	RelfilenodeMapEntryDirty *entry;
+	PgOrphClusterDb *db;
+	MemoryContext oldcontext;
+	int			i;
+	int			next;
 
-	/* callback only gets registered after creating the hash */
-	Assert(RelfilenodeMapHashDirty != NULL);
+	oldcontext = pgorph_scan_begin();
+	last_checkpoint_time = pgorph_last_checkpoint_time();
 
-	hash_seq_init(&status, RelfilenodeMapHashDirty);
-	while ((entry = (RelfilenodeMapEntryDirty *) hash_seq_search(&status)) != NULL)
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(PgOrphClusterDb);
+	ctl.hcxt = pgorph_scan_context;
+	dbs = hash_create("pg_orphaned cluster scan", 64, &ctl,
+					  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pgorph_progress_phase(PGORPH_PHASE_SCANNING);
+	pgorph_cluster_walk(dbs);
+	pgorph_progress_phase(PGORPH_PHASE_CHECKING);
+	pgorph_cluster_check(dbs);
+
+	hash_seq_init(&status, dbs);
+	while ((db = (PgOrphClusterDb *) hash_seq_search(&status)) != NULL)
 	{
+		PgOrphPending *pending;
+		Oid		   *spcs;
+		int			npending = 0;
+
+		if (!db->checked)
+			continue;
+
+		pending = pgorph_scan_alloc(pgorph_scan_context,
+									sizeof(PgOrphPending) * Max(db->nfiles, 1));
+		spcs = pgorph_scan_alloc(pgorph_scan_context, sizeof(Oid) * Max(db->nfiles, 1));
+		/* only the files missing from the catalog are left to look at */
+		for (i = 0; i < db->nfiles; i++)
+		{
+			PgOrphClusterFile *file = &db->files[i];
+			PgOrphCandidate *cand = &db->candidates[i];
+			PgOrphPending *p;
+
+			if (OidIsValid(cand->reloid))
+				continue;
+
+			p = &pending[npending++];
+			memset(&p->row, 0, sizeof(OrphanedRelation));
+			p->row.dbname = db->dbname;
+			p->row.path = file->path;
+			strlcpy(p->row.name, file->name, sizeof(p->row.name));
+			p->row.relfilenode = cand->relfilenode;
+			p->row.reloid = InvalidOid;
+			(void) pgorph_parse_filename(file->name, &p->fname);
+			p->fstate = NULL;
+			p->have_stat = false;
+			p->owner_gone = cand->owner_gone;
+			p->err = 0;
+			spcs[npending - 1] = cand->reltablespace;
+		}
+
 		/*
-		 * If relid is InvalidOid, signalling a complete reset, we must remove
-		 * all entries, otherwise just remove the specific relation's entry.
-		 * Always remove negative cache entries.
+		 * Stat'ed by batches and grouped per relfilenode as in
+		 * search_orphaned(), one directory at a time to count its
+		 * orphaned files in the statistics of its tablespace.
 		 */
-		if (relid == InvalidOid ||      /* complete reset */
-			entry->relid == InvalidOid ||   /* negative cache entry */
-			entry->relid == relid)  /* individual flushed relation */
+		for (i = 0; i < npending; i = next)
 		{
-			if (hash_search(RelfilenodeMapHashDirty,
-							(void *) &entry->key,
-							HASH_REMOVE,
-							NULL) == NULL)
-						elog(ERROR, "hash table corrupted");
+			PgOrphScanStats before = pgorph_stats;
+			PgOrphTablespaceScanStats dstats;
+			int			from;
+
+			for (next = i + 1; next < npending; next++)
+			{
+				if (pending[next].row.path != pending[i].row.path)
+					break;
+			}
+
+			/* the catalog of the database has been checked already */
+			for (from = i; from < next; from += PGORPH_STAT_BATCH)
+				pgorph_stat_pending(NULL, pending[i].row.path, spcs[i], pending,
+									from, Min(from + PGORPH_STAT_BATCH, next), false);
+
+			pgorph_report_groups(sink, NULL, pending + i, next - i, NULL, false);
+
+			memset(&dstats, 0, sizeof(dstats));
+			dstats.reltablespace = spcs[i];
+			dstats.orphaned = pgorph_stats.orphaned - before.orphaned;
+			dstats.orphaned_size = pgorph_stats.orphaned_size - before.orphaned_size;
+			pgorph_ts_stats_add(&dstats);
 		}
+		pfree(pending);
+		pfree(spcs);
 	}
+	pgorph_progress_scan();
+
+	/* the hash table and the files go away with the scan context */
+	pgorph_scan_track_memory(sink->cxt);
+	pgorph_scan_end(oldcontext);
 }
 
 /*
- * Initialize cache, either on first use or after a reset.
- * Same as InitializeRelfilenodeMap in relfilenodemap.c
+ * walk base/ and the current version directory of each tablespace
  */
 static void
-InitializeRelfilenodeMapDirty(void)
+pgorph_cluster_walk(HTAB *dbs)
 {
-	HASHCTL         ctl;
-	int                     i;
+	DIR                *dirdesc;
+	struct dirent *direntry;
+	char            dir[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY)];
 
-	/* Make sure we've initialized CacheMemoryContext. */
-	if (CacheMemoryContext == NULL)
+	/* default tablespace */
+	pgorph_cluster_walk_tablespace(dbs, "base", 0);
+
+	/* non-default tablespaces */
+	dirdesc = AllocateDir("pg_tblspc");
+
+	while ((direntry = ReadDir(dirdesc, "pg_tblspc")) != NULL)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (strcmp(direntry->d_name, ".") == 0 ||
+			strcmp(direntry->d_name, "..") == 0)
+			continue;
+
+		snprintf(dir, sizeof(dir), "pg_tblspc/%s/%s",
+			direntry->d_name, TABLESPACE_VERSION_DIRECTORY);
+
+		pgorph_cluster_walk_tablespace(dbs, dir, (Oid) strtoul(direntry->d_name, NULL, 10));
+	}
+	FreeDir(dirdesc);
+}
+
+static void
+pgorph_cluster_walk_tablespace(HTAB *dbs, const char *tbsdir, Oid reltablespace)
+{
+	DIR                *dirdesc;
+	struct dirent *de;
+	char            dir[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY)];
+
+	dirdesc = AllocateDir(tbsdir);
+	if (!dirdesc)
+		return;
+
+	while ((de = ReadDir(dirdesc, tbsdir)) != NULL)
+	{
+		Oid			dboid;
+		char	   *endptr;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* only the database directories, pgsql_tmp and others are skipped */
+		if (!isdigit((unsigned char) de->d_name[0]))
+			continue;
+		dboid = (Oid) strtoul(de->d_name, &endptr, 10);
+		if (*endptr != '\0' || !OidIsValid(dboid))
+			continue;
+
+		snprintf(dir, sizeof(dir), "%s/%s", tbsdir, de->d_name);
+		pgorph_cluster_walk_db(dbs, dir, dboid, reltablespace);
+	}
+	FreeDir(dirdesc);
+}
+
+/*
+ * record the relation files of a database directory
+ * the file selection is the same as in search_orphaned()
+ */
+static void
+pgorph_cluster_walk_db(HTAB *dbs, const char *dir, Oid dboid, Oid reltablespace)
+{
+	DIR                *dirdesc;
+	struct dirent *de;
+	PgOrphClusterDb *db = NULL;
+	char	   *dircopy = NULL;
+	PgOrphScanStats before = pgorph_stats;
+	PgOrphTablespaceScanStats dstats;
+	instr_time	start;
+	instr_time	end;
+
+	pgorph_progress_set(PGORPH_PROGRESS_TABLESPACE, reltablespace);
+
+	INSTR_TIME_SET_CURRENT(start);
+	dirdesc = AllocateDir(dir);
+	if (!dirdesc)
+		return;
+	pgorph_stats.directories++;
+
+	while ((de = pgorph_readdir(dirdesc, dir)) != NULL)
+	{
+		PgOrphFileName fname;
+		bool		found;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Skip hidden files, and names too long for a relation file */
+		if (de->d_name[0] == '.' || pgorph_name_too_long(dir, de->d_name))
+			continue;
+
+#ifdef DT_REG
+		/* no need to stat what the directory entry says is not a file */
+		if (de->d_type != DT_UNKNOWN && de->d_type != DT_REG && de->d_type != DT_LNK)
+		{
+			pgorph_stats.stat_calls_saved++;
+			continue;
+		}
+#endif
+
+		/*
+		 * As in search_orphaned(), the name is enough: only the files
+		 * missing from the catalog of their database are stat'ed, once
+		 * it has been checked.
+		 */
+		if (!pgorph_parse_filename(de->d_name, &fname))
+			continue;
+		pgorph_stats.files++;
+
+		if (db == NULL)
+		{
+			db = (PgOrphClusterDb *) hash_search(dbs, &dboid, HASH_ENTER, &found);
+			if (!found)
+			{
+				db->dbname = NULL;
+				db->checked = false;
+				db->nfiles = 0;
+				db->maxfiles = 64;
+				db->files = pgorph_scan_alloc(pgorph_scan_context,
+											  sizeof(PgOrphClusterFile) * db->maxfiles);
+				db->candidates = pgorph_scan_alloc(pgorph_scan_context,
+												   sizeof(PgOrphCandidate) * db->maxfiles);
+			}
+		}
+		if (dircopy == NULL)
+		{
+			dircopy = pgorph_scan_alloc(pgorph_scan_context, strlen(dir) + 1);
+			strcpy(dircopy, dir);
+		}
+
+		if (db->nfiles == db->maxfiles)
+		{
+			pgorph_stats.allocations += 2;
+			pgorph_stats.allocated_bytes += (sizeof(PgOrphClusterFile) + sizeof(PgOrphCandidate)) * db->maxfiles;
+			db->maxfiles *= 2;
+			db->files = repalloc_huge(db->files, sizeof(PgOrphClusterFile) * db->maxfiles);
+			db->candidates = repalloc_huge(db->candidates, sizeof(PgOrphCandidate) * db->maxfiles);
+		}
+
+		db->files[db->nfiles].path = dircopy;
+		strlcpy(db->files[db->nfiles].name, de->d_name, PGORPH_MAX_FILENAME);
+		db->candidates[db->nfiles].reltablespace = reltablespace;
+		db->candidates[db->nfiles].relfilenode = fname.relfilenode;
+		db->candidates[db->nfiles].owner_gone = fname.backend >= 0 &&
+			!pgorph_temp_owner_alive(fname.backend, dboid);
+		db->candidates[db->nfiles].reloid = InvalidOid;
+		db->nfiles++;
+	}
+	FreeDir(dirdesc);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+
+	pgorph_progress_dirs_done++;
+	pgorph_progress_scan();
+
+	/* the orphaned files are added once the catalogs have been checked */
+	memset(&dstats, 0, sizeof(dstats));
+	dstats.reltablespace = reltablespace;
+	dstats.directories = pgorph_stats.directories - before.directories;
+	dstats.entries = pgorph_stats.entries - before.entries;
+	dstats.files = pgorph_stats.files - before.files;
+	dstats.elapsed_time = (int64) INSTR_TIME_GET_MICROSEC(end);
+	pgorph_ts_stats_add(&dstats);
+}
+
+/*
+ * Check the relfilenodes of each database against its catalog.
+ * The database we are connected to is checked locally, the others by a
+ * pool of at most pg_orphaned.max_parallel_workers background workers.
+ */
+static void
+pgorph_cluster_check(HTAB *dbs)
+{
+	HASH_SEQ_STATUS status;
+	PgOrphClusterDb *db;
+	PgOrphClusterDb *localdb = NULL;
+	PgOrphClusterDb **taskdbs;
+	int			ntasks = 0;
+	Size		ncandidates = 0;
+	Size		header_size;
+	dsm_segment *seg = NULL;
+	PgOrphClusterScan *cscan = NULL;
+	PgOrphCandidate *candidates = NULL;
+	BackgroundWorkerHandle **handles = NULL;
+	int			maxworkers = Max(pgorph_max_parallel_workers, 1);
+	int			next = 0;
+	int			running = 0;
+	bool		local_done = false;
+	int			i;
+
+	taskdbs = palloc(sizeof(PgOrphClusterDb *) * Max(hash_get_num_entries(dbs), 1));
+
+	hash_seq_init(&status, dbs);
+	while ((db = (PgOrphClusterDb *) hash_seq_search(&status)) != NULL)
+	{
+		db->dbname = pgorph_database_to_check(db->dboid);
+		if (db->dbname == NULL)
+			continue;
+
+		if (db->dboid == MyDatabaseId)
+		{
+			localdb = db;
+			continue;
+		}
+
+		taskdbs[ntasks++] = db;
+		ncandidates += db->nfiles;
+	}
+
+	if (ntasks > 0)
+	{
+		Size		offset = 0;
+
+		header_size = MAXALIGN(offsetof(PgOrphClusterScan, tasks) +
+							   sizeof(PgOrphClusterTask) * ntasks);
+		seg = dsm_create(header_size + sizeof(PgOrphCandidate) * ncandidates, 0);
+		cscan = (PgOrphClusterScan *) dsm_segment_address(seg);
+		candidates = (PgOrphCandidate *) ((char *) cscan + header_size);
+
+		cscan->userid = GetUserId();
+		cscan->last_checkpoint_time = last_checkpoint_time;
+		cscan->lookup_mode = pgorph_lookup_mode;
+		cscan->shared_cache = pgorph_shared_cache;
+		cscan->ntasks = ntasks;
+
+		for (i = 0; i < ntasks; i++)
+		{
+			cscan->tasks[i].dboid = taskdbs[i]->dboid;
+			cscan->tasks[i].offset = offset;
+			cscan->tasks[i].ncandidates = taskdbs[i]->nfiles;
+			cscan->tasks[i].done = false;
+			memcpy(candidates + offset, taskdbs[i]->candidates,
+				   sizeof(PgOrphCandidate) * taskdbs[i]->nfiles);
+			offset += taskdbs[i]->nfiles;
+		}
+
+		handles = palloc0(sizeof(BackgroundWorkerHandle *) * ntasks);
+	}
+
+	while (next < ntasks || running > 0 || !local_done)
+	{
+		/* launch workers up to the limit */
+		while (next < ntasks && running < maxworkers)
+		{
+			if (!pgorph_launch_cluster_worker(seg, next, &handles[next]))
+			{
+				if (running == 0 && local_done)
+					ereport(ERROR,
+						(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+						errmsg("could not register background worker"),
+						errhint("You might need to increase max_worker_processes.")));
+				break;
+			}
+			next++;
+			running++;
+		}
+
+		/* check our own database while the workers are running */
+		if (!local_done)
+		{
+			if (localdb != NULL)
+			{
+				pgorph_init_lookup();
+				pgorph_check_candidates(localdb->candidates, localdb->nfiles);
+				localdb->checked = true;
+			}
+			local_done = true;
+			continue;
+		}
+
+		if (running == 0 && next == ntasks)
+			break;
+
+		pgorph_wait_for_workers();
+
+		for (i = 0; i < next; i++)
+		{
+			pid_t		pid;
+
+			if (handles[i] == NULL ||
+				GetBackgroundWorkerPid(handles[i], &pid) != BGWH_STOPPED)
+				continue;
+
+			pfree(handles[i]);
+			handles[i] = NULL;
+			running--;
+
+			if (!cscan->tasks[i].done)
+			{
+				ereport(WARNING,
+					(errmsg("could not check the orphaned files of database \"%s\"",
+							taskdbs[i]->dbname)));
+				continue;
+			}
+
+			memcpy(taskdbs[i]->candidates, candidates + cscan->tasks[i].offset,
+				   sizeof(PgOrphCandidate) * taskdbs[i]->nfiles);
+			taskdbs[i]->checked = true;
+		}
+	}
+
+	if (seg != NULL)
+		dsm_detach(seg);
+	pfree(taskdbs);
+}
+
+/*
+ * Returns the name of the database if its files can be checked,
+ * NULL otherwise (the directory of a database being created or
+ * a database that does not accept connections).
+ */
+static char *
+pgorph_database_to_check(Oid dboid)
+{
+	HeapTuple	tup;
+	Form_pg_database dbform;
+	char	   *dbname;
+
+	tup = SearchSysCache1(DATABASEOID, ObjectIdGetDatum(dboid));
+	if (!HeapTupleIsValid(tup))
+		return NULL;
+
+	dbform = (Form_pg_database) GETSTRUCT(tup);
+
+	/* -2 is the datconnlimit of an invalid database */
+	if (!dbform->datallowconn || dbform->datconnlimit == -2)
+	{
+		ereport(DEBUG1,
+			(errmsg("skipping database \"%s\" as it does not accept connections",
+					NameStr(dbform->datname))));
+		ReleaseSysCache(tup);
+		return NULL;
+	}
+
+	dbname = pstrdup(NameStr(dbform->datname));
+	ReleaseSysCache(tup);
+
+	return dbname;
+}
+
+static bool
+pgorph_launch_cluster_worker(dsm_segment *seg, int task, BackgroundWorkerHandle **handle)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_orphaned");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgorph_cluster_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_orphaned cluster worker %d", task);
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_orphaned cluster worker");
+#endif
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	memcpy(worker.bgw_extra, &task, sizeof(int));
+	worker.bgw_notify_pid = MyProcPid;
+
+	return RegisterDynamicBackgroundWorker(&worker, handle);
+}
+
+/*
+ * check candidates against the catalog of the database we are connected to
+ */
+static void
+pgorph_check_candidates(PgOrphCandidate *candidates, int ncandidates)
+{
+	int			i;
+	instr_time	start;
+
+	for (i = 0; i < ncandidates; i++)
+	{
+		PgOrphCandidate *cand = &candidates[i];
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* orphaned whatever pg_class says, as in search_orphaned() */
+		if (cand->owner_gone)
+		{
+			pgorph_stats.temp_owner_gone++;
+			continue;
+		}
+
+		/*
+		 * The file has not been stat'ed, so a miss of the bulk loaded
+		 * entries is always confirmed with a probe: it may have been
+		 * created after the load.
+		 */
+		INSTR_TIME_SET_CURRENT(start);
+		cand->reloid = RelidByRelfilenodeDirty(cand->reltablespace, cand->relfilenode);
+		if (!OidIsValid(cand->reloid) && RelfilenodeMapDirtyComplete)
+			cand->reloid = RelidByRelfilenodeDirtyProbe(cand->reltablespace, cand->relfilenode);
+		PGORPH_PHASE_END(start, catalog_time);
+		if (OidIsValid(cand->reloid))
+			pgorph_stats.stat_calls_saved++;
+	}
+}
+
+/*
+ * Entry point of the workers launched by pgorph_cluster_check(), each
+ * of them checks the relfilenodes of one database.
+ */
+void
+pgorph_cluster_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	PgOrphClusterScan *cscan;
+	PgOrphClusterTask *task;
+	PgOrphCandidate *candidates;
+	int			taskno;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&taskno, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			errmsg("could not map dynamic shared memory segment")));
+	cscan = (PgOrphClusterScan *) dsm_segment_address(seg);
+	task = &cscan->tasks[taskno];
+	candidates = (PgOrphCandidate *) ((char *) cscan +
+									  MAXALIGN(offsetof(PgOrphClusterScan, tasks) +
+											   sizeof(PgOrphClusterTask) * cscan->ntasks));
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(task->dboid, cscan->userid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(task->dboid, cscan->userid);
+#endif
+
+	StartTransactionCommand();
+
+	last_checkpoint_time = cscan->last_checkpoint_time;
+	pgorph_lookup_mode = cscan->lookup_mode;
+	pgorph_shared_cache = cscan->shared_cache;
+	pgorph_init_lookup();
+	pgorph_check_candidates(candidates + task->offset, task->ncandidates);
+
+	CommitTransactionCommand();
+
+	task->done = true;
+	dsm_detach(seg);
+}
+
+Datum
+pg_list_orphaned_cluster(PG_FUNCTION_ARGS)
+{
+	PgOrphSink	sink;
+
+	requireSuperuser();
+
+	if (PG_ARGISNULL(0))
+		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
+	else
+		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+
+	pgorph_progress_start(PGORPH_COMMAND_LIST_CLUSTER);
+	pgorph_tuplestore_sink_init(&sink, fcinfo);
+	pg_build_orphaned_cluster_list(&sink);
+	pgorph_progress_end();
+	return (Datum) 0;
+}
+
+Datum
+pg_list_orphaned(PG_FUNCTION_ARGS)
+{
+	PgOrphSink	sink;
+
+	requireSuperuser();
+
+    if (PG_ARGISNULL(0))
+		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
+	else
+		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+
+	pgorph_progress_start(PGORPH_COMMAND_LIST);
+	pgorph_tuplestore_sink_init(&sink, fcinfo);
+
+	/* the 1.0 definition of the function only has older_than */
+	if (PG_NARGS() > 1 && !PG_ARGISNULL(1))
+	{
+		ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(1);
+		Datum	   *elems;
+		bool	   *elemnulls;
+		int			nelems;
+		int			i;
+
+		deconstruct_array(arr, OIDOID, sizeof(Oid), true, 'i',
+						  &elems, &elemnulls, &nelems);
+		for (i = 0; i < nelems; i++)
+		{
+			if (elemnulls[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("tablespaces must not contain nulls")));
+			sink.tablespaces = lappend_oid(sink.tablespaces, DatumGetObjectId(elems[i]));
+		}
+
+		/* an empty array asks for no tablespace at all */
+		if (sink.tablespaces == NIL)
+		{
+			pgorph_progress_end();
+			return (Datum) 0;
+		}
+	}
+
+	sink.filter.min_size = 0;
+	sink.filter.max_mod_time = DT_NOEND;
+	if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
+	{
+		sink.filter.min_size = PG_GETARG_INT64(2);
+		sink.filter.active = true;
+	}
+	if (PG_NARGS() > 3 && !PG_ARGISNULL(3))
+	{
+		sink.filter.max_mod_time = DatumGetTimestampTz(DirectFunctionCall2(timestamptz_mi_interval, TimestampTzGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(3))));
+		sink.filter.active = true;
+	}
+
+	pg_build_orphaned_list(MyDatabaseId, false, &sink);
+	pgorph_progress_end();
+	return (Datum) 0;
+}
+
+Datum
+pg_orphaned_summary(PG_FUNCTION_ARGS)
+{
+	PgOrphSink	sink;
+	int			top_n = PG_ARGISNULL(1) ? 10 : PG_GETARG_INT32(1);
+
+	requireSuperuser();
+
+	if (top_n < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("top_n must not be negative")));
+
+	if (PG_ARGISNULL(0))
+		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
+	else
+		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+
+	pgorph_progress_start(PGORPH_COMMAND_SUMMARY);
+	pgorph_summary_sink_init(&sink, top_n);
+	pg_build_orphaned_list(MyDatabaseId, false, &sink);
+	pgorph_summary_finish(&sink, fcinfo);
+	pgorph_progress_end();
+	return (Datum) 0;
+}
+
+Datum
+pg_list_orphaned_moved(PG_FUNCTION_ARGS)
+{
+	PgOrphSink	sink;
+
+	requireSuperuser();
+
+	pgorph_progress_start(PGORPH_COMMAND_LIST_MOVED);
+	pgorph_tuplestore_sink_init(&sink, fcinfo);
+	pg_build_orphaned_list(MyDatabaseId, true, &sink);
+	pgorph_progress_end();
+	return (Datum) 0;
+}
+
+/*
+ * path of the file holding the position of the chunked scan of a database
+ */
+static void
+pgorph_step_path(char *path, Oid dboid)
+{
+	snprintf(path, MAXPGPATH, "%s/scan_step_%u", PGORPH_STATE_DIR, dboid);
+}
+
+/*
+ * read the position of the chunked scan of a database, a new scan starts
+ * when there is none
+ */
+static void
+pgorph_step_load(Oid dboid, PgOrphStepState *state)
+{
+	char		path[MAXPGPATH];
+	FILE	   *file;
+	bool		valid = false;
+
+	pgorph_step_path(path, dboid);
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+	}
+	else
+	{
+		valid = fread(state, sizeof(PgOrphStepState), 1, file) == 1 &&
+			state->magic == PGORPH_STEP_MAGIC && state->dboid == dboid;
+		FreeFile(file);
+
+		if (!valid)
+			ereport(WARNING,
+					(errmsg("ignoring invalid pg_orphaned scan position file \"%s\"", path)));
+	}
+
+	if (!valid)
+	{
+		memset(state, 0, sizeof(PgOrphStepState));
+		state->magic = PGORPH_STEP_MAGIC;
+		state->dboid = dboid;
+	}
+}
+
+/*
+ * write a file of the pg_orphaned directory, replacing the previous one
+ * in one go
+ */
+static void
+pgorph_write_file(const char *path, const void *header, Size header_len,
+				  const void *data, Size data_len, bool exclusive)
+{
+	char		tmppath[MAXPGPATH];
+	char		dir[MAXPGPATH];
+	FILE	   *file;
+
+	strlcpy(dir, path, sizeof(dir));
+	get_parent_directory(dir);
+	if (pg_orphaned_check_dir(dir) == 0 &&
+		pg_orphaned_mkdir_p(dir, pg_dir_create_mode) == -1 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", dir)));
+
+	/* concurrent writers of an exclusive file do not share their temp file */
+	if (exclusive)
+		snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, MyProcPid);
+	else
+		snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+
+	if (fwrite(header, header_len, 1, file) != 1 ||
+		(data_len > 0 && fwrite(data, data_len, 1, file) != 1) ||
+		fflush(file) != 0 || pgorph_fsync(fileno(file)) != 0)
+	{
+		int			save_errno = errno;
+
+		FreeFile(file);
+		unlink(tmppath);
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+	}
+	if (FreeFile(file) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+
+	if (!exclusive)
+	{
+		(void) durable_rename(tmppath, path, ERROR);
+		return;
+	}
+
+	/* unlike rename(), link() does not replace a file created meanwhile */
+	if (link(tmppath, path) < 0)
+	{
+		int			save_errno = errno;
+
+		unlink(tmppath);
+		errno = save_errno;
+		if (errno == EEXIST)
+			ereport(ERROR,
+					(errcode(ERRCODE_DUPLICATE_FILE),
+					 errmsg("file \"%s\" already exists", path)));
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not link file \"%s\" to \"%s\": %m",
+						tmppath, path)));
+	}
+	if (unlink(tmppath) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", tmppath)));
+	pgorph_fsync_path(dir, true);
+}
+
+/*
+ * write the position of the chunked scan
+ */
+static void
+pgorph_step_save(PgOrphStepState *state)
+{
+	char		path[MAXPGPATH];
+
+	pgorph_step_path(path, state->dboid);
+	pgorph_write_file(path, state, sizeof(PgOrphStepState), NULL, 0, false);
+}
+
+static int
+pgorph_oid_cmp(const void *a, const void *b)
+{
+	Oid			oa = *(const Oid *) a;
+	Oid			ob = *(const Oid *) b;
+
+	if (oa == ob)
+		return 0;
+	return oa < ob ? -1 : 1;
+}
+
+static int
+pgorph_scan_dir_cmp(const void *a, const void *b)
+{
+	const PgOrphScanDir *da = *(PgOrphScanDir *const *) a;
+	const PgOrphScanDir *db = *(PgOrphScanDir *const *) b;
+
+	return pgorph_oid_cmp(&da->reltablespace, &db->reltablespace);
+}
+
+/* a relation file of a directory checked by a chunked scan */
+typedef struct PgOrphStepFile
+{
+	PgOrphFileName fname;
+	char		name[PGORPH_MAX_FILENAME];
+} PgOrphStepFile;
+
+static int
+pgorph_step_file_cmp(const void *a, const void *b)
+{
+	const PgOrphStepFile *fa = (const PgOrphStepFile *) a;
+	const PgOrphStepFile *fb = (const PgOrphStepFile *) b;
+
+	return pgorph_oid_cmp(&fa->fname.relfilenode, &fb->fname.relfilenode);
+}
+
+/*
+ * Read the relation files of a directory with a relfilenode above after,
+ * keeping the max_files first ones in relfilenode order, sorted. Only
+ * whole relfilenodes are kept: *more is set if some have been left out.
+ * If the first one alone has more than max_files files, all of them are
+ * kept.
+ */
+static PgOrphStepFile *
+pgorph_step_files(DIR *dirdesc, const char *dir, Oid after, int max_files,
+				  int *nfiles, bool *more)
+{
+	PgOrphStepFile *files;
+	int			limit = max_files * 2;	/* sorted and halved when reached */
+	int			maxfiles = Min(PGORPH_STEP_FIRST_FILES, limit);
+	int			n = 0;
+	Oid			cut = InvalidOid;	/* smallest relfilenode left out */
+	struct dirent *de;
+
+	files = palloc(sizeof(PgOrphStepFile) * maxfiles);
+	while ((de = pgorph_readdir(dirdesc, dir)) != NULL)
+	{
+		PgOrphFileName fname;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (de->d_name[0] == '.' || pgorph_name_too_long(dir, de->d_name) ||
+			!pgorph_parse_filename(de->d_name, &fname) ||
+			fname.relfilenode <= after ||
+			(OidIsValid(cut) && fname.relfilenode >= cut))
+			continue;
+
+		if (n == maxfiles)
+		{
+			if (maxfiles < limit)
+			{
+				pgorph_stats.allocations++;
+				pgorph_stats.allocated_bytes += sizeof(PgOrphStepFile) * maxfiles;
+				maxfiles = Min(maxfiles * 2, limit);
+				files = repalloc_huge(files, sizeof(PgOrphStepFile) * maxfiles);
+			}
+			else
+			{
+				/* full, only the max_files first ones are worth keeping */
+				qsort(files, n, sizeof(PgOrphStepFile), pgorph_step_file_cmp);
+				cut = files[max_files].fname.relfilenode;
+				n = max_files;
+				if (fname.relfilenode >= cut)
+					continue;
+			}
+		}
+		files[n].fname = fname;
+		strlcpy(files[n].name, de->d_name, sizeof(files[n].name));
+		n++;
+	}
+
+	if (n > 1)
+		qsort(files, n, sizeof(PgOrphStepFile), pgorph_step_file_cmp);
+	if (n > max_files && (!OidIsValid(cut) || files[max_files].fname.relfilenode < cut))
+		cut = files[max_files].fname.relfilenode;
+
+	/* the files of the relfilenode cut in the middle are left out too */
+	while (n > 0 && OidIsValid(cut) && files[n - 1].fname.relfilenode >= cut)
+		n--;
+
+	if (n == 0 && OidIsValid(cut))
+	{
+		/* read again for the files of this relfilenode only */
+		rewinddir(dirdesc);
+		*more = false;
+		while ((de = pgorph_readdir(dirdesc, dir)) != NULL)
+		{
+			PgOrphFileName fname;
+
+			CHECK_FOR_INTERRUPTS();
+
+			if (de->d_name[0] == '.' || pgorph_name_too_long(dir, de->d_name) ||
+				!pgorph_parse_filename(de->d_name, &fname) ||
+				fname.relfilenode < cut)
+				continue;
+			if (fname.relfilenode > cut)
+			{
+				*more = true;
+				continue;
+			}
+
+			if (n == maxfiles)
+			{
+				maxfiles *= 2;
+				files = repalloc_huge(files, sizeof(PgOrphStepFile) * maxfiles);
+			}
+			files[n].fname = fname;
+			strlcpy(files[n].name, de->d_name, sizeof(files[n].name));
+			n++;
+		}
+	}
+	else
+		*more = OidIsValid(cut);
+
+	*nfiles = n;
+	return files;
+}
+
+/*
+ * check the files of a directory from the position of the chunked scan,
+ * relfilenode by relfilenode, until the directory is done (true is
+ * returned) or the budget of the step is exhausted
+ */
+static bool
+pgorph_step_dir(PgOrphSink *sink, const char *dbname, PgOrphScanDir *sdir,
+				PgOrphStepState *state, int64 max_files, int64 max_ms,
+				TimestampTz start, int64 *checked)
+{
+	PgOrphScanStats before = pgorph_stats;
+	PgOrphDirScan scan;
+	PgOrphStepFile *files;
+	int			nfiles;
+	bool		more;
+	int			i;
+	instr_time	dir_start;
+
+	pgorph_progress_set(PGORPH_PROGRESS_TABLESPACE, sdir->reltablespace);
+
+	INSTR_TIME_SET_CURRENT(dir_start);
+	if (!pgorph_dir_scan_begin(&scan, sink, MyDatabaseId, dbname, sdir->path,
+							   sdir->reltablespace, NULL))
+		return true;
+
+	files = pgorph_step_files(scan.dirdesc, sdir->path, state->relfilenode,
+							  (int) Min(max_files - *checked, INT_MAX / 2), &nfiles, &more);
+
+	for (i = 0; i < nfiles; i++)
+	{
+		/* the time is checked once a relfilenode is done */
+		if (i > 0 && files[i].fname.relfilenode != files[i - 1].fname.relfilenode)
+		{
+			state->relfilenode = files[i - 1].fname.relfilenode;
+			if ((GetCurrentTimestamp() - start) / 1000 >= max_ms)
+				break;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+		pgorph_dir_scan_file(&scan, files[i].name, &files[i].fname);
+	}
+	if (i == nfiles && nfiles > 0)
+		state->relfilenode = files[nfiles - 1].fname.relfilenode;
+	*checked += i;
+
+	pgorph_dir_scan_end(&scan);
+	pfree(files);
+	pgorph_scan_dir_stats(sdir, &before, dir_start);
+
+	return i == nfiles && !more;
+}
+
+/*
+ * function to check the next slice of the relation files of the database,
+ * at most max_files of them during at most max_ms (checked between two
+ * relfilenodes), from the position reached by the previous call
+ */
+Datum
+pg_orphaned_scan_step(PG_FUNCTION_ARGS)
+{
+	int64		max_files = PG_ARGISNULL(0) ? 10000 : PG_GETARG_INT32(0);
+	int64		max_ms = PG_ARGISNULL(1) ? 1000 : PG_GETARG_INT32(1);
+	PgOrphSink	sink;
+	PgOrphStepState state;
+	const char *dbName;
+	List	   *dirs;
+	ListCell   *cell;
+	PgOrphScanDir **sdirs;
+	int			ndirs;
+	int			i;
+	int64		checked = 0;
+	bool		pass_done = true;
+	TimestampTz start;
+	MemoryContext oldcontext;
+
+	requireSuperuser();
+
+	if (max_files <= 0 || max_ms <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_files and max_ms must be positive")));
+
+	if (PG_ARGISNULL(2))
+		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
+	else
+		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(2))));
+
+	start = GetCurrentTimestamp();
+	pgorph_progress_start(PGORPH_COMMAND_SCAN_STEP);
+	pgorph_step_load(MyDatabaseId, &state);
+	if (state.steps == 0)
+		state.started_at = start;
+
+	pgorph_tuplestore_sink_init(&sink, fcinfo);
+
+	oldcontext = pgorph_scan_begin();
+	dbName = get_database_name(MyDatabaseId);
+	last_checkpoint_time = pgorph_last_checkpoint_time();
+
+	/* in tablespace order */
+	dirs = pgorph_scan_dirs(MyDatabaseId, dbName, false);
+	ndirs = list_length(dirs);
+	sdirs = palloc(sizeof(PgOrphScanDir *) * ndirs);
+	i = 0;
+	foreach(cell, dirs)
+		sdirs[i++] = (PgOrphScanDir *) lfirst(cell);
+	qsort(sdirs, ndirs, sizeof(PgOrphScanDir *), pgorph_scan_dir_cmp);
+
+	pgorph_progress_phase(PGORPH_PHASE_SCANNING);
+	pgorph_progress_set(PGORPH_PROGRESS_DIRS_TOTAL, ndirs);
+	pgorph_init_lookup();
+
+	for (i = 0; i < ndirs; i++)
+	{
+		PgOrphScanDir *sdir = sdirs[i];
+
+		/* no relfilenode order for the temporary files */
+		if (sdir->spill || sdir->reltablespace < state.reltablespace)
+			continue;
+
+		if (checked >= max_files || (GetCurrentTimestamp() - start) / 1000 >= max_ms)
+		{
+			pass_done = false;
+			break;
+		}
+
+		if (sdir->reltablespace > state.reltablespace)
+		{
+			state.reltablespace = sdir->reltablespace;
+			state.relfilenode = InvalidOid;
+		}
+
+		pass_done = pgorph_step_dir(&sink, dbName, sdir, &state, max_files, max_ms,
+									start, &checked);
+		pgorph_ts_stats_add(&sdir->stats);
+
+		/* the directories before the position count as scanned */
+		pgorph_progress_dirs_done = i + 1;
+		pgorph_progress_scan();
+		if (!pass_done)
+			break;
+	}
+
+	pgorph_scan_track_memory(NULL);
+	pgorph_scan_end(oldcontext);
+
+	/* the next call starts a new pass */
+	state.steps++;
+	state.updated_at = GetCurrentTimestamp();
+	if (pass_done)
+	{
+		state.reltablespace = InvalidOid;
+		state.relfilenode = InvalidOid;
+		state.steps = 0;
+		state.passes++;
+	}
+	pgorph_step_save(&state);
+	pgorph_progress_end();
+
+	return (Datum) 0;
+}
+
+/*
+ * position of the chunked scan of the database
+ */
+Datum
+pg_orphaned_scan_position(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	PgOrphStepState state;
+	Datum           values[6];
+	bool            nulls[6];
+
+	requireSuperuser();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+	pgorph_step_load(MyDatabaseId, &state);
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = ObjectIdGetDatum(state.reltablespace);
+	values[1] = Int64GetDatum((int64) state.relfilenode);
+	if (state.steps > 0)
+		values[2] = TimestampTzGetDatum(state.started_at);
+	else
+		nulls[2] = true;
+	if (state.updated_at != 0)
+		values[3] = TimestampTzGetDatum(state.updated_at);
+	else
+		nulls[3] = true;
+	values[4] = Int64GetDatum(state.steps);
+	values[5] = Int64GetDatum(state.passes);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+	return (Datum) 0;
+}
+
+/*
+ * forget the position of the chunked scan of the database
+ */
+Datum
+pg_orphaned_scan_reset(PG_FUNCTION_ARGS)
+{
+	char		path[MAXPGPATH];
+
+	requireSuperuser();
+
+	pgorph_step_path(path, MyDatabaseId);
+	if (unlink(path) < 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Manifests
+ *
+ * pg_orphaned_snapshot() writes the orphaned relation files found by a scan
+ * of the database to pg_orphaned/manifests/<dboid>/<name>: a header followed
+ * by fixed size entries sorted on (tablespace, backend, relfilenode, fork,
+ * segment). pg_orphaned_diff() merges two of them while reading them, so
+ * comparing two scans takes no more memory than one entry of each.
+ */
+#define PGORPH_MANIFEST_DIR		PGORPH_STATE_DIR "/manifests"
+#define PGORPH_MANIFEST_MAGIC	0x4F52504D
+#define PGORPH_MANIFEST_VERSION	1
+
+typedef struct PgOrphManifestHeader
+{
+	uint32		magic;
+	uint32		version;
+	Oid			dboid;
+	TimestampTz created_at;
+	int64		nentries;
+} PgOrphManifestHeader;
+
+typedef struct PgOrphManifestEntry
+{
+	Oid			reltablespace;
+	Oid			relfilenode;
+	int32		backend;		/* -1 unless the file of a temp relation */
+	int32		fork;
+	uint32		segno;
+	int64		size;
+	TimestampTz mod_time;
+} PgOrphManifestEntry;
+
+/*
+ * path of a manifest of the database, the name being checked as it ends
+ * up in a path
+ */
+static void
+pgorph_manifest_path(char *path, const char *name)
+{
+	const char *p;
+	size_t		len = strlen(name);
+
+	/* the .tmp files are the ones being written */
+	if (len == 0 || name[0] == '.' || len >= NAMEDATALEN ||
+		(len > 4 && strcmp(name + len - 4, ".tmp") == 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid manifest name \"%s\"", name)));
+	for (p = name; *p; p++)
+	{
+		if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-' && *p != '.')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid manifest name \"%s\"", name),
+					 errdetail("Only letters, digits, \"_\", \"-\" and \".\" are allowed.")));
+	}
+
+	snprintf(path, MAXPGPATH, "%s/%u/%s", PGORPH_MANIFEST_DIR, MyDatabaseId, name);
+}
+
+static int
+pgorph_manifest_entry_cmp(const void *a, const void *b)
+{
+	const PgOrphManifestEntry *ea = (const PgOrphManifestEntry *) a;
+	const PgOrphManifestEntry *eb = (const PgOrphManifestEntry *) b;
+
+	if (ea->reltablespace != eb->reltablespace)
+		return ea->reltablespace < eb->reltablespace ? -1 : 1;
+	if (ea->backend != eb->backend)
+		return ea->backend < eb->backend ? -1 : 1;
+	if (ea->relfilenode != eb->relfilenode)
+		return ea->relfilenode < eb->relfilenode ? -1 : 1;
+	if (ea->fork != eb->fork)
+		return ea->fork < eb->fork ? -1 : 1;
+	if (ea->segno != eb->segno)
+		return ea->segno < eb->segno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * open a manifest and read its header, NULL is returned for a NULL name
+ */
+static bool pgorph_manifest_read_header(FILE *file, PgOrphManifestHeader *header);
+
+static FILE *
+pgorph_manifest_open(const char *name, PgOrphManifestHeader *header)
+{
+	char		path[MAXPGPATH];
+	FILE	   *file;
+
+	memset(header, 0, sizeof(PgOrphManifestHeader));
+	if (name == NULL)
+		return NULL;
+
+	pgorph_manifest_path(path, name);
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open manifest \"%s\": %m", name)));
+
+	if (!pgorph_manifest_read_header(file, header))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid manifest \"%s\"", name)));
+
+	return file;
+}
+
+/*
+ * read the header of a manifest, false if it is not one of the database
+ */
+static bool
+pgorph_manifest_read_header(FILE *file, PgOrphManifestHeader *header)
+{
+	return fread(header, sizeof(PgOrphManifestHeader), 1, file) == 1 &&
+		header->magic == PGORPH_MANIFEST_MAGIC &&
+		header->version == PGORPH_MANIFEST_VERSION &&
+		header->dboid == MyDatabaseId &&
+		header->nentries >= 0;
+}
+
+/*
+ * read the next entry of a manifest, false once they have all been read
+ */
+static bool
+pgorph_manifest_read(FILE *file, const char *name, int64 *left, PgOrphManifestEntry *entry)
+{
+	if (file == NULL || *left == 0)
+		return false;
+
+	if (fread(entry, sizeof(PgOrphManifestEntry), 1, file) != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("manifest \"%s\" is truncated", name)));
+	if (entry->fork < 0 || entry->fork > MAX_FORKNUM)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid manifest \"%s\"", name)));
+	(*left)--;
+	return true;
+}
+
+/*
+ * function to write the manifest of the orphaned relation files of the
+ * database, named after the current time unless a name is given
+ */
+Datum
+pg_orphaned_snapshot(PG_FUNCTION_ARGS)
+{
+	char	   *name;
+	char		path[MAXPGPATH];
+	PgOrphSink	sink;
+	PgOrphManifestHeader header;
+	struct stat attrib;
+
+	requireSuperuser();
+
+	if (PG_ARGISNULL(0))
+	{
+		pg_time_t	now = timestamptz_to_time_t(GetCurrentTimestamp());
+
+		name = palloc(NAMEDATALEN);
+		pg_strftime(name, NAMEDATALEN, "%Y%m%d_%H%M%S", pg_gmtime(&now));
+	}
+	else
+		name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+	/* not worth scanning if it exists, the write checks it again */
+	pgorph_manifest_path(path, name);
+	if (stat(path, &attrib) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("manifest \"%s\" already exists", name)));
+
+	pgorph_progress_start(PGORPH_COMMAND_SNAPSHOT);
+	pgorph_manifest_sink_init(&sink);
+	pg_build_orphaned_list(MyDatabaseId, false, &sink);
+
+	if (sink.nentries > 1)
+		qsort(sink.entries, sink.nentries, sizeof(PgOrphManifestEntry),
+			  pgorph_manifest_entry_cmp);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PGORPH_MANIFEST_MAGIC;
+	header.version = PGORPH_MANIFEST_VERSION;
+	header.dboid = MyDatabaseId;
+	header.created_at = GetCurrentTimestamp();
+	header.nentries = sink.nentries;
+	pgorph_write_file(path, &header, sizeof(header), sink.entries,
+					  sizeof(PgOrphManifestEntry) * sink.nentries, true);
+
+	MemoryContextDelete(sink.cxt);
+	pgorph_progress_end();
+
+	PG_RETURN_TEXT_P(cstring_to_text(name));
+}
+
+/*
+ * the orphaned files are only kept as the entries of a manifest, in a
+ * context created in the current memory context and freed with it
+ */
+static void
+pgorph_manifest_sink_init(PgOrphSink *sink)
+{
+	memset(sink, 0, sizeof(PgOrphSink));
+	sink->kind = PGORPH_SINK_MANIFEST;
+	sink->cxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "pg_orphaned manifest",
+									  ALLOCSET_DEFAULT_SIZES);
+	sink->maxentries = 1024;
+	sink->entries = MemoryContextAllocHuge(sink->cxt,
+										   sizeof(PgOrphManifestEntry) * sink->maxentries);
+}
+
+static void
+pgorph_manifest_add(PgOrphSink *sink, OrphanedRelation *orph)
+{
+	PgOrphManifestEntry *entry;
+	PgOrphFileName fname;
+
+	/* the temporary files of the backends have no relfilenode */
+	if (!pgorph_parse_filename(orph->name, &fname))
+		return;
+
+	if (sink->nentries == sink->maxentries)
+	{
+		pgorph_stats.allocations++;
+		pgorph_stats.allocated_bytes += sizeof(PgOrphManifestEntry) * sink->maxentries;
+		sink->maxentries *= 2;
+		sink->entries = repalloc_huge(sink->entries,
+									  sizeof(PgOrphManifestEntry) * sink->maxentries);
+	}
+
+	entry = &sink->entries[sink->nentries++];
+	memset(entry, 0, sizeof(PgOrphManifestEntry));
+	entry->reltablespace = pgorph_path_tablespace(orph->path);
+	entry->relfilenode = fname.relfilenode;
+	entry->backend = fname.backend;
+	entry->fork = (int32) fname.fork;
+	entry->segno = fname.segno;
+	entry->size = orph->size;
+	entry->mod_time = orph->mod_time;
+}
+
+/*
+ * function to list the entries added, removed or modified between two
+ * manifests, a NULL one being empty
+ */
+Datum
+pg_orphaned_diff(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	char	   *name_a = PG_ARGISNULL(0) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *name_b = PG_ARGISNULL(1) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(1));
+	PgOrphManifestHeader header_a;
+	PgOrphManifestHeader header_b;
+	PgOrphManifestEntry a;
+	PgOrphManifestEntry b;
+	FILE	   *file_a;
+	FILE	   *file_b;
+	bool		have_a;
+	bool		have_b;
+
+	requireSuperuser();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	file_a = pgorph_manifest_open(name_a, &header_a);
+	file_b = pgorph_manifest_open(name_b, &header_b);
+
+	have_a = pgorph_manifest_read(file_a, name_a, &header_a.nentries, &a);
+	have_b = pgorph_manifest_read(file_b, name_b, &header_b.nentries, &b);
+	while (have_a || have_b)
+	{
+		PgOrphManifestEntry *entry;
+		const char *change;
+		int			cmp;
+		Datum           values[10];
+		bool            nulls[10];
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (!have_a)
+			cmp = 1;
+		else if (!have_b)
+			cmp = -1;
+		else
+			cmp = pgorph_manifest_entry_cmp(&a, &b);
+
+		/* the same file, reported only if it changed */
+		if (cmp == 0 && a.size == b.size && a.mod_time == b.mod_time)
+		{
+			have_a = pgorph_manifest_read(file_a, name_a, &header_a.nentries, &a);
+			have_b = pgorph_manifest_read(file_b, name_b, &header_b.nentries, &b);
+			continue;
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		if (cmp < 0)
+		{
+			change = "removed";
+			entry = &a;
+			nulls[8] = nulls[9] = true;
+		}
+		else
+		{
+			change = cmp > 0 ? "added" : "modified";
+			entry = &b;
+			values[8] = Int64GetDatum(b.size);
+			values[9] = TimestampTzGetDatum(b.mod_time);
+		}
+
+		values[0] = CStringGetTextDatum(change);
+		values[1] = ObjectIdGetDatum(entry->reltablespace);
+		values[2] = Int64GetDatum((int64) entry->relfilenode);
+		if (entry->backend >= 0)
+			values[3] = Int32GetDatum(entry->backend);
+		else
+			nulls[3] = true;
+		values[4] = CStringGetTextDatum(forkNames[entry->fork]);
+		values[5] = Int64GetDatum((int64) entry->segno);
+		if (cmp <= 0)
+		{
+			values[6] = Int64GetDatum(a.size);
+			values[7] = TimestampTzGetDatum(a.mod_time);
+		}
+		else
+			nulls[6] = nulls[7] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		if (cmp <= 0)
+			have_a = pgorph_manifest_read(file_a, name_a, &header_a.nentries, &a);
+		if (cmp >= 0)
+			have_b = pgorph_manifest_read(file_b, name_b, &header_b.nentries, &b);
+	}
+
+	if (file_a != NULL)
+		FreeFile(file_a);
+	if (file_b != NULL)
+		FreeFile(file_b);
+
+	return (Datum) 0;
+}
+
+/*
+ * the manifests of the database
+ */
+Datum
+pg_orphaned_manifests(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	char		dir[MAXPGPATH];
+	DIR		   *dirdesc;
+	struct dirent *de;
+
+	requireSuperuser();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	snprintf(dir, sizeof(dir), "%s/%u", PGORPH_MANIFEST_DIR, MyDatabaseId);
+	if (pg_orphaned_check_dir(dir) == 0)
+		return (Datum) 0;
+
+	dirdesc = AllocateDir(dir);
+	while ((de = ReadDir(dirdesc, dir)) != NULL)
+	{
+		PgOrphManifestHeader header;
+		FILE	   *file;
+		char		path[MAXPGPATH];
+		bool		valid;
+		Datum           values[3];
+		bool            nulls[3];
+		size_t		len = strlen(de->d_name);
+
+		/* skip the files being written */
+		if (de->d_name[0] == '.' ||
+			(len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0))
+			continue;
+
+		/* and the ones that are not manifests, or are gone already */
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		file = AllocateFile(path, PG_BINARY_R);
+		if (file == NULL)
+			continue;
+		valid = pgorph_manifest_read_header(file, &header);
+		FreeFile(file);
+		if (!valid)
+		{
+			ereport(DEBUG1,
+					(errmsg_internal("skipping \"%s\": not a manifest of the database", path)));
+			continue;
+		}
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(de->d_name);
+		values[1] = TimestampTzGetDatum(header.created_at);
+		values[2] = Int64GetDatum(header.nentries);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	FreeDir(dirdesc);
+
+	return (Datum) 0;
+}
+
+/*
+ * remove a manifest of the database
+ */
+Datum
+pg_orphaned_drop_manifest(PG_FUNCTION_ARGS)
+{
+	char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char		path[MAXPGPATH];
+
+	requireSuperuser();
+
+	pgorph_manifest_path(path, name);
+	if (unlink(path) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove manifest \"%s\": %m", name)));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * the orphaned files are copied to a list, in a context created
+ * in the current memory context and freed with it
+ */
+static void
+pgorph_list_sink_init(PgOrphSink *sink)
+{
+	memset(sink, 0, sizeof(PgOrphSink));
+	sink->kind = PGORPH_SINK_LIST;
+	sink->cxt = AllocSetContextCreate(CurrentMemoryContext,
+									  "pg_orphaned results",
+									  ALLOCSET_DEFAULT_SIZES);
+	sink->list = NIL;
+}
+
+/*
+ * the orphaned files are written to the tuplestore as soon as they are
+ * found, so that the result spills to disk beyond work_mem
+ */
+static void
+pgorph_tuplestore_sink_init(PgOrphSink *sink, FunctionCallInfo fcinfo)
+{
+	memset(sink, 0, sizeof(PgOrphSink));
+	sink->kind = PGORPH_SINK_TUPLESTORE;
+	sink->tupstore = pgorph_begin_srf(fcinfo, &sink->tupdesc);
+	sink->tmpcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "pg_orphaned tuple",
+										 ALLOCSET_SMALL_SIZES);
+}
+
+/*
+ * the orphaned files are sent to the leader of a parallel scan
+ */
+static void
+pgorph_mq_sink_init(PgOrphSink *sink, shm_mq_handle *mqh)
+{
+	memset(sink, 0, sizeof(PgOrphSink));
+	sink->kind = PGORPH_SINK_MQ;
+	sink->mqh = mqh;
+	initStringInfo(&sink->buf);
+}
+
+static void
+pgorph_emit(PgOrphSink *sink, OrphanedRelation *orph)
+{
+	instr_time	start;
+	bool		timed;
+
+	timed = PGORPH_SAMPLE_START(pgorph_emit_calls, start);
+	switch (sink->kind)
+	{
+		case PGORPH_SINK_LIST:
+			{
+				MemoryContext oldcontext = MemoryContextSwitchTo(sink->cxt);
+				OrphanedRelation *copy;
+
+				/*
+				 * the records come directory by directory, so the strings
+				 * only need to be copied when they differ from the last ones
+				 */
+				if (sink->last_dbname == NULL || strcmp(sink->last_dbname, orph->dbname) != 0)
+				{
+					char	   *dbname = pgorph_scan_alloc(sink->cxt, strlen(orph->dbname) + 1);
+
+					strcpy(dbname, orph->dbname);
+					sink->last_dbname = dbname;
+				}
+				if (sink->last_path == NULL || strcmp(sink->last_path, orph->path) != 0)
+				{
+					char	   *path = pgorph_scan_alloc(sink->cxt, strlen(orph->path) + 1);
+
+					strcpy(path, orph->path);
+					sink->last_path = path;
+				}
+
+				copy = pgorph_scan_alloc(sink->cxt, sizeof(OrphanedRelation));
+				memcpy(copy, orph, sizeof(OrphanedRelation));
+				copy->dbname = sink->last_dbname;
+				copy->path = sink->last_path;
+				sink->list = lappend(sink->list, copy);
+				MemoryContextSwitchTo(oldcontext);
+			}
+			break;
+
+		case PGORPH_SINK_TUPLESTORE:
+			{
+				MemoryContext oldcontext = MemoryContextSwitchTo(sink->tmpcxt);
+				Datum           values[8];
+				bool            nulls[8];
+				memset(values, 0, sizeof(values));
+				memset(nulls, 0, sizeof(nulls));
+
+				values[0] = CStringGetTextDatum(orph->dbname);
+				values[1] = CStringGetTextDatum(orph->path);
+				values[2] = CStringGetTextDatum(orph->name);
+				values[3] = Int64GetDatum(orph->size);
+				values[4] = TimestampTzGetDatum(orph->mod_time);
+				values[5] = Int64GetDatum(orph->relfilenode);
+				values[6] = Int64GetDatum(orph->reloid);
+
+				/* pg_list_orphaned_moved() has no older column */
+				if (sink->tupdesc->natts > 7)
+				{
+					if (orph->mod_time <= limitts)
+						values[7] = BoolGetDatum(true);
+					else
+						values[7] = BoolGetDatum(false);
+				}
+
+				tuplestore_putvalues(sink->tupstore, sink->tupdesc, values, nulls);
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(sink->tmpcxt);
+			}
+			break;
+
+		case PGORPH_SINK_MQ:
+			{
+				shm_mq_result res;
+
+				pgorph_serialize_orphan(&sink->buf, orph);
+#if PG_VERSION_NUM >= 150000
+				res = shm_mq_send(sink->mqh, sink->buf.len, sink->buf.data, false, true);
+#else
+				res = shm_mq_send(sink->mqh, sink->buf.len, sink->buf.data, false);
+#endif
+				if (res != SHM_MQ_SUCCESS)
+					ereport(ERROR,
+						(errmsg("could not send orphaned file to pg_orphaned leader")));
+			}
+			break;
+
+		case PGORPH_SINK_SUMMARY:
+			pgorph_summary_add(sink->summary, orph);
+			break;
+
+		case PGORPH_SINK_MANIFEST:
+			pgorph_manifest_add(sink, orph);
+			break;
+	}
+	if (timed)
+		PGORPH_SAMPLE_END(start, emit_time);
+}
+
+/*
+ * the orphaned files are only added to the totals of their tablespace and
+ * of their relfilenode, the top_n largest relfilenodes being kept in a
+ * bounded heap: the memory used does not depend on the number of files
+ */
+static void
+pgorph_summary_sink_init(PgOrphSink *sink, int top_n)
+{
+	PgOrphSummary *summary;
+
+	memset(sink, 0, sizeof(PgOrphSink));
+	sink->kind = PGORPH_SINK_SUMMARY;
+
+	summary = palloc0(sizeof(PgOrphSummary));
+	summary->maxtablespaces = 8;
+	summary->tablespaces = palloc(summary->maxtablespaces * sizeof(PgOrphTotal));
+	summary->maxruns = 8;
+	summary->runs = palloc(summary->maxruns * sizeof(PgOrphSummaryRun));
+	summary->top_n = top_n;
+	summary->top = palloc(Max(top_n, 1) * sizeof(PgOrphTotal));
+	summary->heap = binaryheap_allocate(Max(top_n, 1), pgorph_total_cmp, NULL);
+	sink->summary = summary;
+}
+
+/*
+ * the smallest relfilenode first in the heap
+ */
+static int
+pgorph_total_cmp(Datum a, Datum b, void *arg)
+{
+	PgOrphTotal *ta = (PgOrphTotal *) DatumGetPointer(a);
+	PgOrphTotal *tb = (PgOrphTotal *) DatumGetPointer(b);
+
+	if (ta->size < tb->size)
+		return 1;
+	if (ta->size > tb->size)
+		return -1;
+	return 0;
+}
+
+static void
+pgorph_total_reset(PgOrphTotal *total, Oid reltablespace, Oid relfilenode)
+{
+	memset(total, 0, sizeof(PgOrphTotal));
+	total->reltablespace = reltablespace;
+	total->relfilenode = relfilenode;
+}
+
+static void
+pgorph_total_add(PgOrphTotal *total, OrphanedRelation *orph)
+{
+	if (total->files == 0 || orph->mod_time < total->oldest)
+		total->oldest = orph->mod_time;
+	if (total->files == 0 || orph->mod_time > total->newest)
+		total->newest = orph->mod_time;
+
+	total->files++;
+	total->size += orph->size;
+	if (orph->mod_time <= limitts)
+		total->older_size += orph->size;
+}
+
+/*
+ * keep the relfilenode if it is one of the top_n largest seen so far
+ */
+static void
+pgorph_summary_push(PgOrphSummary *summary, PgOrphTotal *total)
+{
+	binaryheap *heap = summary->heap;
+
+	if (summary->top_n == 0 || total->files == 0)
+		return;
+
+	if (heap->bh_size < summary->top_n)
+	{
+		PgOrphTotal *slot = &summary->top[heap->bh_size];
+
+		*slot = *total;
+		binaryheap_add(heap, PointerGetDatum(slot));
+	}
+	else
+	{
+		PgOrphTotal *smallest = (PgOrphTotal *) DatumGetPointer(binaryheap_first(heap));
+
+		if (total->size > smallest->size)
+		{
+			*smallest = *total;
+			binaryheap_replace_first(heap, PointerGetDatum(smallest));
+		}
+	}
+}
+
+static void
+pgorph_summary_add(PgOrphSummary *summary, OrphanedRelation *orph)
+{
+	Oid			reltablespace = pgorph_path_tablespace(orph->path);
+	PgOrphFileName fname;
+	int			backend = -1;
+	PgOrphTotal *tstotal = NULL;
+	PgOrphSummaryRun *run = NULL;
+	int			i;
+
+	/* the relfilenodes of temp relations are unique per backend only */
+	if (pgorph_parse_filename(orph->name, &fname))
+		backend = fname.backend;
+
+	for (i = 0; i < summary->ntablespaces; i++)
+	{
+		if (summary->tablespaces[i].reltablespace == reltablespace)
+		{
+			tstotal = &summary->tablespaces[i];
+			break;
+		}
+	}
+	if (tstotal == NULL)
+	{
+		if (summary->ntablespaces == summary->maxtablespaces)
+		{
+			summary->maxtablespaces *= 2;
+			summary->tablespaces = repalloc(summary->tablespaces,
+											summary->maxtablespaces * sizeof(PgOrphTotal));
+		}
+		tstotal = &summary->tablespaces[summary->ntablespaces++];
+		pgorph_total_reset(tstotal, reltablespace, InvalidOid);
+	}
+	pgorph_total_add(tstotal, orph);
+
+	for (i = 0; i < summary->nruns; i++)
+	{
+		if (strcmp(summary->runs[i].path, orph->path) == 0)
+		{
+			run = &summary->runs[i];
+			break;
+		}
+	}
+	if (run == NULL)
+	{
+		if (summary->nruns == summary->maxruns)
+		{
+			summary->maxruns *= 2;
+			summary->runs = repalloc(summary->runs,
+									 summary->maxruns * sizeof(PgOrphSummaryRun));
+		}
+		run = &summary->runs[summary->nruns++];
+		strlcpy(run->path, orph->path, MAXPGPATH);
+		run->backend = backend;
+		pgorph_total_reset(&run->total, reltablespace, orph->relfilenode);
+	}
+	else if (run->total.relfilenode != orph->relfilenode || run->backend != backend)
+	{
+		/* the previous relfilenode of this directory is complete */
+		pgorph_summary_push(summary, &run->total);
+		run->backend = backend;
+		pgorph_total_reset(&run->total, reltablespace, orph->relfilenode);
+	}
+	pgorph_total_add(&run->total, orph);
+}
+
+static int
+pgorph_tablespace_total_cmp(const void *a, const void *b)
+{
+	const PgOrphTotal *ta = (const PgOrphTotal *) a;
+	const PgOrphTotal *tb = (const PgOrphTotal *) b;
+
+	if (ta->reltablespace < tb->reltablespace)
+		return -1;
+	if (ta->reltablespace > tb->reltablespace)
+		return 1;
+	return 0;
+}
+
+static int
+pgorph_relfilenode_total_cmp(const void *a, const void *b)
+{
+	const PgOrphTotal *ta = (const PgOrphTotal *) a;
+	const PgOrphTotal *tb = (const PgOrphTotal *) b;
+
+	if (ta->size > tb->size)
+		return -1;
+	if (ta->size < tb->size)
+		return 1;
+	if (ta->reltablespace != tb->reltablespace)
+		return ta->reltablespace < tb->reltablespace ? -1 : 1;
+	if (ta->relfilenode != tb->relfilenode)
+		return ta->relfilenode < tb->relfilenode ? -1 : 1;
+	return 0;
+}
+
+static void
+pgorph_summary_put(Tuplestorestate *tupstore, TupleDesc tupdesc, const char *kind, PgOrphTotal *total)
+{
+	Datum           values[8];
+	bool            nulls[8];
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = CStringGetTextDatum(kind);
+	values[1] = ObjectIdGetDatum(total->reltablespace);
+	if (OidIsValid(total->relfilenode))
+		values[2] = Int64GetDatum(total->relfilenode);
+	else
+		nulls[2] = true;
+	values[3] = Int64GetDatum(total->files);
+	values[4] = Int64GetDatum(total->size);
+	values[5] = Int64GetDatum(total->older_size);
+	values[6] = TimestampTzGetDatum(total->oldest);
+	values[7] = TimestampTzGetDatum(total->newest);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * write the tablespace totals then the top_n relfilenodes, largest first
+ */
+static void
+pgorph_summary_finish(PgOrphSink *sink, FunctionCallInfo fcinfo)
+{
+	PgOrphSummary *summary = sink->summary;
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	int			ntop;
+	int			i;
+
+	for (i = 0; i < summary->nruns; i++)
+		pgorph_summary_push(summary, &summary->runs[i].total);
+	ntop = summary->heap->bh_size;
+
+	qsort(summary->tablespaces, summary->ntablespaces, sizeof(PgOrphTotal),
+		  pgorph_tablespace_total_cmp);
+	qsort(summary->top, ntop, sizeof(PgOrphTotal), pgorph_relfilenode_total_cmp);
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < summary->ntablespaces; i++)
+		pgorph_summary_put(tupstore, tupdesc, "tablespace", &summary->tablespaces[i]);
+
+	for (i = 0; i < ntop; i++)
+		pgorph_summary_put(tupstore, tupdesc, "relfilenode", &summary->top[i]);
+}
+
+/*
+ * set up a materialized set returning function
+ */
+static Tuplestorestate *
+pgorph_begin_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext   per_query_ctx;
+	MemoryContext   oldcontext;
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/*
+	 * Build a tuple descriptor for our result type
+	 */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * function that look for orphaned files
+ * in a given directory
+ * the logic to go through the list of files
+ * is mainly inspired by the existing pg_ls_dir_files()
+ */
+void
+search_orphaned(PgOrphSink *sink, Oid dboid, const char* dbname, const char* dir, Oid reltablespace)
+{
+	PgOrphDirScan scan;
+	PgOrphDirState *dstate = NULL;
+	struct dirent *de;
+
+	/* nothing to do if the directory did not change since the last scan */
+	if (pgorph_incremental_scan)
+	{
+		bool		unchanged;
+
+		dstate = pgorph_incr_begin_dir(dir, dboid, reltablespace, &unchanged);
+		if (unchanged)
+		{
+			pgorph_stats.directories++;
+			pgorph_incr_emit_dir(sink, dstate, dbname);
+			return;
+		}
+	}
+
+	if (!pgorph_dir_scan_begin(&scan, sink, dboid, dbname, dir, reltablespace, dstate))
+	{
+		if (dstate != NULL)
+			pgorph_incr_forget_dir(dstate);
+		return ;
+	}
+
+	while ((de = pgorph_readdir(scan.dirdesc, dir)) != NULL)
+	{
+		PgOrphFileName fname;
+
+		/* Skip hidden files, and names too long for a relation file */
+		if (de->d_name[0] == '.' || pgorph_name_too_long(dir, de->d_name))
+			continue;
+
+#ifdef DT_REG
+		/* no need to stat what the directory entry says is not a file */
+		if (de->d_type != DT_UNKNOWN && de->d_type != DT_REG && de->d_type != DT_LNK)
+		{
+			pgorph_stats.stat_calls_saved++;
+			continue;
+		}
+#endif
+
+		/* Only the relation files are of interest and the name is enough to know it */
+		if (!pgorph_parse_filename(de->d_name, &fname))
+		{
+			pgorph_stats.stat_calls_saved++;
+			continue;
+		}
+
+		pgorph_dir_scan_file(&scan, de->d_name, &fname);
+	}
+
+	pgorph_dir_scan_end(&scan);
+}
+
+/*
+ * open a directory to classify its relation files, false if it is gone
+ */
+static bool
+pgorph_dir_scan_begin(PgOrphDirScan *scan, PgOrphSink *sink, Oid dboid,
+					  const char *dbname, const char *dir, Oid reltablespace,
+					  PgOrphDirState *dstate)
+{
+	scan->dirdesc = AllocateDir(dir);
+	if (!scan->dirdesc)
+		return false;
+	pgorph_stats.directories++;
+
+	scan->sink = sink;
+	scan->dboid = dboid;
+	scan->dbname = dbname;
+	scan->dir = dir;
+	scan->reltablespace = reltablespace;
+	scan->dstate = dstate;
+	scan->maxpending = PGORPH_STAT_BATCH;
+	scan->npending = 0;
+	scan->nstated = 0;
+	scan->decided = NULL;
+	scan->pending = pgorph_scan_alloc(CurrentMemoryContext,
+									  sizeof(PgOrphPending) * scan->maxpending);
+
+	return true;
+}
+
+/*
+ * classify a relation file of the directory: the live ones are done
+ * with, the candidates wait for the stat of their batch and for the other
+ * files of their relfilenode
+ */
+static void
+pgorph_dir_scan_file(PgOrphDirScan *scan, const char *name, PgOrphFileName *fname)
+{
+	PgOrphSink *sink = scan->sink;
+	PgOrphDirState *dstate = scan->dstate;
+	DIR		   *dirdesc = scan->dirdesc;
+	const char *dir = scan->dir;
+	Oid			oidrel;
+	struct stat attrib;
+	bool		have_stat = false;
+	bool		owner_gone;
+	PgOrphFileState *fstate = NULL;
+	PgOrphPending *p;
+	instr_time	start;
+
+	pgorph_stats.files++;
+
+	/* no need to classify again a file that did not change */
+	if (dstate != NULL)
+	{
+		bool		reuse;
+
+		/* the size and the mtime tell if it changed */
+		if (!pgorph_stat_entry(dirdesc, dir, name, &attrib,
+							   PGORPH_STAT_FOLLOW(fname)))
+			return;
+		have_stat = true;
+
+		fstate = pgorph_incr_begin_file(dstate, name, &attrib, &reuse);
+
+		/* dropping a relation does not change its files */
+		if (reuse && fstate->nrows == 0 &&
+			!pgorph_incr_still_live(fname, scan->dboid, scan->reltablespace))
+		{
+			/* until pgorph_incr_end_file() records its classification */
+			fstate->deferred = true;
+			reuse = false;
+		}
+
+		if (reuse)
+		{
+			/* still orphaned, reported with the other files of its relfilenode */
+			if (fstate->nrows > 0)
+			{
+				p = pgorph_pending_add(&scan->pending, &scan->npending, &scan->maxpending,
+									   scan->dbname, dir, name, fname);
+				p->have_stat = true;
+				memcpy(&p->st, &attrib, sizeof(struct stat));
+			}
+			return;
+		}
+	}
+
+	/*
+	 * With a size or age filter, the files that can not match are
+	 * skipped before looking at the catalog. The first segment of a
+	 * main fork is always classified, as it may defer the report of
+	 * the other files of its relfilenode.
+	 */
+	if (sink->filter.active && !have_stat &&
+		!(fname->backend < 0 && fname->fork == MAIN_FORKNUM && fname->segno == 0))
+	{
+		if (!pgorph_stat_entry(dirdesc, dir, name, &attrib,
+							   PGORPH_STAT_FOLLOW(fname)))
+			return;
+		have_stat = true;
+
+		if (!pgorph_filter_match(&sink->filter, (int64) attrib.st_size,
+								 time_t_to_timestamptz(attrib.st_mtime)))
+			return;
+	}
+
+	/*
+	 * If RelidByRelfilenodeDirty does not return a valid oid
+	 * then we consider this file as orphaned: nearly all the files
+	 * belong to a relation, so the catalog is checked before
+	 * looking at the file itself. A temp relation file is orphaned
+	 * once its backend is gone, pg_class is not even looked at.
+	 */
+	owner_gone = fname->backend >= 0 && !pgorph_temp_owner_alive(fname->backend, scan->dboid);
+	if (owner_gone)
+	{
+		pgorph_stats.temp_owner_gone++;
+		oidrel = InvalidOid;
+	}
+	else
+	{
+		INSTR_TIME_SET_CURRENT(start);
+		oidrel = RelidByRelfilenodeDirty(scan->reltablespace, fname->relfilenode);
+		PGORPH_PHASE_END(start, catalog_time);
+	}
+	if (OidIsValid(oidrel))
+	{
+		if (!have_stat)
+			pgorph_stats.stat_calls_saved++;
+		if (fstate != NULL)
+			pgorph_incr_end_file(dstate, fstate, NULL, 0, false);
+		return;
+	}
+
+	/*
+	 * a candidate, its metadata is fetched with the ones of the batch
+	 * and it is reported once all the files of its relfilenode are known
+	 */
+	p = pgorph_pending_add(&scan->pending, &scan->npending, &scan->maxpending,
+						   scan->dbname, dir, name, fname);
+	p->fstate = fstate;
+	p->have_stat = have_stat;
+	p->owner_gone = owner_gone;
+	if (have_stat)
+		memcpy(&p->st, &attrib, sizeof(struct stat));
+
+	if (scan->npending - scan->nstated >= PGORPH_STAT_BATCH)
+	{
+		pgorph_stat_pending(dirdesc, dir, scan->reltablespace, scan->pending,
+							scan->nstated, scan->npending, true);
+		scan->nstated = scan->npending;
+
+		/* do not keep the candidates of a huge directory until its end */
+		if (scan->npending >= PGORPH_PENDING_FLUSH)
+		{
+			pgorph_report_groups(sink, dstate, scan->pending, scan->npending,
+								 &scan->decided, true);
+			scan->npending = scan->nstated = 0;
+		}
+	}
+}
+
+/*
+ * report the candidates left and close the directory
+ */
+static void
+pgorph_dir_scan_end(PgOrphDirScan *scan)
+{
+	pgorph_stat_pending(scan->dirdesc, scan->dir, scan->reltablespace, scan->pending,
+						scan->nstated, scan->npending, true);
+	FreeDir(scan->dirdesc);
+
+	pgorph_report_groups(scan->sink, scan->dstate, scan->pending, scan->npending,
+						 &scan->decided, false);
+
+	pgorph_scan_track_memory(scan->sink->cxt);
+	pfree(scan->pending);
+	if (scan->decided != NULL)
+		hash_destroy(scan->decided);
+
+	if (scan->dstate != NULL)
+		pgorph_incr_end_dir(scan->dstate);
+}
+
+/*
+ * search the temporary files (and the directories of the shared filesets)
+ * of the backends that are gone: their name carries the pid of the
+ * backend that created them. They are reported with a relfilenode of 0,
+ * a fileset with the total size of its files.
+ * In the backup directory (restore), all of them are reported: their
+ * backend is gone, whatever process has its pid now.
+ */
+static void
+search_spill_files(PgOrphSink *sink, const char *dbname, const char *dir, bool restore)
+{
+	DIR		   *dirdesc;
+	struct dirent *de;
+
+	dirdesc = AllocateDir(dir);
+	if (!dirdesc)
+		return;
+	pgorph_stats.directories++;
+
+	while ((de = pgorph_readdir(dirdesc, dir)) != NULL)
+	{
+		OrphanedRelation orph;
+		struct stat attrib;
+		const char *p;
+		char	   *end;
+		long		pid;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* pgsql_tmp<pid>.<n>, followed by .fileset for a shared fileset */
+		if (strncmp(de->d_name, PG_TEMP_FILE_PREFIX, strlen(PG_TEMP_FILE_PREFIX)) != 0 ||
+			pgorph_name_too_long(dir, de->d_name))
+			continue;
+		p = de->d_name + strlen(PG_TEMP_FILE_PREFIX);
+		if (!isdigit((unsigned char) *p))
+			continue;
+		errno = 0;
+		pid = strtol(p, &end, 10);
+		if (errno != 0 || *end != '.' || pid <= 0 || pid > INT_MAX)
+			continue;
+		pgorph_stats.files++;
+
+		/* still used by its backend */
+		if (!restore && BackendPidGetProc((int) pid) != NULL)
+			continue;
+
+		if (pgorph_fstatat(dirdesc, dir, de->d_name, &attrib, false) < 0)
+		{
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not stat file \"%s/%s\": %m", dir, de->d_name)));
+		}
+
+		memset(&orph, 0, sizeof(OrphanedRelation));
+		orph.dbname = dbname;
+		orph.path = dir;
+		strlcpy(orph.name, de->d_name, sizeof(orph.name));
+		orph.size = (int64) attrib.st_size;
+		orph.mod_time = time_t_to_timestamptz(attrib.st_mtime);
+		orph.relfilenode = InvalidOid;
+		orph.reloid = InvalidOid;
+
+		if (S_ISDIR(attrib.st_mode))
+		{
+			char		path[MAXPGPATH];
+
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			orph.size = 0;
+			pgorph_spill_dir_usage(path, &orph.size, &orph.mod_time);
+		}
+		else if (!S_ISREG(attrib.st_mode))
+			continue;
+
+		if (!pgorph_filter_match(&sink->filter, orph.size, orph.mod_time))
+			continue;
+
+		pgorph_stats.orphaned++;
+		pgorph_stats.orphaned_size += orph.size;
+		pgorph_emit(sink, &orph);
+	}
+
+	FreeDir(dirdesc);
+}
+
+/*
+ * total size and latest modification time of the files of a directory
+ */
+static void
+pgorph_spill_dir_usage(const char *path, int64 *size, TimestampTz *mod_time)
+{
+	DIR		   *dirdesc;
+	struct dirent *de;
+
+	dirdesc = AllocateDir(path);
+	if (!dirdesc)
+		return;
+
+	while ((de = ReadDir(dirdesc, path)) != NULL)
+	{
+		char		file[MAXPGPATH];
+		struct stat attrib;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0)
+			continue;
+
+		snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+		if (lstat(file, &attrib) < 0)
+		{
+			/* removed in the meantime */
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not stat file "%s": %m", file)));
+		}
+
+		if (S_ISDIR(attrib.st_mode))
+			pgorph_spill_dir_usage(file, size, mod_time);
+		else if (S_ISREG(attrib.st_mode))
+		{
+			*size += (int64) attrib.st_size;
+			if (time_t_to_timestamptz(attrib.st_mtime) > *mod_time)
+				*mod_time = time_t_to_timestamptz(attrib.st_mtime);
+		}
+	}
+
+	FreeDir(dirdesc);
+}
+
+/*
+ * What has been decided for a relfilenode whose first files have been
+ * reported before the directory has been read to the end
+ */
+typedef struct PgOrphGroupKey
+{
+	int			backend;
+	Oid			relfilenode;
+} PgOrphGroupKey;
+
+typedef struct PgOrphGroupDecision
+{
+	PgOrphGroupKey key;			/* hash key - must be first */
+	bool		decided;
+	bool		known;
+	bool		deferred;
+} PgOrphGroupDecision;
+
+/*
+ * add an orphaned file candidate to the ones of the directory
+ */
+static PgOrphPending *
+pgorph_pending_add(PgOrphPending **pending, int *npending, int *maxpending,
+				   const char *dbname, const char *dir, const char *name,
+				   PgOrphFileName *fname)
+{
+	PgOrphPending *p;
+
+	if (*npending == *maxpending)
+	{
+		pgorph_stats.allocations++;
+		pgorph_stats.allocated_bytes += sizeof(PgOrphPending) * *maxpending;
+		*maxpending *= 2;
+		*pending = repalloc_huge(*pending, sizeof(PgOrphPending) * *maxpending);
+	}
+
+	p = &(*pending)[(*npending)++];
+	memset(&p->row, 0, sizeof(OrphanedRelation));
+	p->row.dbname = dbname;
+	p->row.path = dir;
+	strlcpy(p->row.name, name, sizeof(p->row.name));
+	p->row.relfilenode = fname->relfilenode;
+	p->row.reloid = InvalidOid;
+	p->fname = *fname;
+	p->fstate = NULL;
+	p->have_stat = false;
+	p->owner_gone = false;
+	p->err = 0;
+
+	return p;
+}
+
+/*
+ * stat a batch of orphaned file candidates at once
+ * the ones that are gone or that are not regular files are marked
+ * with ENOENT, the orphaned ones get their size and mtime
+ * probe is false when the catalog has been checked by someone else
+ * (the cluster scan), it is not the one of the current database
+ */
+static void
+pgorph_stat_pending(DIR *dirdesc, const char *dir, Oid reltablespace,
+					PgOrphPending *pending, int from, int to, bool probe)
+{
+	PgOrphStatRequest reqs[PGORPH_STAT_BATCH];
+	int			nreqs = 0;
+	int			i;
+
+	for (i = from; i < to; i++)
+	{
+		if (pending[i].have_stat)
+			continue;
+		reqs[nreqs].name = pending[i].row.name;
+		reqs[nreqs].follow = PGORPH_STAT_FOLLOW(&pending[i].fname);
+		reqs[nreqs].st = &pending[i].st;
+		reqs[nreqs].err = &pending[i].err;
+		nreqs++;
+	}
+
+	pgorph_stat_batch(dirdesc, dir, reqs, nreqs);
+
+	for (i = from; i < to; i++)
+	{
+		PgOrphPending *p = &pending[i];
+
+		/* it may have been dropped in the meantime */
+		if (p->err != 0 && p->err != ENOENT)
+		{
+			errno = p->err;
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not stat file \"%s/%s\": %m", dir, p->row.name)));
+		}
+		if (p->err == 0 && !S_ISREG(p->st.st_mode))
+			p->err = ENOENT;
+		if (p->err != 0)
+			continue;
+
+		p->row.size = (int64) p->st.st_size;
+		p->row.mod_time = time_t_to_timestamptz(p->st.st_mtime);
+
+		/* the cache may predate the creation of the file */
+		if (probe && !p->owner_gone && pgorph_bulk_miss_needs_probe(p->row.mod_time))
+		{
+			instr_time	start;
+
+			INSTR_TIME_SET_CURRENT(start);
+			p->row.reloid = RelidByRelfilenodeDirtyProbe(reltablespace, p->row.relfilenode);
+			PGORPH_PHASE_END(start, catalog_time);
+		}
+	}
+}
+
+static int
+pgorph_pending_cmp(const void *a, const void *b)
+{
+	const PgOrphPending *pa = (const PgOrphPending *) a;
+	const PgOrphPending *pb = (const PgOrphPending *) b;
+	int			cmp;
+
+	cmp = strcmp(pa->row.path, pb->row.path);
+	if (cmp != 0)
+		return cmp;
+	if (pa->fname.backend != pb->fname.backend)
+		return pa->fname.backend < pb->fname.backend ? -1 : 1;
+	if (pa->fname.relfilenode != pb->fname.relfilenode)
+		return pa->fname.relfilenode < pb->fname.relfilenode ? -1 : 1;
+	if (pa->fname.fork != pb->fname.fork)
+		return pa->fname.fork < pb->fname.fork ? -1 : 1;
+	if (pa->fname.segno != pb->fname.segno)
+		return pa->fname.segno < pb->fname.segno ? -1 : 1;
+	return 0;
+}
+
+/*
+ * report the orphaned files, grouped per relfilenode: all the forks and
+ * segments of an orphaned relfilenode are reported together, unless
+ * the first segment of its main fork is empty and has been created after
+ * the last checkpoint
+ * due to https://github.com/postgres/postgres/blob/REL_12_8/src/backend/storage/smgr/md.c#L225
+ * (it has to be checked again during the next scans)
+ *
+ * A directory with many candidates flushes them before it has been read
+ * to the end: the first segment of the main fork of each relfilenode is
+ * then looked up, as it may not have been read yet, and the decision is
+ * kept in decided for the files of the relfilenode that come later,
+ * which are reported in a group of their own.
+ */
+static void
+pgorph_report_groups(PgOrphSink *sink, PgOrphDirState *dstate,
+					 PgOrphPending *pending, int npending,
+					 HTAB **decided, bool flush)
+{
+	int			first;
+	int			last;
+	int			i;
+
+	if (npending > 1)
+		qsort(pending, npending, sizeof(PgOrphPending), pgorph_pending_cmp);
+
+	if (flush && *decided == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(PgOrphGroupKey);
+		ctl.entrysize = sizeof(PgOrphGroupDecision);
+		ctl.hcxt = CurrentMemoryContext;
+		*decided = hash_create("pg_orphaned flushed relfilenodes", 256, &ctl,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	for (first = 0; first < npending; first = last)
+	{
+		bool		deferred = false;
+		bool		known = false;
+		PgOrphGroupKey key;
+		PgOrphGroupDecision *decision = NULL;
+		bool		found;
+
+		/* the files of the same relfilenode in the same directory */
+		for (last = first + 1; last < npending; last++)
+		{
+			if (strcmp(pending[last].row.path, pending[first].row.path) != 0 ||
+				pending[last].fname.backend != pending[first].fname.backend ||
+				pending[last].fname.relfilenode != pending[first].fname.relfilenode)
+				break;
+		}
+
+		/* a file created after the cache has been loaded may have been found */
+		for (i = first; i < last; i++)
+			known |= OidIsValid(pending[i].row.reloid);
+
+		if (decided != NULL && *decided != NULL)
+		{
+			memset(&key, 0, sizeof(key));
+			key.backend = pending[first].fname.backend;
+			key.relfilenode = pending[first].fname.relfilenode;
+			decision = (PgOrphGroupDecision *) hash_search(*decided, &key,
+														   flush ? HASH_ENTER : HASH_FIND,
+														   &found);
+			if (decision != NULL && !found)
+				decision->decided = false;
+		}
+
+		if (decision != NULL && decision->decided)
+		{
+			/* the first files of the relfilenode have already been flushed */
+			known |= decision->known;
+			deferred = decision->deferred && !known;
+		}
+		else
+		{
+			/* sorted first if it exists */
+			if (!known && pending[first].fname.backend < 0 &&
+				pending[first].fname.fork == MAIN_FORKNUM &&
+				pending[first].fname.segno == 0)
+			{
+				if (pending[first].err == 0 &&
+					pending[first].row.size == 0 &&
+					pending[first].row.mod_time > last_checkpoint_time)
+					deferred = true;
+			}
+			else if (!known && pending[first].fname.backend < 0 && flush)
+			{
+				char		name[PGORPH_MAX_FILENAME];
+				struct stat st;
+
+				/* not read yet, or not there at all */
+				snprintf(name, sizeof(name), "%u", pending[first].fname.relfilenode);
+				if (pgorph_stat_entry(NULL, pending[first].row.path, name, &st, true) &&
+					st.st_size == 0 &&
+					time_t_to_timestamptz(st.st_mtime) > last_checkpoint_time)
+					deferred = true;
+			}
+
+			if (decision != NULL)
+			{
+				decision->decided = true;
+				decision->known = known;
+				decision->deferred = deferred;
+			}
+		}
+
+		for (i = first; i < last; i++)
+		{
+			PgOrphPending *p = &pending[i];
+			bool		orphaned = p->err == 0 && !deferred && !known;
+
+			if (p->fstate != NULL)
+				pgorph_incr_end_file(dstate, p->fstate, &p->row, orphaned ? 1 : 0,
+									 deferred && p->err == 0);
+
+			if (orphaned &&
+				pgorph_filter_match(&sink->filter, p->row.size, p->row.mod_time))
+			{
+				pgorph_stats.orphaned++;
+				pgorph_stats.orphaned_size += p->row.size;
+				pgorph_emit(sink, &p->row);
+			}
+		}
+	}
+}
+
+/*
+ * true if the backend that created a temp relation file may still be
+ * using it: its slot is taken by a session of the database. Otherwise
+ * the session that created it is gone, and so is the relation, even if
+ * its pg_class entry is still there until autovacuum drops it.
+ */
+static bool
+pgorph_temp_owner_alive(int backend, Oid dboid)
+{
+	PGPROC	   *proc;
+
+#if PG_VERSION_NUM >= 170000
+	proc = ProcNumberGetProc((ProcNumber) backend);
+#else
+	proc = BackendIdGetProc((BackendId) backend);
+#endif
+
+	return proc != NULL && proc->databaseId == dboid;
+}
+
+/*
+ * true if a file passes the size and age filters of the scan
+ */
+static bool
+pgorph_filter_match(PgOrphFilter *filter, int64 size, TimestampTz mod_time)
+{
+	if (!filter->active)
+		return true;
+	return size >= filter->min_size && mod_time <= filter->max_mod_time;
+}
+
+/*
+ * Incremental scans
+ *
+ * With pg_orphaned.incremental, the state of each scanned directory is
+ * kept for the session: its mtime and, for each file, its size, its mtime
+ * and what it has been classified as (with the orphaned files reported for
+ * it). A directory whose mtime did not change has not seen any file being
+ * created, removed or renamed, so its orphaned files are reported again
+ * without reading it. In a changed directory, only the new or modified
+ * files are classified again. The files found live are the exception:
+ * they are checked against the catalog at each scan.
+ */
+
+/*
+ * get the state of a directory, unchanged is set to true if its
+ * orphaned files can be reported again without reading it
+ */
+static PgOrphDirState *
+pgorph_incr_begin_dir(const char *dir, Oid dboid, Oid reltablespace,
+					  bool *unchanged)
+{
+	PgOrphDirState *dstate;
+	struct stat st;
+	time_t		now = time(NULL);
+	bool		found;
+
+	*unchanged = false;
+
+	if (stat(dir, &st) < 0)
+		return NULL;
+
+	if (pgorph_incr_dirs == NULL)
+	{
+		HASHCTL		ctl;
+
+		pgorph_incr_context = AllocSetContextCreate(TopMemoryContext,
+													"pg_orphaned incremental state",
+													ALLOCSET_DEFAULT_SIZES);
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(((PgOrphDirState *) NULL)->path);
+		ctl.entrysize = sizeof(PgOrphDirState);
+		ctl.hcxt = pgorph_incr_context;
+		pgorph_incr_dirs = hash_create("pg_orphaned directories", 16, &ctl,
+									   HASH_ELEM | PGORPH_HASH_STRINGS | HASH_CONTEXT);
+	}
+
+	if (strlen(dir) >= sizeof(((PgOrphDirState *) NULL)->path))
+		return NULL;
+
+	dstate = (PgOrphDirState *) hash_search(pgorph_incr_dirs, dir, HASH_ENTER, &found);
+	if (!found)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = PGORPH_MAX_FILENAME;
+		ctl.entrysize = sizeof(PgOrphFileState);
+		ctl.hcxt = pgorph_incr_context;
+		dstate->files = hash_create("pg_orphaned files", 256, &ctl,
+									HASH_ELEM | PGORPH_HASH_STRINGS | HASH_CONTEXT);
+		dstate->trusted = false;
+		dstate->generation = 0;
+		dstate->ndeferred = 0;
+	}
+	else if (dstate->trusted && dstate->mtime == st.st_mtime &&
+			 dstate->ndeferred == 0)
+	{
+		HASH_SEQ_STATUS status;
+		PgOrphFileState *fstate;
+
+		/* unless one of its live files lost its relation */
+		*unchanged = true;
+		hash_seq_init(&status, dstate->files);
+		while ((fstate = (PgOrphFileState *) hash_seq_search(&status)) != NULL)
+		{
+			PgOrphFileName fname;
+
+			if (fstate->nrows > 0 || fstate->deferred ||
+				!pgorph_parse_filename(fstate->name, &fname))
+				continue;
+
+			if (!pgorph_incr_still_live(&fname, dboid, reltablespace))
+			{
+				hash_seq_term(&status);
+				*unchanged = false;
+				break;
+			}
+		}
+
+		if (*unchanged)
+			return dstate;
+	}
+
+	/*
+	 * A change done in the same second as the last one would not change
+	 * the mtime, so the directory is only trusted if its mtime is older
+	 * than the beginning of this scan. It is not trusted until the scan
+	 * completes.
+	 */
+	dstate->trusted = false;
+	dstate->scan_mtime = st.st_mtime;
+	dstate->scan_trusted = st.st_mtime < now;
+	dstate->generation++;
+
+	return dstate;
+}
+
+/*
+ * true if a file classified as live still is: the size and the mtime of
+ * the files of a relation do not change when it is dropped, or when the
+ * backend owning a temp relation goes away, so the (cached) catalog is
+ * looked at again at each scan
+ */
+static bool
+pgorph_incr_still_live(PgOrphFileName *fname, Oid dboid, Oid reltablespace)
+{
+	instr_time	start;
+	Oid			oidrel;
+
+	if (fname->backend >= 0 && !pgorph_temp_owner_alive(fname->backend, dboid))
+		return false;
+
+	INSTR_TIME_SET_CURRENT(start);
+	oidrel = RelidByRelfilenodeDirty(reltablespace, fname->relfilenode);
+	PGORPH_PHASE_END(start, catalog_time);
+
+	return OidIsValid(oidrel);
+}
+
+/*
+ * sweep the files that are gone and count the ones to check again
+ */
+static void
+pgorph_incr_end_dir(PgOrphDirState *dstate)
+{
+	HASH_SEQ_STATUS status;
+	PgOrphFileState *fstate;
+
+	dstate->ndeferred = 0;
+
+	hash_seq_init(&status, dstate->files);
+	while ((fstate = (PgOrphFileState *) hash_seq_search(&status)) != NULL)
+	{
+		if (fstate->seen != dstate->generation)
+		{
+			pgorph_incr_free_rows(fstate);
+			hash_search(dstate->files, fstate->name, HASH_REMOVE, NULL);
+			continue;
+		}
+
+		if (fstate->deferred)
+			dstate->ndeferred++;
+	}
+
+	dstate->mtime = dstate->scan_mtime;
+	dstate->trusted = dstate->scan_trusted;
+}
+
+static void
+pgorph_incr_forget_dir(PgOrphDirState *dstate)
+{
+	HASH_SEQ_STATUS status;
+	PgOrphFileState *fstate;
+
+	hash_seq_init(&status, dstate->files);
+	while ((fstate = (PgOrphFileState *) hash_seq_search(&status)) != NULL)
+		pgorph_incr_free_rows(fstate);
+	hash_destroy(dstate->files);
+
+	hash_search(pgorph_incr_dirs, dstate->path, HASH_REMOVE, NULL);
+}
+
+/*
+ * report again the orphaned files of an unchanged directory
+ */
+static void
+pgorph_incr_emit_dir(PgOrphSink *sink, PgOrphDirState *dstate, const char *dbname)
+{
+	HASH_SEQ_STATUS status;
+	PgOrphFileState *fstate;
+	PgOrphPending *pending;
+	int			maxpending = PGORPH_STAT_BATCH;
+	int			npending = 0;
+
+	pending = pgorph_scan_alloc(CurrentMemoryContext, sizeof(PgOrphPending) * maxpending);
+
+	hash_seq_init(&status, dstate->files);
+	while ((fstate = (PgOrphFileState *) hash_seq_search(&status)) != NULL)
+	{
+		PgOrphPending *p;
+		PgOrphFileName fname;
+
+		if (fstate->nrows == 0 || !pgorph_parse_filename(fstate->name, &fname))
+			continue;
+
+		p = pgorph_pending_add(&pending, &npending, &maxpending,
+							   dbname, dstate->path, fstate->name, &fname);
+		p->row.size = fstate->rows[0].size;
+		p->row.mod_time = fstate->rows[0].mod_time;
+		p->have_stat = true;
+	}
+
+	/* in the same order as when the directory is read */
+	pgorph_report_groups(sink, NULL, pending, npending, NULL, false);
+	pfree(pending);
+}
+
+/*
+ * get the state of a file, reuse is set to true if it did not change
+ * since it has been classified
+ */
+static PgOrphFileState *
+pgorph_incr_begin_file(PgOrphDirState *dstate, const char *name,
+					   struct stat *attrib, bool *reuse)
+{
+	PgOrphFileState *fstate;
+	bool		found;
+
+	*reuse = false;
+
+	if (strlen(name) >= PGORPH_MAX_FILENAME)
+		return NULL;
+
+	fstate = (PgOrphFileState *) hash_search(dstate->files, name, HASH_ENTER, &found);
+	fstate->seen = dstate->generation;
+
+	if (found && !fstate->deferred &&
+		fstate->size == (int64) attrib->st_size &&
+		fstate->mtime == attrib->st_mtime)
+	{
+		*reuse = true;
+		return fstate;
+	}
+
+	if (found)
+		pgorph_incr_free_rows(fstate);
+	fstate->rows = NULL;
+	fstate->nrows = 0;
+	/* until pgorph_incr_end_file() records its classification */
+	fstate->deferred = true;
+	fstate->size = (int64) attrib->st_size;
+	fstate->mtime = attrib->st_mtime;
+
+	return fstate;
+}
+
+/*
+ * remember what a file has been classified as, the rows point
+ * to the path of the directory state
+ */
+static void
+pgorph_incr_end_file(PgOrphDirState *dstate, PgOrphFileState *fstate,
+					 OrphanedRelation *rows, int nrows, bool deferred)
+{
+	int			i;
+
+	fstate->deferred = deferred;
+
+	if (nrows == 0)
+		return;
+
+	fstate->rows = MemoryContextAlloc(pgorph_incr_context,
+									  sizeof(OrphanedRelation) * nrows);
+	fstate->nrows = nrows;
+	for (i = 0; i < nrows; i++)
+	{
+		memcpy(&fstate->rows[i], &rows[i], sizeof(OrphanedRelation));
+		/* the database name is the one of the scan reporting it */
+		fstate->rows[i].dbname = NULL;
+		fstate->rows[i].path = dstate->path;
+	}
+}
+
+static void
+pgorph_incr_free_rows(PgOrphFileState *fstate)
+{
+	if (fstate->rows != NULL)
+		pfree(fstate->rows);
+	fstate->rows = NULL;
+	fstate->nrows = 0;
+}
+
+/*
+ * forget everything when pg_orphaned.incremental is disabled
+ */
+static void
+pgorph_incr_reset(void)
+{
+	if (pgorph_incr_context == NULL)
+		return;
+
+	MemoryContextDelete(pgorph_incr_context);
+	pgorph_incr_context = NULL;
+	pgorph_incr_dirs = NULL;
+}
+
+/*
+ * parse a number of at most 32 bits
+ */
+static bool
+pgorph_parse_uint32(const char **str, uint32 *value)
+{
+	const char *p = *str;
+	uint64		v = 0;
+
+	if (!isdigit((unsigned char) *p))
+		return false;
+
+	while (isdigit((unsigned char) *p))
+	{
+		v = v * 10 + (*p - '0');
+		if (v > PG_UINT32_MAX)
+			return false;
+		p++;
+	}
+
+	*str = p;
+	*value = (uint32) v;
+	return true;
+}
+
+/*
+ * Classify a directory entry in a single pass, without allocating:
+ * a relation file name is <relfilenode> or t<backend>_<relfilenode> for
+ * a temp relation, followed by an optional fork (_fsm, _vm or _init)
+ * and an optional segment number (.N)
+ */
+static bool
+pgorph_parse_filename(const char *name, PgOrphFileName *fname)
+{
+	const char *p = name;
+	uint32		value;
+
+	fname->backend = -1;
+	fname->fork = MAIN_FORKNUM;
+	fname->segno = 0;
+
+	if (*p == 't')
+	{
+		p++;
+		if (!pgorph_parse_uint32(&p, &value) || value > INT_MAX || *p != '_')
+			return false;
+		fname->backend = (int) value;
+		p++;
+	}
+
+	if (!pgorph_parse_uint32(&p, &value) || value == InvalidOid)
+		return false;
+	fname->relfilenode = (Oid) value;
+
+	if (*p == '_')
+	{
+		int			forkchars;
+
+		p++;
+		forkchars = forkname_chars(p, &fname->fork);
+		if (forkchars == 0)
+			return false;
+		p += forkchars;
+	}
+
+	if (*p == '.')
+	{
+		p++;
+		/* the first segment has no number */
+		if (!pgorph_parse_uint32(&p, &value) || value == 0)
+			return false;
+		fname->segno = value;
+	}
+
+	return *p == '\0';
+}
+
+/*
+ * The orphaned files of a tablespace are moved to a backup directory
+ * located in the tablespace itself, so that moving them stays a rename
+ * on the same filesystem:
+ *   base/<db>                   -> orphaned_backup/<db>/base/<db>
+ *   pg_tblspc/<ts>/<version>/<db> -> pg_tblspc/<ts>/orphaned_backup/<db>/<version>/<db>
+ * The files moved under orphaned_backup/<db>/pg_tblspc by previous
+ * versions are still listed, moved back and removed.
+ */
+static char *
+pgorph_backup_path(const char *path, Oid dbOid)
+{
+	const char *rest;
+
+	if (strncmp(path, "pg_tblspc/", 10) == 0 &&
+		(rest = strchr(path + 10, '/')) != NULL)
+		return psprintf("%.*s/%s/%u%s", (int) (rest - path), path,
+						orphaned_backup_dir, dbOid, rest);
+
+	return psprintf("%s/%u/%s", orphaned_backup_dir, dbOid, path);
+}
+
+/*
+ * where the files of a backup directory come from
+ */
+static char *
+pgorph_original_path(const char *path)
+{
+	const char *prefix = path;
+	const char *rest;
+	int			i;
+
+	/* pg_tblspc/<ts>/ is kept in front of the backup directory */
+	if (strncmp(path, "pg_tblspc/", 10) == 0 &&
+		(rest = strchr(path + 10, '/')) != NULL)
+		path = rest + 1;
+
+	/* skip orphaned_backup/<db>/ */
+	rest = path;
+	for (i = 0; i < 2 && rest != NULL; i++)
+	{
+		rest = strchr(rest, '/');
+		if (rest != NULL)
+			rest++;
+	}
+	if (rest == NULL)
+		elog(ERROR, "unexpected backup directory \"%s\"", prefix);
+
+	if (path == prefix)
+		return pstrdup(rest);
+	return psprintf("%.*s%s", (int) (path - prefix), prefix, rest);
+}
+
+/*
+ * the backup directories of a database: the one of the data directory
+ * first, then the ones of the tablespaces; with existing set, only the
+ * ones that exist and are not empty
+ */
+static List *
+pgorph_backup_roots(Oid dbOid, bool existing)
+{
+	List	   *roots = NIL;
+	char	   *root;
+	DIR		   *dirdesc;
+	struct dirent *direntry;
+
+	root = psprintf("%s/%u", orphaned_backup_dir, dbOid);
+	if (!existing || pg_orphaned_check_dir(root) == 4)
+		roots = lappend(roots, root);
+
+	dirdesc = AllocateDir("pg_tblspc");
+	while ((direntry = ReadDir(dirdesc, "pg_tblspc")) != NULL)
+	{
+		if (strcmp(direntry->d_name, ".") == 0 ||
+			strcmp(direntry->d_name, "..") == 0)
+			continue;
+
+		root = psprintf("pg_tblspc/%s/%s/%u", direntry->d_name, orphaned_backup_dir, dbOid);
+		if (!existing || pg_orphaned_check_dir(root) == 4)
+			roots = lappend(roots, root);
+	}
+	FreeDir(dirdesc);
+
+	return roots;
+}
+
+/*
+ * function to move orphaned files
+ * to the backup directory
+ * the exact same directory tree is kept
+ */
+Datum
+pg_move_orphaned(PG_FUNCTION_ARGS)
+{
+	Oid                     dbOid;
+	ListCell   *cell;
+	int nb_moved;
+	PgOrphSink	sink;
+	bool		durable;
+	HTAB	   *touched = NULL;
+	List	   *checked_tablespaces;
+	int64		moved_bytes = 0;
+
+	requireSuperuser();
+
+    if (PG_ARGISNULL(0))
+		limitts = GetCurrentTimestamp() - ((3600000 * 24) * (int64) 1000); // 1 Day
+    else
+		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(GetCurrentTimestamp()), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+
+	/* not there when the extension has not been updated to 1.1 */
+	durable = PG_NARGS() > 1 && !PG_ARGISNULL(1) && PG_GETARG_BOOL(1);
+
+	dbOid = MyDatabaseId;
+	pgorph_progress_start(PGORPH_COMMAND_MOVE);
+	pgorph_list_sink_init(&sink);
+	pg_build_orphaned_list(dbOid, false, &sink);
+	nb_moved = 0;
+	checked_tablespaces = NIL;
+
+	if (durable)
+		touched = pgorph_durable_begin();
+
+	pgorph_progress_phase(PGORPH_PHASE_MOVING);
+
+	/* going through the list of orphaned files */
+#if (PG_VERSION_NUM < 130000)
+	for (cell = list_head(sink.list); cell != NULL; cell = lnext(cell))
+#else
+	for (cell = list_head(sink.list); cell != NULL; cell = lnext(sink.list, cell))
+#endif
+	{
+		char  orphaned_file[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
+		char  orphaned_file_backup_dir[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
+		char  orphaned_file_backup[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
+		Oid		reltablespace;
+
+		OrphanedRelation  *orph = (OrphanedRelation *)lfirst(cell);
+
+        snprintf(orphaned_file, sizeof(orphaned_file), "%s/%s", orph->path, orph->name);
+        snprintf(orphaned_file_backup_dir, sizeof(orphaned_file_backup_dir), "%s", pgorph_backup_path(orph->path, dbOid));
+
+		/*
+		 * The backup directory of a tablespace (the default one included)
+		 * is checked the first time one of its files is moved: nothing is
+		 * created when there is nothing to move
+		 */
+		reltablespace = pgorph_path_tablespace(orph->path);
+		pgorph_progress_set(PGORPH_PROGRESS_TABLESPACE, reltablespace);
+		if (!list_member_oid(checked_tablespaces, reltablespace))
+		{
+			char	   *root;
+
+			if (reltablespace == DEFAULTTABLESPACE_OID)
+				root = psprintf("%s/%u", orphaned_backup_dir, dbOid);
+			else
+				root = psprintf("pg_tblspc/%u/%s/%u", reltablespace, orphaned_backup_dir, dbOid);
+
+			verify_dir_is_empty_or_create(root, &made_directory, &found_existing_directory, true);
+			checked_tablespaces = lappend_oid(checked_tablespaces, reltablespace);
+			pfree(root);
+		}
+
+		/*
+		 * Create the directory if it does not exist
+		 */
+		if (pg_orphaned_check_dir(orphaned_file_backup_dir) == 0)
+			verify_dir_is_empty_or_create(orphaned_file_backup_dir, &made_directory, &found_existing_directory, false);
+
+        snprintf(orphaned_file_backup, sizeof(orphaned_file_backup), "%s/%s", orphaned_file_backup_dir, orph->name);
+
+        /* If old enough, move the orphaned file and check the success */
+        if (orph->mod_time <= limitts)
+        {
+            pgorph_move_file(orphaned_file, orphaned_file_backup, touched != NULL);
+            nb_moved++;
+            moved_bytes += orph->size;
+            pgorph_progress_set(PGORPH_PROGRESS_BYTES, moved_bytes);
+
+            if (touched)
+            {
+                pgorph_durable_add(touched, orph->path, false);
+                pgorph_durable_add(touched, orphaned_file_backup_dir, true);
+            }
+        }
+	}
+
+	if (touched)
+	{
+		pgorph_progress_phase(PGORPH_PHASE_SYNCING);
+		pgorph_durable_end(touched);
+	}
+
+	pgorph_progress_end();
+	PG_RETURN_INT32(nb_moved);
+}
+
+/*
+ * rename a file, or copy it then remove it when it has to cross
+ * filesystems (the removal being made durable too for a durable move)
+ */
+static void
+pgorph_move_file(const char *from, const char *to, bool durable)
+{
+	struct stat attrib;
+
+	if (rename(from, to) == 0)
+		return;
+
+	if (errno != EXDEV)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rename \"%s\" to \"%s\": %m",
+						from, to)));
+
+	/* the directory of a shared fileset */
+	if (stat(from, &attrib) == 0 && S_ISDIR(attrib.st_mode))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rename \"%s\" to \"%s\": %m",
+						from, to),
+				 errhint("Directories are not copied across filesystems.")));
+
+	pgorph_copy_file(from, to);
+
+	if (unlink(from) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", from)));
+
+	if (durable)
+	{
+		char		dir[MAXPGPATH];
+
+		strlcpy(dir, from, MAXPGPATH);
+		get_parent_directory(dir);
+		pgorph_fsync_path(dir, true);
+	}
+}
+
+/*
+ * The copy is written to a temporary file, synced, then renamed and its
+ * directory synced, before the source is removed: an interrupted copy
+ * never shows up as a moved file. The temporary file is removed when the
+ * copy fails or is cancelled; only a crash leaves it behind, for
+ * pg_remove_moved_orphaned() to remove (or the next copy of the same
+ * file to overwrite, in the case of a move back).
+ */
+static void
+pgorph_copy_file(const char *from, const char *to)
+{
+	char		tmp[MAXPGPATH];
+	char		dir[MAXPGPATH];
+
+	snprintf(tmp, sizeof(tmp), "%s.pg_orphaned_tmp", to);
+
+	PG_TRY();
+	{
+		pgorph_copy_data(from, tmp);
+
+		if (rename(tmp, to) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not rename \"%s\" to \"%s\": %m", tmp, to)));
+	}
+	PG_CATCH();
+	{
+		(void) unlink(tmp);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	strlcpy(dir, to, MAXPGPATH);
+	get_parent_directory(dir);
+	pgorph_fsync_path(dir, true);
+
+	pgorph_stats.copied_files++;
+}
+
+/*
+ * copy a file to a new file, and fsync it
+ */
+static void
+pgorph_copy_data(const char *from, const char *tmp)
+{
+	int			srcfd;
+	int			dstfd;
+	struct stat attrib;
+	off_t		offset = 0;
+	bool		copied = false;
+#ifdef FICLONE
+	int			rc;
+#endif
+
+#if PG_VERSION_NUM >= 110000
+	srcfd = OpenTransientFile(from, O_RDONLY | PG_BINARY);
+#else
+	srcfd = OpenTransientFile((char *) from, O_RDONLY | PG_BINARY, 0);
+#endif
+	if (srcfd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", from)));
+
+	if (fstat(srcfd, &attrib) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", from)));
+
+#if PG_VERSION_NUM >= 110000
+	dstfd = OpenTransientFilePerm(tmp, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+								  pg_file_create_mode);
+#else
+	dstfd = OpenTransientFile((char *) tmp, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+							  pg_file_create_mode);
+#endif
+	if (dstfd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmp)));
+
+#ifdef FICLONE
+	/* shares the blocks, when both sides are on the same filesystem */
+	pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_COPY));
+	rc = ioctl(dstfd, FICLONE, srcfd);
+	pgstat_report_wait_end();
+	if (rc == 0)
+	{
+		copied = true;
+		pgorph_stats.clones++;
+	}
+#endif
+
+#ifdef PGORPH_HAVE_COPY_FILE_RANGE
+	while (!copied && offset < attrib.st_size)
+	{
+		ssize_t		nbytes;
+
+		CHECK_FOR_INTERRUPTS();
+
+		pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_COPY));
+		nbytes = copy_file_range(srcfd, NULL, dstfd, NULL,
+								 Min(attrib.st_size - offset, PGORPH_COPY_CHUNK), 0);
+		pgstat_report_wait_end();
+		if (nbytes < 0)
+		{
+			/* not supported across these filesystems, copy through a buffer */
+			if (offset == 0 &&
+				(errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+				break;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not copy file \"%s\" to \"%s\": %m", from, tmp)));
+		}
+		if (nbytes == 0)
+			break;
+		offset += nbytes;
+		pgorph_stats.copied_bytes += nbytes;
+	}
+	if (!copied && offset > 0)
+		copied = true;
+#endif
+
+	if (!copied)
+	{
+		char	   *buffer = palloc(PGORPH_COPY_BUFFER);
+
+		if (lseek(srcfd, offset, SEEK_SET) < 0 || lseek(dstfd, offset, SEEK_SET) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek in file \"%s\": %m", from)));
+
+		for (;;)
+		{
+			ssize_t		nread;
+			ssize_t		nwritten;
+
+			CHECK_FOR_INTERRUPTS();
+
+			pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_COPY));
+			nread = read(srcfd, buffer, PGORPH_COPY_BUFFER);
+			pgstat_report_wait_end();
+			if (nread < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read file \"%s\": %m", from)));
+			if (nread == 0)
+				break;
+
+			errno = 0;
+			pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_COPY));
+			nwritten = write(dstfd, buffer, nread);
+			pgstat_report_wait_end();
+			if (nwritten != nread)
+			{
+				/* if write didn't set errno, assume problem is no disk space */
+				if (errno == 0)
+					errno = ENOSPC;
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not write to file \"%s\": %m", tmp)));
+			}
+			pgorph_stats.copied_bytes += nread;
+		}
+		pfree(buffer);
+	}
+
+	if (pgorph_fsync(dstfd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmp)));
+
+	CloseTransientFile(dstfd);
+	CloseTransientFile(srcfd);
+}
+
+/*
+ * Durable moves: the source and destination directories of the renames
+ * are collected, then each of them is fsync'ed once when all the files
+ * have been moved, rather than once per file as durable_rename() does.
+ */
+static HTAB *
+pgorph_durable_begin(void)
+{
+	HASHCTL		ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = MAXPGPATH;
+	ctl.entrysize = MAXPGPATH;
+	ctl.hcxt = CurrentMemoryContext;
+
+	return hash_create("pg_orphaned touched directories", 64, &ctl,
+					   HASH_ELEM | PGORPH_HASH_STRINGS | HASH_CONTEXT);
+}
+
+/*
+ * add a directory, and its parents if it may have been created by the
+ * move (the data directory being the parent of the top one)
+ */
+static void
+pgorph_durable_add(HTAB *touched, const char *dir, bool with_parents)
+{
+	char		path[MAXPGPATH];
+	char	   *slash;
+
+	strlcpy(path, dir, MAXPGPATH);
+	hash_search(touched, path, HASH_ENTER, NULL);
+
+	if (!with_parents)
+		return;
+
+	while ((slash = strrchr(path, '/')) != NULL)
+	{
+		bool		found;
+
+		*slash = '\0';
+		hash_search(touched, path, HASH_ENTER, &found);
+		if (found)
+			return;
+	}
+	hash_search(touched, ".", HASH_ENTER, NULL);
+}
+
+static void
+pgorph_durable_end(HTAB *touched)
+{
+	HASH_SEQ_STATUS status;
+	char	   *dir;
+
+	hash_seq_init(&status, touched);
+	while ((dir = (char *) hash_seq_search(&status)) != NULL)
+		pgorph_fsync_path(dir, true);
+
+	hash_destroy(touched);
+
+	ereport(DEBUG1,
+			(errmsg("fsynced " INT64_FORMAT " files and directories in %.3f ms",
+					pgorph_stats.fsyncs, (double) pgorph_stats.fsync_time / 1000.0)));
+}
+
+/*
+ * fsync a file or a directory, failing with a plain ERROR: fsync_fname()
+ * turns a failure into a PANIC when data_sync_retry is off, which is
+ * meant for the files of the cluster, not for the moved orphaned files
+ */
+static void
+pgorph_fsync_path(const char *path, bool isdir)
+{
+	int			fd;
+	int			rc;
+
+	/* some OSes need directories to be opened read-only */
+#if PG_VERSION_NUM >= 110000
+	fd = OpenTransientFile(path, PG_BINARY | (isdir ? O_RDONLY : O_RDWR));
+#else
+	fd = OpenTransientFile((char *) path, PG_BINARY | (isdir ? O_RDONLY : O_RDWR), 0);
+#endif
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+
+	rc = pgorph_fsync(fd);
+
+	/* and some do not allow to fsync them at all */
+	if (rc != 0 && !(isdir && (errno == EBADF || errno == EINVAL)))
+	{
+		int			save_errno = errno;
+
+		CloseTransientFile(fd);
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", path)));
+	}
+
+	CloseTransientFile(fd);
+}
+
+/*
+ * pg_fsync(), counted in the statistics of the scan
+ */
+static int
+pgorph_fsync(int fd)
+{
+	instr_time	start;
+	int			rc;
+
+	INSTR_TIME_SET_CURRENT(start);
+	rc = pg_fsync(fd);
+	PGORPH_PHASE_END(start, fsync_time);
+	pgorph_stats.fsyncs++;
+
+	return rc;
+}
+
+/*
+ * function to remove the orphaned files
+ * we basically remove the whole backup directory
+ * for this database
+ */
+Datum
+pg_remove_moved_orphaned(PG_FUNCTION_ARGS)
+{
+
+	Oid                     dbOid;
+	char *dir_to_remove;
+	List	   *roots;
+	List	   *files = NIL;
+	ListCell   *cell;
+	PgOrphRemoveState state;
+
+	requireSuperuser();
+
+	dbOid = MyDatabaseId;
+
+	/* the backup directory of the database and the ones of its tablespaces */
+	roots = pgorph_backup_roots(dbOid, false);
+
+	/*
+	 * Unlinking many large segments at once makes the filesystem free all
+	 * their extents in one go, so the files are shrunk and removed one by
+	 * one, at the pace allowed by pg_orphaned.remove_rate_limit, before the
+	 * (then empty) directories are removed.
+	 */
+	memset(&state, 0, sizeof(state));
+	state.last_report = GetCurrentTimestamp();
+	pgorph_progress_start(PGORPH_COMMAND_REMOVE);
+	pgorph_progress_phase(PGORPH_PHASE_COLLECTING);
+	foreach(cell, roots)
+		pgorph_remove_collect((const char *) lfirst(cell), &files, &state);
+
+	pgorph_progress_set(PGORPH_PROGRESS_ORPHANED, state.files);
+	pgorph_progress_phase(PGORPH_PHASE_REMOVING);
+
+#if (PG_VERSION_NUM < 130000)
+	for (cell = list_head(files); cell != NULL; cell = lnext(cell))
+#else
+	for (cell = list_head(files); cell != NULL; cell = lnext(files, cell))
+#endif
+	{
+		const char *file = (const char *) lfirst(cell);
+		struct stat attrib;
+
+		if (stat(file, &attrib) < 0)
+		{
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", file)));
+		}
+
+		pgorph_remove_file(file, attrib.st_size, &state);
+	}
+
+	if (state.files > 0)
+		pgorph_remove_report(&state);
+
+	foreach(cell, roots)
+	{
+		dir_to_remove = (char *) lfirst(cell);
+
+		/* only the one of the database is expected to exist */
+		if (cell != list_head(roots) && pg_orphaned_check_dir(dir_to_remove) == 0)
+			continue;
+
+		if (!rmtree(dir_to_remove, true))
+			ereport(WARNING,
+					(errmsg("could not remove directory \"%s\"", dir_to_remove)));
+
+		/* Now remove the top directory if empty */
+		get_parent_directory(dir_to_remove);
+
+		if (is_directory_empty(dir_to_remove) && !rmtree(dir_to_remove, true))
+			ereport(WARNING,
+					(errmsg("could not remove directory \"%s\"", dir_to_remove)));
+	}
+
+	pgorph_progress_end();
+	PG_RETURN_INT64(state.freed);
+}
+
+/*
+ * collect the regular files located under path, and their total size
+ */
+static void
+pgorph_remove_collect(const char *path, List **files, PgOrphRemoveState *state)
+{
+	DIR		   *dirdesc;
+	struct dirent *de;
+
+	dirdesc = AllocateDir(path);
+	if (dirdesc == NULL)
+	{
+		/* rmtree() will complain about it */
+		if (errno == ENOENT)
+			return;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", path)));
+	}
+
+	while ((de = ReadDir(dirdesc, path)) != NULL)
+	{
+		char	   *file;
+		struct stat attrib;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0)
+			continue;
+
+		file = psprintf("%s/%s", path, de->d_name);
+		if (lstat(file, &attrib) < 0)
+		{
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", file)));
+		}
+
+		if (S_ISDIR(attrib.st_mode))
+			pgorph_remove_collect(file, files, state);
+		else if (S_ISREG(attrib.st_mode))
+		{
+			*files = lappend(*files, file);
+			state->files++;
+			state->bytes += attrib.st_size;
+			pgorph_progress_set(PGORPH_PROGRESS_FILES, state->files);
+		}
+	}
+
+	FreeDir(dirdesc);
+}
+
+/*
+ * shrink a file by steps of pg_orphaned.remove_truncate_step, then
+ * unlink it, sleeping between the steps as needed
+ */
+static void
+pgorph_remove_file(const char *path, int64 size, PgOrphRemoveState *state)
+{
+	int64		step = (int64) pgorph_remove_truncate_step * 1024 * 1024;
+
+	if (step > 0 && size > step)
+	{
+		int			fd;
+
+#if PG_VERSION_NUM >= 110000
+		fd = OpenTransientFile(path, O_RDWR | PG_BINARY);
+#else
+		fd = OpenTransientFile((char *) path, O_RDWR | PG_BINARY, 0);
+#endif
+		if (fd < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+
+		while (size > step)
+		{
+			int			rc;
+
+			pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_REMOVE));
+			rc = ftruncate(fd, size - step);
+			pgstat_report_wait_end();
+			if (rc < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not truncate file \"%s\": %m", path)));
+			size -= step;
+			state->freed += step;
+			pgorph_remove_delay(state, step);
+		}
+
+		CloseTransientFile(fd);
+	}
+
+	pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_REMOVE));
+	if (unlink(path) < 0 && errno != ENOENT)
+	{
+		pgstat_report_wait_end();
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+	}
+	pgstat_report_wait_end();
+
+	state->removed++;
+	state->freed += size;
+	pgorph_remove_delay(state, size);
+}
+
+/*
+ * sleep in proportion to the bytes freed since the last sleep, once
+ * they exceed the budget of PGORPH_REMOVE_DELAY_MS, and report the
+ * progress every PGORPH_REMOVE_PROGRESS_MS
+ */
+static void
+pgorph_remove_delay(PgOrphRemoveState *state, int64 bytes)
+{
+	int64		rate = (int64) pgorph_remove_rate_limit * 1024;
+	TimestampTz now;
+
+	CHECK_FOR_INTERRUPTS();
+
+	pgorph_progress_set(PGORPH_PROGRESS_BYTES, state->freed);
+
+	state->balance += bytes;
+	if (rate > 0 && state->balance >= rate * PGORPH_REMOVE_DELAY_MS / 1000)
+	{
+		int64		msec = state->balance * 1000 / rate;
+
+		state->balance = 0;
+		while (msec > 0)
+		{
+			long		timeout = (long) Min(msec, 1000);
+			int			rc;
+
+			rc = WaitLatch(MyLatch, PGORPH_WL_FLAGS | WL_TIMEOUT, timeout,
+						   pgorph_wait_event(PGORPH_WAIT_THROTTLE));
+#if PG_VERSION_NUM < 120000
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+#else
+			(void) rc;
+#endif
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+			msec -= timeout;
+		}
+	}
+
+	now = GetCurrentTimestamp();
+	if (TimestampDifferenceExceeds(state->last_report, now, PGORPH_REMOVE_PROGRESS_MS))
+	{
+		pgorph_remove_report(state);
+		state->last_report = now;
+	}
+}
+
+static void
+pgorph_remove_report(PgOrphRemoveState *state)
+{
+	ereport(NOTICE,
+			(errmsg("removed " INT64_FORMAT " of " INT64_FORMAT " files, "
+					INT64_FORMAT " of " INT64_FORMAT " bytes freed",
+					state->removed, state->files, state->freed, state->bytes)));
+}
+
+/*
+ * function to move back the backed up
+ * orphaned files to their original location
+ * we ensure that the files to restore are still
+ * orphaned ones
+ */
+Datum
+pg_move_back_orphaned(PG_FUNCTION_ARGS)
+{
+
+	Oid                     dbOid;
+	ListCell   *cell;
+	int nb_moved;
+	int			nb_spill = 0;
+	PgOrphSink	sink;
+	int64		moved_bytes = 0;
+
+	requireSuperuser();
+
+	dbOid = MyDatabaseId;
+	nb_moved = 0;
+
+	/*
+	 * Nothing to move back if all the backup directories are missing or empty
+	 */
+	if (pgorph_backup_roots(dbOid, true) == NIL)
+		PG_RETURN_INT32(nb_moved);
+
+	/* building the list of orphaned files
+	 * from the backup location: so the second arg is set to true
+	 */
+	pgorph_progress_start(PGORPH_COMMAND_MOVE_BACK);
+	pgorph_list_sink_init(&sink);
+	pg_build_orphaned_list(dbOid, true, &sink);
+	pgorph_progress_phase(PGORPH_PHASE_MOVING);
+
+	/* going through the list of orphaned files */
+#if (PG_VERSION_NUM < 130000)
+	for (cell = list_head(sink.list); cell != NULL; cell = lnext(cell))
+#else
+	for (cell = list_head(sink.list); cell != NULL; cell = lnext(sink.list, cell))
+#endif
+	{
+		char  orphaned_file_backup[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
+		char  orphaned_file_restore[MAXPGPATH + 21 + sizeof(TABLESPACE_VERSION_DIRECTORY) + 10 + 6] = {0};
+
+		OrphanedRelation  *orph = (OrphanedRelation *)lfirst(cell);
+
+		/* the temporary files are of no use to anyone, they stay to be removed */
+		if (!OidIsValid(orph->relfilenode))
+		{
+			nb_spill++;
+			continue;
+		}
+
+		snprintf(orphaned_file_backup, sizeof(orphaned_file_backup), "%s/%s", orph->path, orph->name);
+
+		/* remove the directories used to locate the backup */
+		snprintf(orphaned_file_restore, sizeof(orphaned_file_restore), "%s/%s", pgorph_original_path(orph->path), orph->name);
+
+		/* move the orphaned files back to their original location */
+		pgorph_progress_set(PGORPH_PROGRESS_TABLESPACE, pgorph_path_tablespace(orph->path));
+		pgorph_move_file(orphaned_file_backup, orphaned_file_restore, false);
+		nb_moved++;
+		moved_bytes += orph->size;
+		pgorph_progress_set(PGORPH_PROGRESS_BYTES, moved_bytes);
+	}
+
+	if (nb_spill > 0)
+		ereport(NOTICE,
+				(errmsg("%d temporary files left in the backup directories", nb_spill),
+				 errhint("They can be removed with pg_remove_moved_orphaned().")));
+
+	pgorph_progress_end();
+	PG_RETURN_INT32(nb_moved);
+}
+
+/*
+ * Verify that the given directory exists and is empty. If it does not
+ * exist, it is created. If it exists but is not empty, an error will
+ * be given and the process ended.
+ * mainly a copy/paste from the verify_dir_is_empty_or_create() in pg_basebackup.c
+ */
+static void
+verify_dir_is_empty_or_create(char *dirname, bool *created, bool *found, bool display_hint)
+{
+	switch (pg_orphaned_check_dir(dirname))
+	{
+		case 0:
+
+			/*
+			 * Does not exist, so create
+			 */
+			if (pg_orphaned_mkdir_p(dirname, pg_dir_create_mode) == -1)
+			{
+				ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("could not create directory \"%s\": %m", dirname)));
+				exit(1);
+			}
+			if (created)
+				*created = true;
+			return;
+		case 1:
+
+			/*
+			 * Exists, empty
+			 */
+			if (found)
+				*found = true;
+			return;
+		case 2:
+		case 3:
+		case 4:
+
+			/*
+			 * Exists, not empty
+			 */
+			if (!display_hint)
+				ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("directory \"%s\" exists but is not empty", dirname)));
+			else
+				ereport(ERROR,
+					(errcode_for_file_access(),
+					errmsg("directory \"%s\" exists but is not empty", dirname),
+					errhint(" please check no files exist with pg_list_orphaned_moved(), move them back (if any) with pg_move_back_orphaned() and then clean \"%s\" up with pg_remove_moved_orphaned()", dirname)));
+			exit(1);
+		case -1:
+
+			/*
+			 * Access problem
+			 */
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				errmsg("could not access directory \"%s\": %m", dirname)));
+			exit(1);
+	}
+}
+
+/*
+ * We don't want non superuser to execute the functions
+ */
+static void
+requireSuperuser(void)
+{
+	if (!superuser())
+		ereport(ERROR,
+			(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+			errmsg("only superuser can execute pg_orphaned functions")));
+}
+
+/*
+ * run a batch of stats, through io_uring if configured to and if the
+ * directory is still open, one after the other otherwise
+ */
+static void
+pgorph_stat_batch(DIR *dirdesc, const char *dir, PgOrphStatRequest *reqs, int nreqs)
+{
+	int			i;
+
+	if (nreqs == 0)
+		return;
+
+#ifdef USE_PGORPH_URING
+	if (pgorph_stat_method == PGORPH_STAT_IO_URING && dirdesc != NULL &&
+		pgorph_uring_stat_batch(dirdesc, reqs, nreqs))
+		return;
+#endif
+
+	for (i = 0; i < nreqs; i++)
+	{
+		if (pgorph_fstatat(dirdesc, dir, reqs[i].name, reqs[i].st, reqs[i].follow) < 0)
+			*reqs[i].err = errno;
+		else
+			*reqs[i].err = 0;
+	}
+}
+
+#ifdef USE_PGORPH_URING
+/*
+ * The ring is set up the first time it is needed and kept for the life of
+ * the backend, with the statx buffers. A batch interrupted by an error
+ * waits for its requests in flight before the error goes on and the
+ * directory they are relative to gets closed.
+ */
+static struct io_uring pgorph_ring;
+static struct statx *pgorph_ring_stx = NULL;
+static int pgorph_ring_state = 0;	/* 0: not set up, 1: ready, -1: unusable */
+static int pgorph_ring_inflight = 0;
+static bool pgorph_ring_broken = false;	/* to tear down after an error */
+
+static bool
+pgorph_uring_setup(void)
+{
+	int			rc;
+
+	if (pgorph_ring_state != 0)
+		return pgorph_ring_state > 0;
+
+	rc = io_uring_queue_init(PGORPH_URING_DEPTH, &pgorph_ring, 0);
+	if (rc < 0)
+	{
+		/* not allowed in this environment (seccomp, container...) */
+		pgorph_ring_state = -1;
+		ereport(DEBUG1,
+			(errmsg("pg_orphaned could not set up io_uring, falling back to sync stats: %s",
+					strerror(-rc))));
+		return false;
+	}
+
+#if PG_VERSION_NUM >= 130000
+	/* the ring uses a file descriptor */
+	ReserveExternalFD();
+#endif
+	pgorph_ring_stx = MemoryContextAlloc(TopMemoryContext,
+										 sizeof(struct statx) * PGORPH_URING_DEPTH);
+	pgorph_ring_state = 1;
+
+	return true;
+}
+
+/*
+ * wait for one completion and record its result
+ */
+static void
+pgorph_uring_reap(PgOrphStatRequest *reqs, int *completed)
+{
+	struct io_uring_cqe *cqe;
+	PgOrphStatRequest *req;
+	struct statx *stx;
+	int			slot;
+	int			rc;
+
+	do
+	{
+		rc = io_uring_wait_cqe(&pgorph_ring, &cqe);
+	} while (rc == -EINTR);
+	if (rc < 0)
+	{
+		pgorph_ring_broken = true;
+		ereport(ERROR,
+			(errmsg("could not wait for io_uring completion: %s", strerror(-rc))));
+	}
+
+	pgorph_ring_inflight--;
+	slot = (int) (uintptr_t) io_uring_cqe_get_data(cqe);
+	req = &reqs[slot];
+	stx = &pgorph_ring_stx[slot];
+
+	if (cqe->res < 0)
+		*req->err = -cqe->res;
+	else
+	{
+		memset(req->st, 0, sizeof(struct stat));
+		req->st->st_mode = stx->stx_mode;
+		req->st->st_size = (off_t) stx->stx_size;
+		req->st->st_mtime = (time_t) stx->stx_mtime.tv_sec;
+		*req->err = 0;
+	}
+	(*completed)++;
+	io_uring_cqe_seen(&pgorph_ring, cqe);
+}
+
+/*
+ * wait for the requests still in flight after an error, without raising
+ * another one: a ring that can not be waited on is torn down, which
+ * cancels them, and not used again
+ */
+static void
+pgorph_uring_drain(void)
+{
+	while (pgorph_ring_inflight > 0)
+	{
+		struct io_uring_cqe *cqe;
+		int			rc;
+
+		rc = io_uring_wait_cqe(&pgorph_ring, &cqe);
+		if (rc == -EINTR)
+			continue;
+		if (rc < 0)
+		{
+			pgorph_ring_broken = true;
+			break;
+		}
+		pgorph_ring_inflight--;
+		io_uring_cqe_seen(&pgorph_ring, cqe);
+	}
+
+	if (pgorph_ring_broken)
+	{
+		io_uring_queue_exit(&pgorph_ring);
+#if PG_VERSION_NUM >= 130000
+		ReleaseExternalFD();
+#endif
+		pgorph_ring_state = -1;
+		pgorph_ring_broken = false;
+		pgorph_ring_inflight = 0;
+	}
+}
+
+/*
+ * submit a statx per request relative to the open directory, as many as
+ * the ring can hold at once, and collect the results
+ * returns false if io_uring can not be used
+ */
+static bool
+pgorph_uring_stat_batch(DIR *dirdesc, PgOrphStatRequest *reqs, int nreqs)
+{
+	int			submitted = 0;
+	int			completed = 0;
+
+	/* a batch fits in the ring, each request having its own statx buffer */
+	StaticAssertStmt(PGORPH_STAT_BATCH <= PGORPH_URING_DEPTH,
+					 "pg_orphaned stat batch does not fit in the ring");
+	Assert(nreqs <= PGORPH_URING_DEPTH);
+
+	if (!pgorph_uring_setup())
+		return false;
+
+	PG_TRY();
+	{
+		while (completed < nreqs)
+		{
+			int			nprepared = 0;
+			int			rc;
+			instr_time	start;
+
+			while (submitted + nprepared < nreqs)
+			{
+				int			slot = submitted + nprepared;
+				struct io_uring_sqe *sqe = io_uring_get_sqe(&pgorph_ring);
+
+				if (sqe == NULL)
+					break;
+				io_uring_prep_statx(sqe, dirfd(dirdesc), reqs[slot].name,
+									reqs[slot].follow ? 0 : AT_SYMLINK_NOFOLLOW,
+									STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME,
+									&pgorph_ring_stx[slot]);
+				io_uring_sqe_set_data(sqe, (void *) (uintptr_t) slot);
+				nprepared++;
+			}
+
+			INSTR_TIME_SET_CURRENT(start);
+			pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_STAT));
+			do
+			{
+				rc = io_uring_submit(&pgorph_ring);
+			} while (rc == -EINTR);
+			pgstat_report_wait_end();
+			if (rc > 0)
+			{
+				submitted += rc;
+				pgorph_ring_inflight += rc;
+			}
+			/* the requests left in the ring would be waited for forever */
+			if (rc != nprepared)
+			{
+				pgorph_ring_broken = true;
+				ereport(ERROR,
+					(errmsg("could not submit io_uring requests: %s",
+							rc < 0 ? strerror(-rc) : "short submit")));
+			}
+			pgorph_stats.stat_batches++;
+
+			/* collect at least one result, then whatever is already there */
+			pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_STAT));
+			pgorph_uring_reap(reqs, &completed);
+			pgstat_report_wait_end();
+			PGORPH_PHASE_END(start, stat_time);
+			while (completed < submitted)
+			{
+				struct io_uring_cqe *cqe;
+
+				if (io_uring_peek_cqe(&pgorph_ring, &cqe) != 0)
+					break;
+				pgorph_uring_reap(reqs, &completed);
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		pgorph_uring_drain();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	pgorph_stats.stat_calls += nreqs;
+
+	return true;
+}
+#endif
+
+/*
+ * stat a file relative to its open directory, or with its full path
+ * when the directory is not open (or on Windows)
+ */
+static int
+pgorph_fstatat(DIR *dirdesc, const char *dir, const char *name,
+			   struct stat *st, bool follow)
+{
+	char		path[MAXPGPATH * 2];
+	instr_time	start;
+	int			rc;
+
+	pgorph_stats.stat_calls++;
+
+	INSTR_TIME_SET_CURRENT(start);
+	pgstat_report_wait_start(pgorph_wait_event(PGORPH_WAIT_STAT));
+#ifndef WIN32
+	if (dirdesc != NULL)
+		rc = fstatat(dirfd(dirdesc), name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+	else
+#endif
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		rc = follow ? stat(path, st) : lstat(path, st);
+	}
+	pgstat_report_wait_end();
+	PGORPH_PHASE_END(start, stat_time);
+
+	return rc;
+}
+
+/*
+ * stat a directory entry, returns false if it is gone or
+ * if it is not a regular file
+ */
+static bool
+pgorph_stat_entry(DIR *dirdesc, const char *dir, const char *name, struct stat *st,
+				  bool follow)
+{
+	if (pgorph_fstatat(dirdesc, dir, name, st, follow) < 0)
+	{
+		if (errno == ENOENT)
+			return false;
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			errmsg("could not stat file \"%s/%s\": %m", dir, name)));
+	}
+
+	return S_ISREG(st->st_mode);
+}
+
+/*
+ * Map a relation's (tablespace, filenode) to a relation's oid and cache the
+ * result.
+ *
+ * This is the same as the existing RelidByRelfilenode in relfilenodemap.c but
+ * it is done by using a DirtySnapshot as we want to see relation being created.
+ *
+ * Once pg_class has been bulk loaded into the cache, a cache miss means that
+ * the relfilenode is not in pg_class and only the relmapper is checked.
+ *
+ * Returns InvalidOid if no relation matching the criteria could be found.
+ */
+Oid
+RelidByRelfilenodeDirty(Oid reltablespace, Oid relfilenode)
+{
+	RelfilenodeMapKeyDirty key;
+	RelfilenodeMapEntryDirty *entry;
+	Oid                     relid;
+#ifdef PGORPH_SHARED_CACHE
+	PgOrphCacheStamp stamp;
+	bool		stamped;
+#endif
+
+	if (RelfilenodeMapHashDirty == NULL)
+		InitializeRelfilenodeMapDirty();
+
+	/* pg_class will show 0 when the value is actually MyDatabaseTableSpace */
+	if (reltablespace == MyDatabaseTableSpace)
+		reltablespace = 0;
+
+	MemSet(&key, 0, sizeof(key));
+	key.reltablespace = reltablespace;
+	key.relfilenode = relfilenode;
+
+	/*
+	 * Check cache and return entry if one is found. Even if no target
+	 * relation can be found later on we store the negative match and return a
+	 * InvalidOid from cache. That's not really necessary for performance
+	 * since querying invalid values isn't supposed to be a frequent thing,
+	 * but it's basically free.
+	 */
+	entry = pgorph_rfn_lookup(RelfilenodeMapHashDirty, key);
+
+	if (entry != NULL &&
+		entry->gen == (OidIsValid(entry->relid) ? pgorph_rfn_reset_gen : pgorph_rfn_inval_gen))
+	{
+		pgorph_stats.cache_hits++;
+		return entry->relid;
+	}
+
+	/*
+	 * In auto mode, switch to the bulk load once enough probes have been
+	 * done during this scan.
+	 */
+	if (!RelfilenodeMapDirtyComplete &&
+		pgorph_lookup_mode == PGORPH_LOOKUP_AUTO &&
+		pgorph_bulk_loaded_at == 0 &&
+		++pgorph_nprobes > pgorph_bulk_threshold)
+	{
+		pgorph_bulk_load_relfilenodes();
+
+		/* the bulk load only enters positive entries */
+		entry = pgorph_rfn_lookup(RelfilenodeMapHashDirty, key);
+		if (entry != NULL && OidIsValid(entry->relid) &&
+			entry->gen == pgorph_rfn_reset_gen)
+		{
+			pgorph_stats.cache_hits++;
+			return entry->relid;
+		}
+	}
+	pgorph_stats.cache_misses++;
+
+	/* the whole pg_class is cached, only mapped relations can be missing */
+	if (RelfilenodeMapDirtyComplete)
+	{
+#if PG_VERSION_NUM >= 160000
+		return RelationMapFilenumberToOid(relfilenode, reltablespace == GLOBALTABLESPACE_OID);
+#else
+		return RelationMapFilenodeToOid(relfilenode, reltablespace == GLOBALTABLESPACE_OID);
+#endif
+	}
+
+#ifdef PGORPH_SHARED_CACHE
+	/* another backend may already have found it */
+	if (pgorph_shared_cache_lookup(reltablespace, relfilenode, &relid))
+	{
+		pgorph_rfn_store(&key, relid);
+		return relid;
+	}
+	stamped = pgorph_shared_cache_stamp(&stamp);
+#endif
+
+	/* ok, no previous cache entry, do it the hard way */
+	relid = RelidByRelfilenodeDirtyProbe(reltablespace, relfilenode);
+
+#ifdef PGORPH_SHARED_CACHE
+	if (stamped && OidIsValid(relid))
+		pgorph_shared_cache_insert(reltablespace, relfilenode, relid, &stamp);
+#endif
+
+	/*
+	 * Only enter entry into cache now, our opening of pg_class could have
+	 * caused cache invalidations to be executed which would have deleted a
+	 * new entry if we had entered it above.
+	 */
+	pgorph_rfn_store(&key, relid);
+
+	return relid;
+}
+
+/*
+ * Enter a relfilenode in the cache, replacing a stale entry, and keep
+ * track of it by relid.  A relid only has one relfilenode at a time: the
+ * entry of its previous one, if any, is removed.
+ */
+static void
+pgorph_rfn_store(RelfilenodeMapKeyDirty *key, Oid relid)
+{
+	RelfilenodeMapEntryDirty *entry;
+	bool		found;
+
+	if (OidIsValid(relid))
+	{
+		PgOrphRelidEntry *rentry;
+
+		rentry = pgorph_relid_insert(RelfilenodeMapRelidDirty, relid, &found);
+		if (found && rentry->gen == pgorph_rfn_reset_gen &&
+			(rentry->key.reltablespace != key->reltablespace ||
+			 rentry->key.relfilenode != key->relfilenode))
+		{
+			RelfilenodeMapKeyDirty oldkey = rentry->key;
+
+			entry = pgorph_rfn_lookup(RelfilenodeMapHashDirty, oldkey);
+			if (entry != NULL && entry->relid == relid)
+				pgorph_rfn_delete(RelfilenodeMapHashDirty, oldkey);
+		}
+		rentry->key = *key;
+		rentry->gen = pgorph_rfn_reset_gen;
+	}
+
+	/* the reverse index is a separate table, entry stays valid */
+	entry = pgorph_rfn_insert(RelfilenodeMapHashDirty, *key, &found);
+	entry->relid = relid;
+	entry->gen = OidIsValid(relid) ? pgorph_rfn_reset_gen : pgorph_rfn_inval_gen;
+}
+
+/*
+ * Look for the relfilenode in pg_class with an index probe (and in the
+ * relmapper), bypassing the cache.
+ */
+static Oid
+RelidByRelfilenodeDirtyProbe(Oid reltablespace, Oid relfilenode)
+{
+	SysScanDesc scandesc;
+	Relation        relation;
+	HeapTuple       ntp;
+	ScanKeyData skey[2];
+	Oid                     relid;
+	bool            found;
+	SnapshotData DirtySnapshot;
+
+	InitDirtySnapshot(DirtySnapshot);
+	if (RelfilenodeMapHashDirty == NULL)
+		InitializeRelfilenodeMapDirty();
+
+	/* pg_class will show 0 when the value is actually MyDatabaseTableSpace */
+	if (reltablespace == MyDatabaseTableSpace)
+		reltablespace = 0;
+
+	relid = InvalidOid;
+
+	if (reltablespace == GLOBALTABLESPACE_OID)
+	{
+		/*
+		 * Ok, shared table, check relmapper.
+		 */
+#if PG_VERSION_NUM >= 160000
+		relid = RelationMapFilenumberToOid(relfilenode, true);
+#else
+		relid = RelationMapFilenodeToOid(relfilenode, true);
+#endif
+	}
+	else
+	{
+		/*
+		 * Not a shared table, could either be a plain relation or a
+		 * non-shared, nailed one, like e.g. pg_class.
+		 */
+		/* check for plain relations by looking in pg_class */
+		pgorph_stats.catalog_probes++;
+#if PG_VERSION_NUM >= 120000
+		relation = table_open(RelationRelationId, AccessShareLock);
+#else
+		relation = heap_open(RelationRelationId, AccessShareLock);
+#endif
+		/* copy scankey to local copy, it will be modified during the scan */
+		memcpy(skey, relfilenode_skey_dirty, sizeof(skey));
+
+		/* set scan arguments */
+		skey[0].sk_argument = ObjectIdGetDatum(reltablespace);
+		skey[1].sk_argument = ObjectIdGetDatum(relfilenode);
+
+		scandesc = systable_beginscan(relation,
+							ClassTblspcRelfilenodeIndexId,
+							true,
+							&DirtySnapshot,
+							2,
+							skey);
+
+		found = false;
+
+		while (HeapTupleIsValid(ntp = systable_getnext(scandesc)))
+		{
+#if PG_VERSION_NUM >= 120000
+			Form_pg_class classform = (Form_pg_class) GETSTRUCT(ntp);
+			found = true;
+
+			Assert(classform->reltablespace == reltablespace);
+			Assert(classform->relfilenode == relfilenode);
+			relid = classform->oid;
+#else
+			found = true;
+			relid = HeapTupleGetOid(ntp);
+#endif
+		}
+
+		systable_endscan(scandesc);
+#if PG_VERSION_NUM >= 120000
+		table_close(relation, AccessShareLock);
+#else
+		heap_close(relation, AccessShareLock);
+#endif
+		/* check for tables that are mapped but not shared */
+		if (!found)
+#if PG_VERSION_NUM >= 160000
+			relid = RelationMapFilenumberToOid(relfilenode, false);
+#else
+			relid = RelationMapFilenodeToOid(relfilenode, false);
+#endif
+	}
+
+	return relid;
+}
+
+/*
+ * Load every (reltablespace, relfilenode) pair of pg_class into the cache
+ * with one dirty snapshot pass, instead of one index probe per file.
+ * Mapped relations have a zero relfilenode in pg_class and are resolved
+ * through the relmapper on cache misses.
+ */
+static void
+pgorph_bulk_load_relfilenodes(void)
+{
+	SysScanDesc scandesc;
+	Relation        relation;
+	HeapTuple       ntp;
+	SnapshotData DirtySnapshot;
+
+	InitDirtySnapshot(DirtySnapshot);
+	if (RelfilenodeMapHashDirty == NULL)
+		InitializeRelfilenodeMapDirty();
+
+	pgorph_bulk_loaded_at = GetCurrentTimestamp();
+
+#if PG_VERSION_NUM >= 120000
+	relation = table_open(RelationRelationId, AccessShareLock);
+#else
+	relation = heap_open(RelationRelationId, AccessShareLock);
+#endif
+
+	scandesc = systable_beginscan(relation, InvalidOid, false,
+								  &DirtySnapshot, 0, NULL);
+
+	while (HeapTupleIsValid(ntp = systable_getnext(scandesc)))
+	{
+		Form_pg_class classform = (Form_pg_class) GETSTRUCT(ntp);
+		RelfilenodeMapKeyDirty key;
+
+		if (!OidIsValid(classform->relfilenode))
+			continue;
+
+		MemSet(&key, 0, sizeof(key));
+		key.reltablespace = classform->reltablespace;
+		key.relfilenode = classform->relfilenode;
+
+#if PG_VERSION_NUM >= 120000
+		pgorph_rfn_store(&key, classform->oid);
+#else
+		pgorph_rfn_store(&key, HeapTupleGetOid(ntp));
+#endif
+	}
+
+	systable_endscan(scandesc);
+#if PG_VERSION_NUM >= 120000
+	table_close(relation, AccessShareLock);
+#else
+	heap_close(relation, AccessShareLock);
+#endif
+
+	RelfilenodeMapDirtyComplete = true;
+}
+
+/*
+ * Reset the lookup state at the beginning of a scan and, depending on
+ * pg_orphaned.catalog_lookup, bulk load pg_class or compute the number
+ * of probes after which auto switches to the bulk load.
+ */
+static void
+pgorph_init_lookup(void)
+{
+	Relation        relation;
+	BlockNumber     nblocks;
+
+	RelfilenodeMapDirtyComplete = false;
+	pgorph_bulk_loaded_at = 0;
+	pgorph_nprobes = 0;
+
+	if (pgorph_lookup_mode == PGORPH_LOOKUP_BULK)
+	{
+		pgorph_bulk_load_relfilenodes();
+		return;
+	}
+
+	if (pgorph_lookup_mode == PGORPH_LOOKUP_PROBE)
+		return;
+
+#if PG_VERSION_NUM >= 120000
+	relation = table_open(RelationRelationId, AccessShareLock);
+#else
+	relation = heap_open(RelationRelationId, AccessShareLock);
+#endif
+	nblocks = RelationGetNumberOfBlocks(relation);
+#if PG_VERSION_NUM >= 120000
+	table_close(relation, AccessShareLock);
+#else
+	heap_close(relation, AccessShareLock);
+#endif
+
+	pgorph_bulk_threshold = Max(nblocks / PGORPH_PAGES_PER_PROBE,
+								PGORPH_MIN_BULK_THRESHOLD);
+}
+
+/*
+ * A file created after the bulk load may belong to a relation whose
+ * pg_class entry was not there yet, so a miss on such a file has to be
+ * confirmed with a probe.
+ */
+static bool
+pgorph_bulk_miss_needs_probe(TimestampTz mod_time)
+{
+	if (!RelfilenodeMapDirtyComplete)
+		return false;
+
+	/* st_mtime has a one second granularity */
+	return mod_time >= pgorph_bulk_loaded_at - USECS_PER_SEC;
+}
+
+/*
+ *  Flush mapping entries when pg_class is updated in a relevant fashion.
+ *  Same as RelfilenodeMapInvalidateCallback in relfilenodemap.c, without
+ *  walking the whole cache: only the entry of relid is removed, and the
+ *  negative entries (or all of them for a complete reset) are outdated
+ *  by bumping a generation.
+ */
+static void
+RelfilenodeMapInvalidateCallbackDirty(Datum arg, Oid relid)
+{
+	PgOrphRelidEntry *rentry;
+
+	/* callback only gets registered after creating the hash */
+	Assert(RelfilenodeMapHashDirty != NULL);
+
+	/* only the ones received while scanning */
+	if (pgorph_scan_context != NULL)
+		pgorph_stats.invalidations++;
+
+	/*
+	 * A new relation may be missing from the bulk loaded entries, let auto
+	 * mode count its probes again and reload pg_class if needed.
+	 */
+	RelfilenodeMapDirtyComplete = false;
+	pgorph_bulk_loaded_at = 0;
+	pgorph_nprobes = 0;
+
+	/* always outdate negative cache entries */
+	pgorph_rfn_inval_gen++;
+
+	/* complete reset */
+	if (relid == InvalidOid)
+	{
+		pgorph_rfn_reset_gen++;
+		return;
+	}
+
+	/* individual flushed relation */
+	rentry = pgorph_relid_lookup(RelfilenodeMapRelidDirty, relid);
+	if (rentry == NULL)
+		return;
+
+	if (rentry->gen == pgorph_rfn_reset_gen)
+	{
+		RelfilenodeMapKeyDirty key = rentry->key;
+		RelfilenodeMapEntryDirty *entry;
+
+		entry = pgorph_rfn_lookup(RelfilenodeMapHashDirty, key);
+		if (entry != NULL && entry->relid == relid)
+			pgorph_rfn_delete(RelfilenodeMapHashDirty, key);
+	}
+	pgorph_relid_delete(RelfilenodeMapRelidDirty, relid);
+}
+
+/*
+ * Initialize cache, either on first use or after a reset.
+ * Same as InitializeRelfilenodeMap in relfilenodemap.c
+ */
+static void
+InitializeRelfilenodeMapDirty(void)
+{
+	int                     i;
+
+	/* Make sure we've initialized CacheMemoryContext. */
+	if (CacheMemoryContext == NULL)
 		CreateCacheMemoryContext();
 
-	/* build skey */
-	MemSet(&relfilenode_skey_dirty, 0, sizeof(relfilenode_skey_dirty));
+	/* build skey */
+	MemSet(&relfilenode_skey_dirty, 0, sizeof(relfilenode_skey_dirty));
+
+	for (i = 0; i < 2; i++)
+	{
+		fmgr_info_cxt(F_OIDEQ,
+					&relfilenode_skey_dirty[i].sk_func,
+					CacheMemoryContext);
+		relfilenode_skey_dirty[i].sk_strategy = BTEqualStrategyNumber;
+		relfilenode_skey_dirty[i].sk_subtype = InvalidOid;
+		relfilenode_skey_dirty[i].sk_collation = InvalidOid;
+	}
+
+	relfilenode_skey_dirty[0].sk_attno = Anum_pg_class_reltablespace;
+	relfilenode_skey_dirty[1].sk_attno = Anum_pg_class_relfilenode;
+
+	/*
+	 * Only create the RelfilenodeMapHashDirty now, so we don't end up partially
+	 * initialized when fmgr_info_cxt() above ERRORs out with an out of memory
+	 * error.
+	 * Note that the hash tables are not created in shared memory but in
+	 * private memory.
+	 */
+	RelfilenodeMapRelidDirty = pgorph_relid_create(CacheMemoryContext, 64, NULL);
+	RelfilenodeMapHashDirty = pgorph_rfn_create(CacheMemoryContext, 64, NULL);
+
+	/* Watch for invalidation events. */
+	CacheRegisterRelcacheCallback(RelfilenodeMapInvalidateCallbackDirty,
+									(Datum) 0);
+}
+
+/*
+ * Background scanner
+ *
+ * When loaded with shared_preload_libraries, a background worker connected
+ * to pg_orphaned.scan_database rescans it every pg_orphaned.scan_interval
+ * seconds and publishes the orphaned files, with per tablespace totals,
+ * in a dynamic shared memory area that pg_orphaned_cached() and
+ * pg_orphaned_cached_tablespaces() read without touching the filesystem.
+ */
+
+/*
+ * Shared memory state
+ */
+typedef struct PgOrphSharedState
+{
+	LWLock	   *lock;			/* protects the fields below */
+	int			dsa_tranche;
+	bool		dsa_created;
+	dsa_handle	dsa;
+	dsa_pointer snapshot;		/* PgOrphSnapshot, or InvalidDsaPointer */
+#ifdef PGORPH_SHARED_CACHE
+	int			cache_tranche;
+	bool		cache_created;
+	dshash_table_handle cache;
+	pg_atomic_uint32 cache_entries;	/* approximate */
+	pg_atomic_uint64 inval_reset;
+	pg_atomic_uint64 inval_any;
+	pg_atomic_uint64 inval_relid[PGORPH_INVAL_SLOTS];
+#endif
+} PgOrphSharedState;
+
+/*
+ * The published snapshot: the header is followed by the tablespace
+ * totals, the orphaned files and the strings they point to.
+ */
+typedef struct PgOrphSnapshot
+{
+	Size		size;			/* of the whole snapshot */
+	TimestampTz scanned_at;
+	Oid			dboid;
+	int			ntablespaces;
+	int			norphans;
+	Size		tablespaces_off;
+	Size		orphans_off;
+	Size		strings_off;
+	Size		dbname_off;
+} PgOrphSnapshot;
+
+typedef struct PgOrphTablespaceTotal
+{
+	Oid			reltablespace;
+	int64		files;
+	int64		size;
+} PgOrphTablespaceTotal;
+
+typedef struct PgOrphCachedRelation
+{
+	int64		size;
+	TimestampTz mod_time;
+	Oid			relfilenode;
+	Oid			reloid;
+	Size		path_off;
+	Size		name_off;
+} PgOrphCachedRelation;
+
+static PgOrphSharedState *pgorph_shared = NULL;
+static dsa_area *pgorph_area = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static void
+pgorph_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(PgOrphSharedState)));
+	RequestNamedLWLockTranche("pg_orphaned", 1);
+}
+
+static void
+pgorph_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pgorph_shared = ShmemInitStruct("pg_orphaned",
+									sizeof(PgOrphSharedState),
+									&found);
+	if (!found)
+	{
+		pgorph_shared->lock = &(GetNamedLWLockTranche("pg_orphaned"))->lock;
+#if PG_VERSION_NUM >= 190000
+		pgorph_shared->dsa_tranche = LWLockNewTrancheId("pg_orphaned_dsa");
+#else
+		pgorph_shared->dsa_tranche = LWLockNewTrancheId();
+#endif
+		pgorph_shared->dsa_created = false;
+		pgorph_shared->snapshot = InvalidDsaPointer;
+#ifdef PGORPH_SHARED_CACHE
+		{
+			int			i;
+
+#if PG_VERSION_NUM >= 190000
+			pgorph_shared->cache_tranche = LWLockNewTrancheId("pg_orphaned_cache");
+#else
+			pgorph_shared->cache_tranche = LWLockNewTrancheId();
+#endif
+			pgorph_shared->cache_created = false;
+			pg_atomic_init_u64(&pgorph_shared->inval_reset, 0);
+			pg_atomic_init_u64(&pgorph_shared->inval_any, 0);
+			pg_atomic_init_u32(&pgorph_shared->cache_entries, 0);
+			for (i = 0; i < PGORPH_INVAL_SLOTS; i++)
+				pg_atomic_init_u64(&pgorph_shared->inval_relid[i], 0);
+		}
+#endif
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+static void
+pgorph_require_shared_state(void)
+{
+	if (pgorph_shared == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			errmsg("pg_orphaned must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * Attach to the dynamic shared memory area, creating it if needed.
+ * Must be called with the lock held, exclusively if create is true.
+ * Returns NULL if the area does not exist yet and create is false.
+ */
+static dsa_area *
+pgorph_attach_area(bool create)
+{
+	MemoryContext oldcontext;
+
+	if (pgorph_area != NULL)
+		return pgorph_area;
+
+	if (!pgorph_shared->dsa_created && !create)
+		return NULL;
+
+#if PG_VERSION_NUM < 190000
+	LWLockRegisterTranche(pgorph_shared->dsa_tranche, "pg_orphaned_dsa");
+#endif
+
+	/* the mapping is kept for the life of the session */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	if (!pgorph_shared->dsa_created)
+	{
+		pgorph_area = dsa_create(pgorph_shared->dsa_tranche);
+		dsa_pin(pgorph_area);
+		pgorph_shared->dsa = dsa_get_handle(pgorph_area);
+		pgorph_shared->dsa_created = true;
+	}
+	else
+		pgorph_area = dsa_attach(pgorph_shared->dsa);
+	dsa_pin_mapping(pgorph_area);
+	MemoryContextSwitchTo(oldcontext);
+
+	return pgorph_area;
+}
+
+#ifdef PGORPH_SHARED_CACHE
+static dshash_table *pgorph_cache_table = NULL;
+
+static const dshash_parameters pgorph_cache_params = {
+	sizeof(PgOrphSharedCacheKey),
+	sizeof(PgOrphSharedCacheEntry),
+	dshash_memcmp,
+	dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+	dshash_memcpy,
+#endif
+	0							/* set at attach time */
+};
+
+/*
+ * Attach to the shared relfilenode cache, creating it if needed.
+ * Returns NULL if the shared cache is not enabled or not available.
+ */
+static dshash_table *
+pgorph_attach_cache(void)
+{
+	dshash_parameters params;
+	dsa_area   *area;
+	MemoryContext oldcontext;
+
+	if (!pgorph_shared_cache || pgorph_shared == NULL)
+		return NULL;
+
+	if (pgorph_cache_table != NULL)
+		return pgorph_cache_table;
+
+	params = pgorph_cache_params;
+	params.tranche_id = pgorph_shared->cache_tranche;
+#if PG_VERSION_NUM < 190000
+	LWLockRegisterTranche(pgorph_shared->cache_tranche, "pg_orphaned_cache");
+#endif
+
+	/* the attachment is kept for the life of the session */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockAcquire(pgorph_shared->lock, LW_EXCLUSIVE);
+	area = pgorph_attach_area(true);
+	if (!pgorph_shared->cache_created)
+	{
+		pgorph_cache_table = dshash_create(area, &params, NULL);
+		pgorph_shared->cache = dshash_get_hash_table_handle(pgorph_cache_table);
+		pgorph_shared->cache_created = true;
+	}
+	else
+		pgorph_cache_table = dshash_attach(area, &params, pgorph_shared->cache, NULL);
+	LWLockRelease(pgorph_shared->lock);
+	MemoryContextSwitchTo(oldcontext);
+
+	return pgorph_cache_table;
+}
+
+static void
+pgorph_shared_cache_key(PgOrphSharedCacheKey *key, Oid reltablespace, Oid relfilenode)
+{
+	MemSet(key, 0, sizeof(PgOrphSharedCacheKey));
+	key->dboid = MyDatabaseId;
+	key->key.reltablespace = reltablespace;
+	key->key.relfilenode = relfilenode;
+}
+
+/* true if no invalidation outdated the entry since it has been added */
+static bool
+pgorph_shared_cache_valid(PgOrphSharedCacheEntry *entry)
+{
+	return entry->reset_gen == pg_atomic_read_u64(&pgorph_shared->inval_reset) &&
+		entry->relid_gen == pg_atomic_read_u64(&pgorph_shared->inval_relid[entry->relid % PGORPH_INVAL_SLOTS]);
+}
+
+/*
+ * make room in a full table, returns true if there is some
+ */
+static bool
+pgorph_shared_cache_evict(dshash_table *table)
+{
+#if PG_VERSION_NUM >= 150000
+	dshash_seq_status status;
+	PgOrphSharedCacheEntry *entry;
+	uint32		target = pgorph_shared_cache_max_entries -
+		pgorph_shared_cache_max_entries / 8;
+	int			pass;
+
+	/* one sweep at a time, the others do without adding entries */
+	if (!LWLockConditionalAcquire(pgorph_shared->lock, LW_EXCLUSIVE))
+		return false;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		dshash_seq_init(&status, table, true);
+		while ((entry = dshash_seq_next(&status)) != NULL)
+		{
+			if (pass == 0 && pgorph_shared_cache_valid(entry))
+				continue;
+
+			dshash_delete_current(&status);
+			pgorph_stats.shared_cache_evictions++;
+			if (pg_atomic_sub_fetch_u32(&pgorph_shared->cache_entries, 1) < target &&
+				pass > 0)
+				break;
+		}
+		dshash_seq_term(&status);
+
+		if (pg_atomic_read_u32(&pgorph_shared->cache_entries) < target)
+			break;
+	}
+
+	LWLockRelease(pgorph_shared->lock);
+
+	return pg_atomic_read_u32(&pgorph_shared->cache_entries) <
+		(uint32) pgorph_shared_cache_max_entries;
+#else
+	return false;
+#endif
+}
+
+/*
+ * look for a still valid entry, removing it if it is stale
+ */
+static bool
+pgorph_shared_cache_lookup(Oid reltablespace, Oid relfilenode, Oid *relid)
+{
+	dshash_table *table = pgorph_attach_cache();
+	PgOrphSharedCacheKey key;
+	PgOrphSharedCacheEntry *entry;
+	bool		valid;
+
+	if (table == NULL)
+		return false;
+
+	pgorph_shared_cache_key(&key, reltablespace, relfilenode);
+	entry = dshash_find(table, &key, false);
+	if (entry == NULL)
+		return false;
+
+	valid = pgorph_shared_cache_valid(entry);
+	*relid = entry->relid;
+	dshash_release_lock(table, entry);
+
+	if (!valid)
+	{
+		if (dshash_delete_key(table, &key))
+			pg_atomic_fetch_sub_u32(&pgorph_shared->cache_entries, 1);
+		return false;
+	}
+
+	pgorph_stats.shared_cache_hits++;
+	return true;
+}
+
+static bool
+pgorph_shared_cache_stamp(PgOrphCacheStamp *stamp)
+{
+	if (pgorph_attach_cache() == NULL)
+		return false;
+
+	stamp->reset_gen = pg_atomic_read_u64(&pgorph_shared->inval_reset);
+	stamp->any_gen = pg_atomic_read_u64(&pgorph_shared->inval_any);
+	pg_read_barrier();
+	return true;
+}
+
+/*
+ * The generation of the slot of relid is read before checking that no
+ * invalidation at all has been processed since the probe began: as the
+ * callback bumps inval_any first, the generation read is then the one the
+ * probe saw.
+ */
+static void
+pgorph_shared_cache_insert(Oid reltablespace, Oid relfilenode, Oid relid,
+						   PgOrphCacheStamp *stamp)
+{
+	dshash_table *table = pgorph_attach_cache();
+	PgOrphSharedCacheKey key;
+	PgOrphSharedCacheEntry *entry;
+	uint64		relid_gen;
+	bool		found;
+
+	relid_gen = pg_atomic_read_u64(&pgorph_shared->inval_relid[relid % PGORPH_INVAL_SLOTS]);
+	pg_read_barrier();
+	if (pg_atomic_read_u64(&pgorph_shared->inval_any) != stamp->any_gen)
+		return;
+
+	pgorph_shared_cache_key(&key, reltablespace, relfilenode);
+
+	/* full, only an existing entry can be refreshed */
+	if (pg_atomic_read_u32(&pgorph_shared->cache_entries) >=
+		(uint32) pgorph_shared_cache_max_entries &&
+		!pgorph_shared_cache_evict(table))
+	{
+		entry = dshash_find(table, &key, true);
+		if (entry == NULL)
+			return;
+	}
+	else
+	{
+		entry = dshash_find_or_insert(table, &key, &found);
+		if (!found)
+			pg_atomic_fetch_add_u32(&pgorph_shared->cache_entries, 1);
+	}
+	entry->relid = relid;
+	entry->reset_gen = stamp->reset_gen;
+	entry->relid_gen = relid_gen;
+	dshash_release_lock(table, entry);
+}
+
+/*
+ * registered in every backend when preloaded: called for each relcache
+ * invalidation processed, it must not do more than bumping counters
+ */
+static void
+pgorph_shared_cache_inval(Datum arg, Oid relid)
+{
+	if (pgorph_shared == NULL)
+		return;
+
+	pg_atomic_fetch_add_u64(&pgorph_shared->inval_any, 1);
+	if (OidIsValid(relid))
+		pg_atomic_fetch_add_u64(&pgorph_shared->inval_relid[relid % PGORPH_INVAL_SLOTS], 1);
+	else
+		pg_atomic_fetch_add_u64(&pgorph_shared->inval_reset, 1);
+}
+#endif
+
+/*
+ * the tablespace of an orphaned file, from its path
+ */
+static Oid
+pgorph_path_tablespace(const char *path)
+{
+	if (strncmp(path, "pg_tblspc/", 10) == 0)
+		return (Oid) strtoul(path + 10, NULL, 10);
+
+	return DEFAULTTABLESPACE_OID;
+}
+
+/*
+ * Publish the orphaned files found by the background scanner in the
+ * shared memory area, replacing the previous snapshot.
+ */
+static void
+pgorph_publish_snapshot(List *orphans, const char *dbname, TimestampTz scanned_at)
+{
+	dsa_area   *area;
+	dsa_pointer dp;
+	dsa_pointer old;
+	PgOrphSnapshot *snap;
+	PgOrphTablespaceTotal *totals;
+	PgOrphCachedRelation *cached;
+	char	   *strings;
+	Size		strings_size = strlen(dbname) + 1;
+	Size		size;
+	Size		off;
+	int			norphans = list_length(orphans);
+	int			ntablespaces = 0;
+	ListCell   *cell;
+	int			i;
+
+	foreach(cell, orphans)
+	{
+		OrphanedRelation *orph = (OrphanedRelation *) lfirst(cell);
 
-	for (i = 0; i < 2; i++)
+		strings_size += strlen(orph->path) + 1 + strlen(orph->name) + 1;
+	}
+
+	LWLockAcquire(pgorph_shared->lock, LW_EXCLUSIVE);
+
+	area = pgorph_attach_area(true);
+
+	/* at most one total per orphaned file */
+	off = MAXALIGN(sizeof(PgOrphSnapshot));
+	size = off +
+		MAXALIGN(sizeof(PgOrphTablespaceTotal) * norphans) +
+		MAXALIGN(sizeof(PgOrphCachedRelation) * norphans) +
+		strings_size;
+	dp = dsa_allocate_extended(area, size, DSA_ALLOC_HUGE | DSA_ALLOC_ZERO);
+	snap = (PgOrphSnapshot *) dsa_get_address(area, dp);
+
+	snap->size = size;
+	snap->scanned_at = scanned_at;
+	snap->dboid = MyDatabaseId;
+	snap->norphans = norphans;
+	snap->tablespaces_off = off;
+	snap->orphans_off = off + MAXALIGN(sizeof(PgOrphTablespaceTotal) * norphans);
+	snap->strings_off = snap->orphans_off + MAXALIGN(sizeof(PgOrphCachedRelation) * norphans);
+
+	totals = (PgOrphTablespaceTotal *) ((char *) snap + snap->tablespaces_off);
+	cached = (PgOrphCachedRelation *) ((char *) snap + snap->orphans_off);
+	strings = (char *) snap + snap->strings_off;
+
+	off = 0;
+	snap->dbname_off = off;
+	strcpy(strings + off, dbname);
+	off += strlen(dbname) + 1;
+
+	i = 0;
+	foreach(cell, orphans)
 	{
-		fmgr_info_cxt(F_OIDEQ,
-					&relfilenode_skey_dirty[i].sk_func,
-					CacheMemoryContext);
-		relfilenode_skey_dirty[i].sk_strategy = BTEqualStrategyNumber;
-		relfilenode_skey_dirty[i].sk_subtype = InvalidOid;
-		relfilenode_skey_dirty[i].sk_collation = InvalidOid;
+		OrphanedRelation *orph = (OrphanedRelation *) lfirst(cell);
+		Oid			reltablespace = pgorph_path_tablespace(orph->path);
+		int			t;
+
+		cached[i].size = orph->size;
+		cached[i].mod_time = orph->mod_time;
+		cached[i].relfilenode = orph->relfilenode;
+		cached[i].reloid = orph->reloid;
+		cached[i].path_off = off;
+		strcpy(strings + off, orph->path);
+		off += strlen(orph->path) + 1;
+		cached[i].name_off = off;
+		strcpy(strings + off, orph->name);
+		off += strlen(orph->name) + 1;
+		i++;
+
+		for (t = 0; t < ntablespaces; t++)
+			if (totals[t].reltablespace == reltablespace)
+				break;
+		if (t == ntablespaces)
+		{
+			totals[t].reltablespace = reltablespace;
+			ntablespaces++;
+		}
+		totals[t].files++;
+		totals[t].size += orph->size;
 	}
+	snap->ntablespaces = ntablespaces;
 
-	relfilenode_skey_dirty[0].sk_attno = Anum_pg_class_reltablespace;
-	relfilenode_skey_dirty[1].sk_attno = Anum_pg_class_relfilenode;
+	old = pgorph_shared->snapshot;
+	pgorph_shared->snapshot = dp;
+	if (DsaPointerIsValid(old))
+		dsa_free(area, old);
 
-	/* Initialize the hash table. */
-	MemSet(&ctl, 0, sizeof(ctl));
-	ctl.keysize = sizeof(RelfilenodeMapKeyDirty);
-	ctl.entrysize = sizeof(RelfilenodeMapEntryDirty);
-	ctl.hcxt = CacheMemoryContext;
+	LWLockRelease(pgorph_shared->lock);
+}
 
-	/*
-	 * Only create the RelfilenodeMapHashDirty now, so we don't end up partially
-	 * initialized when fmgr_info_cxt() above ERRORs out with an out of memory
-	 * error.
-	 * Note that the hash table is not created in shared memory but in
-	 * private memory.
-	 */
-	RelfilenodeMapHashDirty =
-		hash_create("RelfilenodeMap cache", 64, &ctl,
-			HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+static volatile sig_atomic_t pgorph_got_sighup = false;
 
-	/* Watch for invalidation events. */
-	CacheRegisterRelcacheCallback(RelfilenodeMapInvalidateCallbackDirty,
-									(Datum) 0);
+static void
+pgorph_daemon_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	pgorph_got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Oid of the database named dbname, or InvalidOid if it does not exist
+ * or does not accept connections.  Only needs a connection to the shared
+ * catalogs.
+ */
+static Oid
+pgorph_database_oid(const char *dbname)
+{
+	Relation	relation;
+	SysScanDesc scandesc;
+	ScanKeyData key;
+	HeapTuple	tup;
+	Oid			dboid = InvalidOid;
+
+#if PG_VERSION_NUM >= 120000
+	relation = table_open(DatabaseRelationId, AccessShareLock);
+#else
+	relation = heap_open(DatabaseRelationId, AccessShareLock);
+#endif
+	ScanKeyInit(&key,
+				Anum_pg_database_datname,
+				BTEqualStrategyNumber, F_NAMEEQ,
+				CStringGetDatum(dbname));
+	scandesc = systable_beginscan(relation, DatabaseNameIndexId, true,
+								  NULL, 1, &key);
+
+	tup = systable_getnext(scandesc);
+	if (HeapTupleIsValid(tup))
+	{
+		Form_pg_database dbform = (Form_pg_database) GETSTRUCT(tup);
+
+		/* -2 is the datconnlimit of an invalid database */
+		if (dbform->datallowconn && dbform->datconnlimit != -2)
+#if PG_VERSION_NUM >= 120000
+			dboid = dbform->oid;
+#else
+			dboid = HeapTupleGetOid(tup);
+#endif
+	}
+
+	systable_endscan(scandesc);
+#if PG_VERSION_NUM >= 120000
+	table_close(relation, AccessShareLock);
+#else
+	heap_close(relation, AccessShareLock);
+#endif
+
+	return dboid;
+}
+
+/* seconds before the launcher, and the scanner with it, is restarted */
+#define PGORPH_LAUNCHER_RESTART 60
+
+static BackgroundWorkerHandle *pgorph_scanner_handle = NULL;
+
+/* stop the scanner along with the launcher */
+static void
+pgorph_launcher_shutdown(int code, Datum arg)
+{
+	if (pgorph_scanner_handle != NULL)
+		TerminateBackgroundWorker(pgorph_scanner_handle);
+}
+
+/*
+ * Entry point of the background scanner launcher
+ *
+ * Connecting a worker to a missing database fails with a FATAL error
+ * that the postmaster would retry forever, so the launcher only connects
+ * to the shared catalogs, checks pg_orphaned.scan_database and, if it
+ * can be connected to, starts the scanner itself as a dynamic worker.
+ * When the scanner stops the launcher exits with an error so that it is
+ * restarted, and rechecks the database, bgw_restart_time later.
+ */
+void
+pgorph_launcher_main(Datum main_arg)
+{
+	BackgroundWorker worker;
+	BgwHandleStatus status;
+	Oid			dboid;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+#else
+	BackgroundWorkerInitializeConnection(NULL, NULL);
+#endif
+
+	StartTransactionCommand();
+	dboid = pgorph_database_oid(pgorph_scan_database);
+	CommitTransactionCommand();
+
+	if (!OidIsValid(dboid))
+	{
+		ereport(LOG,
+				(errmsg("pg_orphaned scanner not started: database \"%s\" does not exist or does not accept connections",
+						pgorph_scan_database),
+				 errhint("Set pg_orphaned.scan_database to an existing database and restart the server.")));
+		/* exit code 0 unregisters the worker */
+		proc_exit(0);
+	}
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_orphaned");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgorph_daemon_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_orphaned scanner");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_orphaned scanner");
+#endif
+	worker.bgw_main_arg = ObjectIdGetDatum(dboid);
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &pgorph_scanner_handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not register background process"),
+				 errhint("You may need to increase max_worker_processes.")));
+
+	before_shmem_exit(pgorph_launcher_shutdown, (Datum) 0);
+
+	status = WaitForBackgroundWorkerShutdown(pgorph_scanner_handle);
+	pgorph_scanner_handle = NULL;
+
+	if (status == BGWH_POSTMASTER_DIED)
+		proc_exit(1);
+
+	ereport(LOG,
+			(errmsg("pg_orphaned scanner stopped, restarting it in %d seconds",
+					PGORPH_LAUNCHER_RESTART)));
+	proc_exit(1);
+}
+
+/*
+ * Entry point of the background scanner, started by the launcher with
+ * the oid of the database to scan
+ */
+void
+pgorph_daemon_main(Datum main_arg)
+{
+	TimestampTz last_scan = 0;
+
+	pqsignal(SIGHUP, pgorph_daemon_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(DatumGetObjectId(main_arg), InvalidOid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(DatumGetObjectId(main_arg), InvalidOid);
+#endif
+
+	for (;;)
+	{
+		long		timeout = -1;
+		int			rc;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (pgorph_got_sighup)
+		{
+			pgorph_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (pgorph_scan_interval > 0)
+		{
+			TimestampTz now = GetCurrentTimestamp();
+			TimestampTz next_scan = last_scan + (int64) pgorph_scan_interval * USECS_PER_SEC;
+
+			if (last_scan == 0 || now >= next_scan)
+			{
+				const char *dbname;
+				PgOrphSink	sink;
+
+				SetCurrentStatementStartTimestamp();
+				StartTransactionCommand();
+				pgstat_report_activity(STATE_RUNNING, "scanning for orphaned files");
+				pgorph_progress_start(PGORPH_COMMAND_DAEMON);
+
+				last_scan = GetCurrentTimestamp();
+				dbname = get_database_name(MyDatabaseId);
+				pgorph_list_sink_init(&sink);
+				pg_build_orphaned_list(MyDatabaseId, false, &sink);
+				pgorph_publish_snapshot(sink.list, dbname, last_scan);
+				MemoryContextDelete(sink.cxt);
+				pgorph_progress_end();
+
+				CommitTransactionCommand();
+				pgstat_report_activity(STATE_IDLE, NULL);
+
+				now = GetCurrentTimestamp();
+				next_scan = last_scan + (int64) pgorph_scan_interval * USECS_PER_SEC;
+			}
+
+			timeout = Max((next_scan - now) / 1000, 1);
+		}
+
+		rc = WaitLatch(MyLatch,
+					   PGORPH_WL_FLAGS | (timeout >= 0 ? WL_TIMEOUT : 0),
+					   timeout, pgorph_wait_event(PGORPH_WAIT_SCANNER_IDLE));
+#if PG_VERSION_NUM < 120000
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+#else
+		(void) rc;
+#endif
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * set up the shared memory and, unless pg_orphaned.scan_interval is 0,
+ * the background scanner when loaded with shared_preload_libraries
+ */
+static void
+pgorph_init_daemon(void)
+{
+	BackgroundWorker worker;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pgorph_shmem_request;
+#else
+	pgorph_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pgorph_shmem_startup;
+
+	if (pgorph_scan_interval == 0)
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = PGORPH_LAUNCHER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_orphaned");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgorph_launcher_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_orphaned launcher");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_orphaned launcher");
+#endif
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Local copy of the last published snapshot, or NULL if there is none,
+ * so that the lock is not held while the rows are built.
+ */
+static PgOrphSnapshot *
+pgorph_copy_snapshot(void)
+{
+	PgOrphSnapshot *copy = NULL;
+	dsa_area   *area;
+
+	LWLockAcquire(pgorph_shared->lock, LW_SHARED);
+
+	area = pgorph_attach_area(false);
+	if (area != NULL && DsaPointerIsValid(pgorph_shared->snapshot))
+	{
+		PgOrphSnapshot *snap = dsa_get_address(area, pgorph_shared->snapshot);
+
+		copy = palloc_extended(snap->size, MCXT_ALLOC_HUGE);
+		memcpy(copy, snap, snap->size);
+	}
+
+	LWLockRelease(pgorph_shared->lock);
+
+	return copy;
+}
+
+/*
+ * function to list the orphaned files found
+ * by the last run of the background scanner
+ */
+Datum
+pg_orphaned_cached(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	TimestampTz now = GetCurrentTimestamp();
+	PgOrphSnapshot *snap;
+
+	requireSuperuser();
+	pgorph_require_shared_state();
+
+	if (PG_ARGISNULL(0))
+		limitts = now - ((3600000 * 24) * (int64) 1000); // 1 Day
+	else
+		limitts = DatumGetTimestamp(DirectFunctionCall2(timestamp_mi_interval, TimestampGetDatum(now), IntervalPGetDatum(PG_GETARG_INTERVAL_P(0))));
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	snap = pgorph_copy_snapshot();
+	if (snap != NULL)
+	{
+		PgOrphCachedRelation *cached = (PgOrphCachedRelation *) ((char *) snap + snap->orphans_off);
+		char	   *strings = (char *) snap + snap->strings_off;
+		Datum		age;
+		int			i;
+
+		age = DirectFunctionCall2(timestamp_mi,
+								  TimestampTzGetDatum(now),
+								  TimestampTzGetDatum(snap->scanned_at));
+
+		for (i = 0; i < snap->norphans; i++)
+		{
+			Datum           values[10];
+			bool            nulls[10];
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[0] = CStringGetTextDatum(strings + snap->dbname_off);
+			values[1] = CStringGetTextDatum(strings + cached[i].path_off);
+			values[2] = CStringGetTextDatum(strings + cached[i].name_off);
+			values[3] = Int64GetDatum(cached[i].size);
+			values[4] = TimestampTzGetDatum(cached[i].mod_time);
+			values[5] = Int64GetDatum(cached[i].relfilenode);
+			values[6] = Int64GetDatum(cached[i].reloid);
+			values[7] = BoolGetDatum(cached[i].mod_time <= limitts);
+			values[8] = TimestampTzGetDatum(snap->scanned_at);
+			values[9] = age;
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * function to get the per tablespace totals
+ * of the last run of the background scanner
+ */
+Datum
+pg_orphaned_cached_tablespaces(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	TimestampTz now = GetCurrentTimestamp();
+	PgOrphSnapshot *snap;
+
+	requireSuperuser();
+	pgorph_require_shared_state();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	snap = pgorph_copy_snapshot();
+	if (snap != NULL)
+	{
+		PgOrphTablespaceTotal *totals = (PgOrphTablespaceTotal *) ((char *) snap + snap->tablespaces_off);
+		char	   *strings = (char *) snap + snap->strings_off;
+		Datum		age;
+		int			i;
+
+		age = DirectFunctionCall2(timestamp_mi,
+								  TimestampTzGetDatum(now),
+								  TimestampTzGetDatum(snap->scanned_at));
+
+		for (i = 0; i < snap->ntablespaces; i++)
+		{
+			Datum           values[6];
+			bool            nulls[6];
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[0] = CStringGetTextDatum(strings + snap->dbname_off);
+			values[1] = ObjectIdGetDatum(totals[i].reltablespace);
+			values[2] = Int64GetDatum(totals[i].files);
+			values[3] = Int64GetDatum(totals[i].size);
+			values[4] = TimestampTzGetDatum(snap->scanned_at);
+			values[5] = age;
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * statistics of the last scan run by this backend
+ */
+Datum
+pg_orphaned_last_scan_stats(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	int			i;
+
+	requireSuperuser();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < lengthof(pgorph_stats_fields); i++)
+	{
+		Datum           values[2];
+		bool            nulls[2];
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(pgorph_stats_fields[i].name);
+		values[1] = Int64GetDatum(*(int64 *) ((char *) &pgorph_stats + pgorph_stats_fields[i].offset));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * progress of the pg_orphaned functions running in the backends
+ */
+Datum
+pg_orphaned_progress_info(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	int			num_backends;
+	int			curr_backend;
+
+	requireSuperuser();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	num_backends = pgstat_fetch_stat_numbackends();
+	for (curr_backend = 1; curr_backend <= num_backends; curr_backend++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+		int64		command;
+		int64		phase;
+		Datum           values[10];
+		bool            nulls[10];
+
+#if PG_VERSION_NUM >= 170000
+		local_beentry = pgstat_get_local_beentry_by_index(curr_backend);
+#else
+		local_beentry = pgstat_fetch_stat_local_beentry(curr_backend);
+#endif
+		if (local_beentry == NULL)
+			continue;
+		beentry = &local_beentry->backendStatus;
+
+		/* set by the statement running in the backend */
+		if (beentry->st_progress_command != PROGRESS_COMMAND_INVALID ||
+			beentry->st_progress_param[PGORPH_PROGRESS_MARKER] == 0 ||
+			beentry->st_progress_param[PGORPH_PROGRESS_MARKER] != (int64) beentry->st_activity_start_timestamp)
+			continue;
+
+		command = beentry->st_progress_param[PGORPH_PROGRESS_COMMAND];
+		phase = beentry->st_progress_param[PGORPH_PROGRESS_PHASE];
+		if (command <= 0 || command >= lengthof(pgorph_progress_commands) ||
+			phase < 0 || phase >= lengthof(pgorph_progress_phases))
+			continue;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = Int32GetDatum(beentry->st_procpid);
+		values[1] = ObjectIdGetDatum(beentry->st_databaseid);
+		values[2] = CStringGetTextDatum(pgorph_progress_commands[command]);
+		values[3] = CStringGetTextDatum(pgorph_progress_phases[phase]);
+		if (phase == PGORPH_PHASE_SCANNING || phase == PGORPH_PHASE_MOVING)
+			values[4] = ObjectIdGetDatum((Oid) beentry->st_progress_param[PGORPH_PROGRESS_TABLESPACE]);
+		else
+			nulls[4] = true;
+		values[5] = Int64GetDatum(beentry->st_progress_param[PGORPH_PROGRESS_DIRS_DONE]);
+		values[6] = Int64GetDatum(beentry->st_progress_param[PGORPH_PROGRESS_DIRS_TOTAL]);
+		values[7] = Int64GetDatum(beentry->st_progress_param[PGORPH_PROGRESS_FILES]);
+		values[8] = Int64GetDatum(beentry->st_progress_param[PGORPH_PROGRESS_ORPHANED]);
+		values[9] = Int64GetDatum(beentry->st_progress_param[PGORPH_PROGRESS_BYTES]);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * statistics of the last scan run by this backend, per tablespace
+ */
+Datum
+pg_orphaned_last_scan_tablespaces(PG_FUNCTION_ARGS)
+{
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	int			i;
+
+	requireSuperuser();
+
+	tupstore = pgorph_begin_srf(fcinfo, &tupdesc);
+
+	for (i = 0; i < pgorph_ts_nstats; i++)
+	{
+		PgOrphTablespaceScanStats *tstats = &pgorph_ts_stats[i];
+		Datum           values[7];
+		bool            nulls[7];
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(tstats->reltablespace);
+		values[1] = Int64GetDatum(tstats->directories);
+		values[2] = Int64GetDatum(tstats->entries);
+		values[3] = Int64GetDatum(tstats->files);
+		values[4] = Int64GetDatum(tstats->orphaned);
+		values[5] = Int64GetDatum(tstats->orphaned_size);
+		values[6] = Int64GetDatum(tstats->elapsed_time);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+void
+_PG_init(void)
+{
+	DefineCustomEnumVariable("pg_orphaned.catalog_lookup",
+							 "Sets how the relfilenodes found on disk are checked against pg_class.",
+							 "probe does one index lookup per file, bulk loads pg_class in one pass, "
+							 "auto switches from probe to bulk depending on the pg_class size.",
+							 &pgorph_lookup_mode,
+							 PGORPH_LOOKUP_AUTO,
+							 pgorph_lookup_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_orphaned.parallel_scan",
+							 "Scans the directories with background workers.",
+							 "tablespace launches one worker per tablespace, device one worker "
+							 "per device hosting the directories to scan.",
+							 &pgorph_parallel_mode,
+							 PGORPH_PARALLEL_OFF,
+							 pgorph_parallel_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_orphaned.max_parallel_workers",
+							"Maximum number of background workers used by a parallel scan.",
+							NULL,
+							&pgorph_max_parallel_workers,
+							4,
+							0,
+							PGORPH_MAX_PARALLEL_WORKERS,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_orphaned.stat_method",
+							 "Sets how the orphaned file candidates are stat'ed.",
+							 "sync stats them one after the other, io_uring submits a batch "
+							 "of statx at once (only available when built with liburing).",
+							 &pgorph_stat_method,
+							 pgorph_stat_method,
+							 pgorph_stat_method_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_orphaned.remove_rate_limit",
+							"Maximum rate at which pg_remove_moved_orphaned() frees disk space.",
+							"0 removes the files without sleeping.",
+							&pgorph_remove_rate_limit,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_orphaned.remove_truncate_step",
+							"Size by which pg_remove_moved_orphaned() shrinks a file before unlinking it.",
+							"0 unlinks the files without truncating them first.",
+							&pgorph_remove_truncate_step,
+							64,
+							0,
+							INT_MAX / 1024,
+							PGC_SUSET,
+							GUC_UNIT_MB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_orphaned.shared_cache",
+							 "Shares the relfilenodes found in pg_class between the backends.",
+							 "Only available when loaded via shared_preload_libraries.",
+							 &pgorph_shared_cache,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_orphaned.shared_cache_max_entries",
+							"Maximum number of entries of the shared relfilenode cache.",
+							NULL,
+							&pgorph_shared_cache_max_entries,
+							1000000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_orphaned.incremental",
+							 "Rescans only the directories and files that changed since the previous scan.",
+							 "The state of the scanned directories is kept for the session.",
+							 &pgorph_incremental,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_orphaned.spill_files",
+							 "Also reports the temporary files left behind by the backends that are gone.",
+							 "The pgsql_tmp directories of the default tablespace and of the other tablespaces are scanned too, by the scans of pg_orphaned.spill_files_database.",
+							 &pgorph_spill_files,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_orphaned.spill_files_database",
+							   "Database reporting the temporary files of pg_orphaned.spill_files.",
+							   "These files are not tied to a database, the scans of the other databases skip them.",
+							   &pgorph_spill_files_database,
+							   "postgres",
+							   PGC_SUSET,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_orphaned.scan_interval",
+							"Interval between two runs of the background scanner.",
+							"0 at server start does not start the background scanner.",
+							&pgorph_scan_interval,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_orphaned.scan_database",
+							   "Database scanned by the background scanner.",
+							   NULL,
+							   &pgorph_scan_database,
+							   "postgres",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("pg_orphaned");
+#else
+	EmitWarningsOnPlaceholders("pg_orphaned");
+#endif
+
+	RegisterXactCallback(pgorph_xact_callback, NULL);
+	RegisterSubXactCallback(pgorph_subxact_callback, NULL);
+
+	if (process_shared_preload_libraries_in_progress)
+	{
+		pgorph_init_daemon();
+#ifdef PGORPH_SHARED_CACHE
+		/* inherited by every backend */
+		CacheRegisterRelcacheCallback(pgorph_shared_cache_inval, (Datum) 0);
+#endif
+	}
 }
 
 static bool